@@ -0,0 +1,256 @@
+// Microbenchmarks for the calendar code, the attendance rollups and the
+// scheduler's timer wheel.
+//
+//	build/telegram-bot-bench [filter] [--rows N] [--mysql CONNECTION]
+//
+// Prints ns/op, allocs/op and bytes/op per case; filter is a substring of
+// the case name. --rows sets how many attendance rows the stats cases load.
+// --mysql runs them against a MySQL server as well, for example
+// "host=localhost;port=3306;db=bench;user=bench;password=bench".
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+#include "alloc_counter.hh"
+#include "calendar.hh"
+#include "log_storage.hh"
+#include "metrics.hh"
+#include "mysql_storage.hh"
+#include "timer_wheel.hh"
+
+namespace {
+
+using Clock = ::std::chrono::steady_clock;
+
+constexpr auto MIN_TIME = ::std::chrono::milliseconds{200};
+
+char const* g_filter{};
+
+template<typename T>
+void Keep(T const& value)
+{
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Doubles the iteration count until one run takes MIN_TIME, then reports
+// that run.
+template<typename F>
+void Bench(char const* name, F&& f)
+{
+	if (g_filter && !::std::strstr(name, g_filter)) {
+		return;
+	}
+	for (::std::uint64_t n = 1;; n *= 2) {
+		auto allocs = AllocCounter::Get();
+		auto start = Clock::now();
+		for (::std::uint64_t i = 0; i < n; ++i) {
+			f();
+		}
+		auto elapsed = Clock::now() - start;
+		if (elapsed < MIN_TIME) {
+			continue;
+		}
+		allocs = AllocCounter::Get() - allocs;
+		auto ns = ::std::chrono::duration<double, ::std::nano>(elapsed).count();
+		::std::printf("%-32s %12.1f ns/op %8.2f allocs/op %10.1f B/op %10llu ops\n", name,
+				ns / n, static_cast<double>(allocs.allocs) / n, static_cast<double>(allocs.bytes) / n,
+				static_cast<unsigned long long>(n));
+		return;
+	}
+}
+
+void BenchCalendar()
+{
+	auto const today = Calendar::Date{2024, 5, 15};
+	auto const kb = Calendar::Keyboard{today};
+
+	Bench("Keyboard::GenerateGrid", [&]() {
+		auto grid = kb.GenerateGrid();
+		Keep(grid);
+	});
+
+	auto buffer = ::std::array<::std::byte, 4096>{};
+	auto arena = ::std::pmr::monotonic_buffer_resource{buffer.data(), buffer.size()};
+	Bench("Keyboard::GenerateGrid/arena", [&]() {
+		auto grid = kb.GenerateGrid(&arena);
+		Keep(grid);
+		arena.release();
+	});
+
+	auto const grid = kb.GenerateGrid();
+	auto days = ::std::pmr::vector<Calendar::DayView>(grid.size());
+	for (::std::size_t i = 0; i < days.size(); ++i) {
+		days[i].count = i % 4;
+	}
+	Bench("Calendar::RenderKeyboard", [&]() {
+		auto kb_dv = Calendar::RenderKeyboard(kb, grid, days, today);
+		Keep(kb_dv);
+	});
+
+	auto const ks = Calendar::CallbackData::Serialize(kb);
+	Bench("CallbackData::Serialize/kb", [&]() {
+		auto s = Calendar::CallbackData::Serialize(kb);
+		Keep(s);
+	});
+	auto key = Calendar::Key{Calendar::Key::Type::DAY};
+	key.data.date = today;
+	Bench("CallbackData::Serialize/key", [&]() {
+		auto s = Calendar::CallbackData::Serialize(ks, key);
+		Keep(s);
+	});
+
+	auto const data = Calendar::CallbackData::Serialize(ks, key);
+	Bench("CallbackData::Parse", [&]() {
+		auto cd = Calendar::CallbackData{};
+		auto ok = cd.Parse(data);
+		Keep(ok);
+		Keep(cd);
+	});
+
+	Bench("Date::From/string", [&]() {
+		auto date = Calendar::Date::From(::std::string_view{"2024.5.15"});
+		Keep(date);
+	});
+	Bench("Date::To/string", [&]() {
+		auto s = today.To<::std::string>();
+		Keep(s);
+	});
+}
+
+// Loads rows attendances spread over about three years, in batches the
+// size the journal commits.
+void LoadAttendances(Storage& storage, ::std::size_t rows)
+{
+	constexpr int DAYS = 3 * 365;
+	constexpr ::std::size_t BATCH = 4096;
+	auto const first_day = Calendar::Date{2022, 1, 1}.DayNumber();
+	auto batch = ::std::vector<Storage::Change>{};
+	batch.reserve(BATCH);
+	auto start = Clock::now();
+	for (::std::size_t i = 0; i < rows; ++i) {
+		auto user = static_cast<Storage::UserId>(i / DAYS);
+		batch.push_back({user, first_day + static_cast<int>(i % DAYS), false});
+		if (batch.size() == BATCH || i + 1 == rows) {
+			storage.ApplyAttendances(batch);
+			batch.clear();
+		}
+	}
+	::std::printf("loaded %zu rows in %.1f ms\n", rows,
+			::std::chrono::duration<double, ::std::milli>(Clock::now() - start).count());
+}
+
+// The /stats report over the rows loaded above.
+void BenchStats(char const* backend, Storage& storage)
+{
+	auto const last = 2024 * 12 + 11;
+	auto name = ::std::string{backend} + "::ReadStats/12m";
+	Bench(name.c_str(), [&]() {
+		auto stats = storage.ReadStats(last - 11, last);
+		Keep(stats);
+	});
+	name = ::std::string{backend} + "::ReadStats/36m";
+	Bench(name.c_str(), [&]() {
+		auto stats = storage.ReadStats(last - 35, last);
+		Keep(stats);
+	});
+}
+
+void BenchLogStorage(::std::size_t rows)
+{
+	if (g_filter && !::std::strstr("LogStorage::ReadStats", g_filter)) {
+		return;
+	}
+	char path[] = "/tmp/telegram-bot-bench-XXXXXX";
+	auto fd = ::mkstemp(path);
+	if (fd < 0) {
+		::std::perror("mkstemp");
+		return;
+	}
+	::close(fd);
+	::unlink(path);
+	{
+		auto storage = LogStorage{path};
+		LoadAttendances(storage, rows);
+		BenchStats("LogStorage", storage);
+	}
+	::unlink(path);
+}
+
+// The query the rollups exist for, on a real server. The rows are loaded
+// through ApplyAttendances, rollups and all, unless the database already
+// holds them from an earlier run; it should be a scratch database.
+void BenchMySqlStorage(char const* connection, ::std::size_t rows)
+{
+	if (!connection || (g_filter && !::std::strstr("MySqlStorage::ReadStats", g_filter))) {
+		return;
+	}
+	auto metrics = Metrics{};
+	auto storage = MySqlStorage{connection, MySqlStorage::PoolOptions{}, metrics};
+	if (storage.ReadStats(2022 * 12, 2024 * 12 + 11).users.empty()) {
+		LoadAttendances(storage, rows);
+	}
+	BenchStats("MySqlStorage", storage);
+}
+
+// Timers against a wheel already holding a day's worth of reminders at
+// 100 ms ticks.
+void BenchTimerWheel()
+{
+	constexpr int PENDING = 50000;
+	constexpr ::std::uint64_t DAY_TICKS = 864000;
+	auto wheel = TimerWheel<::std::uint64_t>{};
+	auto due = ::std::vector<::std::uint64_t>{};
+	auto seed = ::std::uint64_t{88172645463325252ull};
+	auto random = [&]() {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		return seed;
+	};
+	for (int i = 0; i < PENDING; ++i) {
+		wheel.Add(random() % DAY_TICKS, i);
+	}
+	Bench("TimerWheel::Add+Cancel", [&]() {
+		wheel.Cancel(wheel.Add(random() % DAY_TICKS, 0));
+	});
+	Bench("TimerWheel::Advance/tick", [&]() {
+		wheel.Advance(1, due);
+		// keep the wheel as full as it started
+		for (; !due.empty(); due.pop_back()) {
+			wheel.Add(DAY_TICKS, due.back());
+		}
+	});
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	auto rows = ::std::size_t{1} << 20;
+	char const* mysql{};
+	for (int i = 1; i < argc; ++i) {
+		if (!::std::strcmp(argv[i], "--rows") && i + 1 < argc) {
+			rows = ::std::strtoull(argv[++i], nullptr, 10);
+		} else if (!::std::strcmp(argv[i], "--mysql") && i + 1 < argc) {
+			mysql = argv[++i];
+		} else {
+			g_filter = argv[i];
+		}
+	}
+	BenchCalendar();
+	BenchLogStorage(rows);
+	BenchMySqlStorage(mysql, rows);
+	BenchTimerWheel();
+	return 0;
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,32 @@
+// libFuzzer target for CallbackData::Parse. Anything that parses must
+// survive a Serialize round trip unchanged.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+
+#include "calendar.hh"
+
+extern "C" int LLVMFuzzerTestOneInput(::std::uint8_t const* data, ::std::size_t size)
+{
+	auto input = ::std::string_view{reinterpret_cast<char const*>(data), size};
+	auto cd = Calendar::CallbackData{};
+	if (!cd.Parse(input)) {
+		return 0;
+	}
+	auto again = Calendar::CallbackData{};
+	auto s = Calendar::CallbackData::Serialize(Calendar::CallbackData::Serialize(cd.kb), cd.key);
+	if (!again.Parse(s)
+			|| !(again.kb.first_date.first == cd.kb.first_date.first)
+			|| again.kb.first_date.second != cd.kb.first_date.second
+			|| again.kb.mode != cd.kb.mode
+			|| again.kb.n_cols != cd.kb.n_cols
+			|| again.key.type != cd.key.type
+			|| (cd.key.type == Calendar::Key::Type::DAY && !(again.key.data.date == cd.key.data.date))) {
+		::std::abort();
+	}
+	return 0;
+}
+
+// vim: set ts=4 sw=4 noet :
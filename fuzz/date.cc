@@ -0,0 +1,25 @@
+// libFuzzer target for Date::From. A parsed date must print and parse
+// back to itself.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include "calendar.hh"
+
+extern "C" int LLVMFuzzerTestOneInput(::std::uint8_t const* data, ::std::size_t size)
+{
+	auto input = ::std::string_view{reinterpret_cast<char const*>(data), size};
+	auto date = Calendar::Date::From(input);
+	if (date == Calendar::Date{}) {
+		return 0;
+	}
+	if (!(Calendar::Date::From(date.To<::std::string>()) == date)) {
+		::std::abort();
+	}
+	return 0;
+}
+
+// vim: set ts=4 sw=4 noet :
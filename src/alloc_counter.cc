@@ -0,0 +1,46 @@
+#include "alloc_counter.hh"
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+thread_local ::std::uint64_t t_allocs{};
+thread_local ::std::uint64_t t_bytes{};
+
+} // namespace
+
+AllocCounter::Count AllocCounter::Get()
+{
+	return {t_allocs, t_bytes};
+}
+
+// The array and nothrow forms default to these. The aligned
+// forms are left alone and stay paired with each other.
+void* operator new(::std::size_t size)
+{
+	++t_allocs;
+	t_bytes += size;
+	for (;;) {
+		if (auto* ptr = ::std::malloc(size ? size : 1)) {
+			return ptr;
+		}
+		auto handler = ::std::get_new_handler();
+		if (!handler) {
+			throw ::std::bad_alloc{};
+		}
+		handler();
+	}
+}
+
+void operator delete(void* ptr) noexcept
+{
+	::std::free(ptr);
+}
+
+void operator delete(void* ptr, ::std::size_t) noexcept
+{
+	::std::free(ptr);
+}
+
+// vim: set ts=4 sw=4 noet :
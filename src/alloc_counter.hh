@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+// Counts heap allocations made through the global operator new, per thread.
+// Linking alloc_counter.cc replaces operator new and delete for the whole
+// program; the bookkeeping is two thread-local increments.
+class AllocCounter {
+public:
+	struct Count {
+		::std::uint64_t allocs{};
+		::std::uint64_t bytes{};
+
+		Count operator-(Count const& rhs) const { return {allocs - rhs.allocs, bytes - rhs.bytes}; }
+	};
+
+	// totals of the calling thread since it started
+	static Count Get();
+};
+
+// vim: set ts=4 sw=4 noet :
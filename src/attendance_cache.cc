@@ -0,0 +1,260 @@
+#include "attendance_cache.hh"
+
+#include <charconv>
+
+#include <libmemcached/memcached.h>
+
+#include "day_number.hh"
+#include "logger.hh"
+
+namespace {
+
+::std::uint64_t NowMicros()
+{
+	return ::std::chrono::duration_cast<::std::chrono::microseconds>(
+		::std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+AttendanceCache::AttendanceCache(Options const& options, Metrics& metrics)
+	: options_{options}
+	, metrics_{metrics}
+{
+	memc_ = ::memcached_create(nullptr);
+	if (!memc_) {
+		throw Error{"memcached_create failed"};
+	}
+	auto* servers = ::memcached_servers_parse(options_.servers.c_str());
+	auto rc = ::memcached_server_push(memc_, servers);
+	::memcached_server_list_free(servers);
+	if (rc != MEMCACHED_SUCCESS) {
+		auto what = ::std::string{"memcached servers "} + options_.servers + ": "
+			+ ::memcached_strerror(memc_, rc);
+		::memcached_free(memc_);
+		throw Error{what};
+	}
+	// stamps are bumped with increment-with-initial, a binary protocol call
+	::memcached_behavior_set(memc_, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+	::memcached_behavior_set(memc_, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+	::memcached_behavior_set(memc_, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, options_.timeout.count());
+	::memcached_behavior_set(memc_, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, options_.timeout.count());
+}
+
+AttendanceCache::~AttendanceCache()
+{
+	::memcached_free(memc_);
+}
+
+int AttendanceCache::MonthOf(int day)
+{
+	int y{}, m{}, d{};
+	CivilFromDays(day, y, m, d);
+	return y * 12 + m - 1;
+}
+
+int AttendanceCache::FirstDay(int month)
+{
+	return DaysFromCivil(month / 12, month % 12 + 1, 1);
+}
+
+int AttendanceCache::LastDay(int month)
+{
+	return FirstDay(month + 1) - 1;
+}
+
+::std::optional<AttendanceCache::Versions> AttendanceCache::ReadVersions(int first_month, int last_month)
+{
+	auto keys = ::std::vector<::std::string>{};
+	for (auto month = first_month; month <= last_month; ++month) {
+		keys.push_back(VersionKey(month));
+	}
+	auto lock = ::std::lock_guard{mutex_};
+	auto values = Fetch(keys);
+	if (values.empty()) {
+		return {};
+	}
+	auto versions = Versions(keys.size());
+	for (::std::size_t i = 0; i < values.size(); ++i) {
+		if (values[i]) {
+			::std::from_chars(values[i]->data(), values[i]->data() + values[i]->size(), versions[i]);
+		}
+	}
+	return versions;
+}
+
+::std::vector<::std::optional<AttendanceCache::Counts>> AttendanceCache::ReadCounts(
+		int first_month, int last_month)
+{
+	auto keys = ::std::vector<::std::string>{};
+	for (auto month = first_month; month <= last_month; ++month) {
+		keys.push_back(CountsKey(month));
+	}
+	auto counts = ::std::vector<::std::optional<Counts>>(keys.size());
+	auto values = ::std::vector<::std::optional<::std::string>>{};
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		values = Fetch(keys);
+	}
+	for (::std::size_t i = 0; i < values.size(); ++i) {
+		if (values[i]) {
+			counts[i] = Parse(*values[i]);
+		}
+		metrics_.Add(counts[i] ? "attendance_cache.hits" : "attendance_cache.misses");
+	}
+	return counts;
+}
+
+void AttendanceCache::AddCounts(int month, Counts const& counts)
+{
+	auto key = CountsKey(month);
+	auto value = Format(counts);
+	auto lock = ::std::lock_guard{mutex_};
+	auto rc = ::memcached_add(memc_, key.data(), key.size(), value.data(), value.size(),
+			options_.ttl.count(), 0);
+	if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTSTORED && rc != MEMCACHED_DATA_EXISTS) {
+		Logger::Warning("attendance_cache", "add failed")("key", key)
+			("error", ::memcached_strerror(memc_, rc));
+	}
+}
+
+void AttendanceCache::Update(int month, ::std::function<Counts()> const& load)
+{
+	auto key = CountsKey(month);
+	auto stored = false;
+	for (auto attempt = 0; attempt < options_.cas_attempts && !stored; ++attempt) {
+		auto cas = ::std::vector<::std::uint64_t>{};
+		auto found = false;
+		{
+			auto lock = ::std::lock_guard{mutex_};
+			auto values = Fetch({key}, &cas);
+			if (values.empty()) {
+				break;
+			}
+			found = values.front().has_value();
+		}
+		auto value = Format(load());
+		auto lock = ::std::lock_guard{mutex_};
+		auto rc = found
+			? ::memcached_cas(memc_, key.data(), key.size(), value.data(), value.size(),
+				options_.ttl.count(), 0, cas.front())
+			: ::memcached_add(memc_, key.data(), key.size(), value.data(), value.size(),
+				options_.ttl.count(), 0);
+		if (rc == MEMCACHED_SUCCESS) {
+			stored = true;
+		} else if (rc == MEMCACHED_DATA_EXISTS || rc == MEMCACHED_NOTSTORED || rc == MEMCACHED_NOTFOUND) {
+			metrics_.Add("attendance_cache.cas_conflicts");
+		} else {
+			Logger::Warning("attendance_cache", "store failed")("key", key)
+				("error", ::memcached_strerror(memc_, rc));
+			break;
+		}
+	}
+
+	auto lock = ::std::lock_guard{mutex_};
+	if (!stored) {
+		// readers go to the database rather than trust what is there
+		::memcached_delete(memc_, key.data(), key.size(), 0);
+	}
+	// A stamp lost to eviction restarts from the clock, never from a value
+	// some instance may still hold.
+	auto version_key = VersionKey(month);
+	auto version = ::std::uint64_t{};
+	auto rc = ::memcached_increment_with_initial(memc_, version_key.data(), version_key.size(),
+			1, NowMicros(), 0, &version);
+	if (rc != MEMCACHED_SUCCESS) {
+		Logger::Error("attendance_cache", "version bump failed")("key", version_key)
+			("error", ::memcached_strerror(memc_, rc));
+		return;
+	}
+	metrics_.Add("attendance_cache.updates");
+}
+
+// Values in key order, empty for misses; no values at all if the request
+// failed. With cas set, also the CAS of each value.
+::std::vector<::std::optional<::std::string>> AttendanceCache::Fetch(
+		::std::vector<::std::string> const& keys, ::std::vector<::std::uint64_t>* cas)
+{
+	auto key_ptrs = ::std::vector<char const*>{};
+	auto key_lengths = ::std::vector<::std::size_t>{};
+	for (auto const& key : keys) {
+		key_ptrs.push_back(key.data());
+		key_lengths.push_back(key.size());
+	}
+	auto rc = ::memcached_mget(memc_, key_ptrs.data(), key_lengths.data(), keys.size());
+	if (rc != MEMCACHED_SUCCESS) {
+		metrics_.Add("attendance_cache.errors");
+		Logger::Warning("attendance_cache", "get failed")("error", ::memcached_strerror(memc_, rc));
+		return {};
+	}
+	auto values = ::std::vector<::std::optional<::std::string>>(keys.size());
+	if (cas) {
+		cas->assign(keys.size(), 0);
+	}
+	auto* result = ::memcached_result_create(memc_, nullptr);
+	while (::memcached_fetch_result(memc_, result, &rc)) {
+		auto key = ::std::string_view{::memcached_result_key_value(result),
+			::memcached_result_key_length(result)};
+		for (::std::size_t i = 0; i < keys.size(); ++i) {
+			if (keys[i] == key) {
+				values[i].emplace(::memcached_result_value(result), ::memcached_result_length(result));
+				if (cas) {
+					(*cas)[i] = ::memcached_result_cas(result);
+				}
+				break;
+			}
+		}
+	}
+	::memcached_result_free(result);
+	if (rc != MEMCACHED_END && rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND) {
+		metrics_.Add("attendance_cache.errors");
+		Logger::Warning("attendance_cache", "get failed")("error", ::memcached_strerror(memc_, rc));
+		return {};
+	}
+	return values;
+}
+
+::std::string AttendanceCache::CountsKey(int month)
+{
+	return "attendance:counts:" + ::std::to_string(month);
+}
+
+::std::string AttendanceCache::VersionKey(int month)
+{
+	return "attendance:version:" + ::std::to_string(month);
+}
+
+// "day:users" pairs separated by spaces; an empty month is an empty value.
+::std::string AttendanceCache::Format(Counts const& counts)
+{
+	auto s = ::std::string{};
+	for (auto const& [day, users] : counts) {
+		if (!s.empty()) {
+			s += ' ';
+		}
+		s.append(::std::to_string(day)).append(1, ':').append(::std::to_string(users));
+	}
+	return s;
+}
+
+::std::optional<AttendanceCache::Counts> AttendanceCache::Parse(::std::string_view s)
+{
+	auto counts = Counts{};
+	auto const* p = s.data();
+	auto const* end = s.data() + s.size();
+	while (p != end) {
+		auto& [day, users] = counts.emplace_back();
+		auto r = ::std::from_chars(p, end, day);
+		if (r.ec != ::std::errc{} || r.ptr == end || *r.ptr != ':') {
+			return {};
+		}
+		r = ::std::from_chars(r.ptr + 1, end, users);
+		if (r.ec != ::std::errc{} || (r.ptr != end && *r.ptr != ' ')) {
+			return {};
+		}
+		p = r.ptr == end ? end : r.ptr + 1;
+	}
+	return counts;
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "metrics.hh"
+
+struct memcached_st;
+
+// Attendance counts shared by every instance through memcached, a second
+// tier behind each process's own window. A month (numbered as in
+// Storage) has two entries: its per-day counts, rewritten with CAS from
+// the database after the month changes, and a version stamp bumped right
+// after that. Comparing stamps tells an instance whether what it holds is
+// still current without reading the counts again.
+//
+// Failures only cost database reads: a miss or an unreachable server
+// reads as nothing cached. Calls are serialized on one connection.
+class AttendanceCache {
+public:
+	using Counts = ::std::vector<::std::pair<int, ::std::size_t>>; // day,users
+	using Versions = ::std::vector<::std::uint64_t>;
+
+	struct Error : ::std::runtime_error {
+		using ::std::runtime_error::runtime_error;
+	};
+
+	struct Options {
+		::std::string servers{"localhost:11211"};
+		::std::chrono::seconds ttl{86400};
+		::std::chrono::milliseconds timeout{100};
+		int cas_attempts{4};
+	};
+
+	AttendanceCache(Options const& options, Metrics& metrics);
+	~AttendanceCache();
+
+	AttendanceCache(AttendanceCache const&) = delete;
+	AttendanceCache& operator=(AttendanceCache const&) = delete;
+
+	static int MonthOf(int day);
+	static int FirstDay(int month);
+	static int LastDay(int month);
+
+	// Stamps of months first..last, 0 for a month without one; nothing if
+	// the server can't be asked.
+	::std::optional<Versions> ReadVersions(int first_month, int last_month);
+	// Counts of months first..last; misses are empty.
+	::std::vector<::std::optional<Counts>> ReadCounts(int first_month, int last_month);
+	// Fills a miss unless another instance got there first.
+	void AddCounts(int month, Counts const& counts);
+	// Replaces the month's counts with load() and bumps its stamp. load()
+	// runs after the current entry is read, so losing the CAS to another
+	// writer means loading again.
+	void Update(int month, ::std::function<Counts()> const& load);
+
+private:
+	Options options_{};
+	Metrics& metrics_;
+	::std::mutex mutex_{};
+	::memcached_st* memc_{};
+
+	::std::vector<::std::optional<::std::string>> Fetch(::std::vector<::std::string> const& keys,
+			::std::vector<::std::uint64_t>* cas = nullptr);
+
+	static ::std::string CountsKey(int month);
+	static ::std::string VersionKey(int month);
+	static ::std::string Format(Counts const& counts);
+	static ::std::optional<Counts> Parse(::std::string_view s);
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,346 @@
+#include "attendance_journal.hh"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Poco/Checksum.h>
+
+#include "logger.hh"
+
+namespace {
+
+::std::uint32_t Crc32(char const* data, ::std::size_t size)
+{
+	auto crc = ::Poco::Checksum{::Poco::Checksum::TYPE_CRC32};
+	crc.update(data, static_cast<unsigned>(size));
+	return crc.checksum();
+}
+
+// Returns errno, or 0 once everything is written.
+int WriteAll(int fd, char const* data, ::std::size_t size)
+{
+	for (::std::size_t done = 0; done < size;) {
+		auto n = ::write(fd, data + done, size - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+} // namespace
+
+AttendanceJournal::AttendanceJournal(::std::string const& path, Commit commit, Metrics& metrics,
+		::std::chrono::milliseconds commit_interval, ::std::size_t batch_size)
+	: path_{path}
+	, commit_{::std::move(commit)}
+	, metrics_{metrics}
+	, commit_interval_{commit_interval}
+	, batch_size_{::std::max<::std::size_t>(batch_size, 1)}
+{
+	fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if (fd_ < 0) {
+		throw ::std::runtime_error{"journal: open " + path + ": " + ::std::strerror(errno)};
+	}
+	Replay();
+	thread_ = ::std::thread{[this]() { Run(); }};
+}
+
+AttendanceJournal::~AttendanceJournal()
+{
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		stop_ = true;
+	}
+	cv_.notify_all();
+	thread_.join();
+	::close(fd_);
+}
+
+void AttendanceJournal::Append(::std::vector<Entry> const& entries)
+{
+	if (entries.empty()) {
+		return;
+	}
+	auto buf = ::std::string(entries.size() * RECORD_SIZE, '\0');
+	for (::std::size_t i = 0; i < entries.size(); ++i) {
+		Encode(entries[i], buf.data() + i * RECORD_SIZE);
+	}
+	auto now = Clock::now();
+	{
+		// written and queued as one step, so truncating the file once the
+		// queue is empty can't take an entry that is not queued yet
+		auto file_lock = ::std::lock_guard{file_mutex_};
+		if (auto error = WriteAll(fd_, buf.data(), buf.size())) {
+			// still committed from memory, only crash safety is lost
+			Logger::Error("journal", "write failed")("error", ::std::strerror(error));
+			metrics_.Add("journal.write_errors");
+		}
+		unsynced_ = true;
+		auto lock = ::std::lock_guard{mutex_};
+		for (auto const& entry : entries) {
+			pending_.push_back({entry, now});
+		}
+	}
+	metrics_.Add("journal.appended", entries.size());
+	cv_.notify_one();
+}
+
+void AttendanceJournal::Sync()
+{
+	auto file_lock = ::std::lock_guard{file_mutex_};
+	if (!unsynced_) {
+		return;
+	}
+	unsynced_ = false;
+	if (::fdatasync(fd_) < 0) {
+		Logger::Error("journal", "sync failed")("error", ::std::strerror(errno));
+		metrics_.Add("journal.write_errors");
+	}
+	metrics_.Add("journal.syncs");
+}
+
+::std::size_t AttendanceJournal::PendingCount() const
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return pending_.size();
+}
+
+::std::chrono::milliseconds AttendanceJournal::Lag() const
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (pending_.empty()) {
+		return {};
+	}
+	return ::std::chrono::duration_cast<::std::chrono::milliseconds>(
+			Clock::now() - pending_.front().time);
+}
+
+void AttendanceJournal::Replay()
+{
+	auto data = ::std::string{};
+	::std::array<char, 64 * 1024> buf{};
+	for (;;) {
+		auto n = ::pread(fd_, buf.data(), buf.size(), data.size());
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			throw ::std::runtime_error{::std::string{"journal: read: "} + ::std::strerror(errno)};
+		}
+		if (!n) {
+			break;
+		}
+		data.append(buf.data(), n);
+	}
+
+	auto now = Clock::now();
+	auto valid = ::std::size_t{};
+	for (; valid + RECORD_SIZE <= data.size(); valid += RECORD_SIZE) {
+		auto entry = Entry{};
+		if (!Decode(data.data() + valid, entry)) {
+			break;
+		}
+		pending_.push_back({entry, now});
+	}
+	if (valid != data.size()) {
+		// drop a torn or corrupt tail left by a crash mid-write
+		Logger::Warning("journal", "discarding torn tail")("bytes", data.size() - valid);
+		if (::ftruncate(fd_, valid) < 0) {
+			throw ::std::runtime_error{::std::string{"journal: truncate: "} + ::std::strerror(errno)};
+		}
+	}
+	if (!pending_.empty()) {
+		Logger::Info("journal", "replaying")("entries", pending_.size());
+	}
+	metrics_.Add("journal.replayed", pending_.size());
+}
+
+// Group commit: every commit interval (or as soon as a full batch is
+// queued) commit everything queued in one go.
+void AttendanceJournal::Run()
+{
+	auto backoff = commit_interval_;
+	auto lock = ::std::unique_lock{mutex_};
+	for (;;) {
+		cv_.wait_for(lock, commit_interval_, [this]() {
+			return stop_ || pending_.size() >= batch_size_;
+		});
+		if (pending_.empty()) {
+			if (stop_) {
+				break;
+			}
+			continue;
+		}
+		auto n = ::std::min(pending_.size(), batch_size_);
+		auto batch = ::std::vector<Entry>{};
+		batch.reserve(n);
+		for (::std::size_t i = 0; i < n; ++i) {
+			batch.push_back(pending_[i].entry);
+		}
+		auto stopping = stop_;
+		lock.unlock();
+		auto ok = Flush(batch);
+		lock.lock();
+		if (!ok) {
+			if (stopping) {
+				break; // whatever is left is replayed on the next start
+			}
+			cv_.wait_for(lock, backoff, [this]() { return stop_; });
+			backoff = ::std::min<::std::chrono::milliseconds>(backoff * 2, MAX_BACKOFF);
+			continue;
+		}
+		backoff = commit_interval_;
+		pending_.erase(pending_.begin(), pending_.begin() + n);
+		committed_ += n;
+		if (pending_.empty()) {
+			// file_mutex_ goes first, and Append may have written an entry
+			// it has not queued yet
+			lock.unlock();
+			auto file_lock = ::std::lock_guard{file_mutex_};
+			lock.lock();
+			if (!pending_.empty()) {
+				continue;
+			}
+			if (::ftruncate(fd_, 0) < 0) {
+				Logger::Error("journal", "truncate failed")("error", ::std::strerror(errno));
+			} else {
+				committed_ = 0;
+				unsynced_ = false;
+			}
+		} else if (committed_ >= COMPACT_RECORDS) {
+			lock.unlock();
+			Compact();
+			lock.lock();
+		}
+	}
+}
+
+// Runs on the commit thread, the one thread that takes entries off
+// pending_, without either lock. Under steady load the queue never runs
+// dry and the file is never truncated, so once enough of it is committed
+// it is replaced by a copy of just the pending entries. The copy is
+// written and synced unlocked. Only entries appended meanwhile, the rename
+// and the swap hold up Append. On any failure the old file stays, which
+// costs only a longer replay.
+void AttendanceJournal::Compact()
+{
+	auto encode = [](::std::deque<Queued> const& queued, ::std::size_t first) {
+		auto buf = ::std::string((queued.size() - first) * RECORD_SIZE, '\0');
+		for (auto i = first; i < queued.size(); ++i) {
+			Encode(queued[i].entry, buf.data() + (i - first) * RECORD_SIZE);
+		}
+		return buf;
+	};
+	auto buf = ::std::string{};
+	auto copied = ::std::size_t{};
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		buf = encode(pending_, 0);
+		copied = pending_.size();
+	}
+	auto tmp = path_ + ".tmp";
+	auto fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		Logger::Error("journal", "compaction failed")("error", ::std::strerror(errno));
+		return;
+	}
+	auto error = WriteAll(fd, buf.data(), buf.size());
+	if (!error && ::fdatasync(fd) < 0) {
+		error = errno;
+	}
+
+	auto file_lock = ::std::lock_guard{file_mutex_};
+	if (!error) {
+		// An entry appended since the copy may have been synced and
+		// acknowledged in the old file already, so it is synced here too.
+		{
+			auto lock = ::std::lock_guard{mutex_};
+			buf = encode(pending_, copied);
+		}
+		if (!buf.empty()) {
+			error = WriteAll(fd, buf.data(), buf.size());
+			if (!error && ::fdatasync(fd) < 0) {
+				error = errno;
+			}
+		}
+	}
+	if (!error && ::rename(tmp.c_str(), path_.c_str()) < 0) {
+		error = errno;
+	}
+	if (error) {
+		Logger::Error("journal", "compaction failed")("error", ::std::strerror(error));
+		::close(fd);
+		::unlink(tmp.c_str());
+		return;
+	}
+	// The rename itself must survive a crash, or the old file comes back
+	// without what is appended to the new one from here on.
+	auto dir = path_.substr(0, path_.find_last_of('/') + 1);
+	if (auto dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			dir_fd >= 0) {
+		::fsync(dir_fd);
+		::close(dir_fd);
+	}
+	::close(fd_);
+	fd_ = fd;
+	unsynced_ = false;
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		committed_ = 0;
+	}
+	metrics_.Add("journal.compactions");
+}
+
+// The entries are synced by Sync(), not here.
+bool AttendanceJournal::Flush(::std::vector<Entry> const& batch)
+{
+	try {
+		commit_(batch);
+	} catch (::std::exception const& e) {
+		Logger::Error("journal", "commit failed")("error", e.what());
+		metrics_.Add("journal.commit_errors");
+		return false;
+	}
+	metrics_.Add("journal.commits");
+	metrics_.Add("journal.committed", batch.size());
+	return true;
+}
+
+// Record layout, host byte order: user_id (8), day (4), remove (1),
+// reserved (3), CRC-32 of the preceding 16 bytes (4).
+void AttendanceJournal::Encode(Entry const& entry, char* record)
+{
+	::std::memset(record, 0, RECORD_SIZE);
+	::std::memcpy(record, &entry.user_id, 8);
+	::std::memcpy(record + 8, &entry.day, 4);
+	record[12] = entry.remove ? 1 : 0;
+	auto crc = Crc32(record, 16);
+	::std::memcpy(record + 16, &crc, 4);
+}
+
+bool AttendanceJournal::Decode(char const* record, Entry& entry)
+{
+	::std::uint32_t crc{};
+	::std::memcpy(&crc, record + 16, 4);
+	if (crc != Crc32(record, 16)) {
+		return false;
+	}
+	::std::memcpy(&entry.user_id, record, 8);
+	::std::memcpy(&entry.day, record + 8, 4);
+	entry.remove = record[12];
+	return true;
+}
+
+// vim: set ts=4 sw=4 noet :
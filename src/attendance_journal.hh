@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hh"
+#include "storage.hh"
+
+// Write-behind log of attendance changes. Append() only writes a local
+// file and Sync() makes everything appended so far durable at once; a
+// background thread hands batches of entries to the commit function,
+// retrying with backoff until it succeeds. Entries left over after a crash
+// are replayed on the next start, which is safe because committing the
+// same entry twice has no further effect.
+class AttendanceJournal {
+public:
+	using Clock = ::std::chrono::steady_clock;
+
+	using Entry = Storage::Change;
+
+	using Commit = ::std::function<void(::std::vector<Entry> const& batch)>;
+
+	AttendanceJournal(::std::string const& path, Commit commit, Metrics& metrics,
+			::std::chrono::milliseconds commit_interval, ::std::size_t batch_size);
+	~AttendanceJournal();
+
+	AttendanceJournal(AttendanceJournal const&) = delete;
+	AttendanceJournal& operator=(AttendanceJournal const&) = delete;
+
+	void Append(::std::vector<Entry> const& entries);
+	// One fdatasync for every Append since the last call, if any; an entry
+	// may be acknowledged once this returns.
+	void Sync();
+
+	// Visits the entries not yet committed, oldest first.
+	template<typename F> void ForEachPending(F f) const;
+
+	::std::size_t PendingCount() const;
+	::std::chrono::milliseconds Lag() const;
+
+private:
+	static constexpr ::std::size_t RECORD_SIZE = 20;
+	static constexpr auto MAX_BACKOFF = ::std::chrono::seconds{30};
+	// committed records the file may hold before it is compacted
+	static constexpr ::std::size_t COMPACT_RECORDS = 64 * 1024;
+
+	struct Queued {
+		Entry entry{};
+		Clock::time_point time{};
+	};
+
+	::std::string path_{};
+	Commit commit_{};
+	Metrics& metrics_;
+	::std::chrono::milliseconds commit_interval_{};
+	::std::size_t batch_size_{};
+
+	// Guards the file. Taken before mutex_ when both are needed, and never
+	// by readers of the pending entries.
+	::std::mutex file_mutex_{};
+	int fd_{-1};
+	bool unsynced_{};
+
+	mutable ::std::mutex mutex_{};
+	::std::condition_variable cv_{};
+	::std::deque<Queued> pending_{};
+	::std::size_t committed_{}; // records ahead of pending_ in the file
+	bool stop_{false};
+	::std::thread thread_{};
+
+	void Replay();
+	void Run();
+	bool Flush(::std::vector<Entry> const& batch);
+	void Compact();
+
+	static void Encode(Entry const& entry, char* record);
+	static bool Decode(char const* record, Entry& entry);
+};
+
+template<typename F>
+	inline void AttendanceJournal::ForEachPending(F f) const
+{
+	auto lock = ::std::lock_guard{mutex_};
+	for (auto const& queued : pending_) {
+		f(queued.entry);
+	}
+}
+
+// vim: set ts=4 sw=4 noet :
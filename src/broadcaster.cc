@@ -0,0 +1,216 @@
+#include "broadcaster.hh"
+
+#include <algorithm>
+#include <deque>
+
+#include "logger.hh"
+
+Broadcaster::Broadcaster(Storage& storage, RateLimiter& limiter, Send send, Check check,
+		Options const& options, Metrics& metrics)
+	: storage_{storage}
+	, limiter_{limiter}
+	, send_{::std::move(send)}
+	, check_{::std::move(check)}
+	, options_{options}
+	, metrics_{metrics}
+{
+	options_.max_in_flight = ::std::max<::std::size_t>(options_.max_in_flight, 1);
+	options_.checkpoint_size = ::std::max<::std::size_t>(options_.checkpoint_size, 1);
+	thread_ = ::std::thread{[this]() { Run(); }};
+}
+
+Broadcaster::~Broadcaster()
+{
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		stop_ = true;
+	}
+	cv_.notify_all();
+	thread_.join();
+}
+
+void Broadcaster::Wake()
+{
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		wake_ = true;
+	}
+	cv_.notify_one();
+}
+
+::std::vector<Broadcaster::Report> Broadcaster::TakeReports()
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return ::std::move(reports_);
+}
+
+void Broadcaster::Run()
+{
+	for (;;) {
+		{
+			auto lock = ::std::unique_lock{mutex_};
+			cv_.wait_for(lock, options_.poll_interval, [this]() { return stop_ || wake_; });
+			if (stop_) {
+				return;
+			}
+			wake_ = false;
+		}
+		auto broadcasts = ::std::vector<Storage::Broadcast>{};
+		try {
+			broadcasts = storage_.ReadUnfinishedBroadcasts();
+		} catch (::std::exception const& e) {
+			Logger::Error("broadcast", "read failed")("error", e.what());
+			continue;
+		}
+		for (auto const& broadcast : broadcasts) {
+			if (Stopping()) {
+				return;
+			}
+			Deliver(broadcast);
+		}
+	}
+}
+
+// Sends go out as the limiter allows, the in-flight bound permitting, and
+// answers are taken in the order the sends went out. A 429 holds the
+// limiter for as long as it asks and does not use up an attempt. Once
+// stopping, nothing new is sent but the answers in flight are still
+// recorded.
+void Broadcaster::Deliver(Storage::Broadcast const& broadcast)
+{
+	struct InFlight {
+		UserId user_id{};
+		int attempt{};
+		::std::future<HttpLoop::Response> response{};
+	};
+
+	auto report = Report{};
+	report.id = broadcast.id;
+	report.created_by = broadcast.created_by;
+	report.total = broadcast.total;
+	Logger::Info("broadcast", "started")("id", broadcast.id)("total", broadcast.total)
+		("pending", broadcast.pending.size());
+
+	auto start = Clock::now();
+	auto queue = ::std::deque<::std::pair<UserId, int>>{};
+	for (auto user_id : broadcast.pending) {
+		queue.emplace_back(user_id, 1);
+	}
+	auto in_flight = ::std::deque<InFlight>{};
+	auto done = ::std::vector<::std::pair<UserId, Storage::Delivery>>{};
+	auto stopping = false;
+	while (!in_flight.empty() || (!queue.empty() && !stopping)) {
+		stopping = stopping || Stopping();
+		while (!stopping && !queue.empty() && in_flight.size() < options_.max_in_flight
+				&& limiter_.TryAcquire()) {
+			auto [user_id, attempt] = queue.front();
+			queue.pop_front();
+			auto response = ::std::future<HttpLoop::Response>{};
+			try {
+				response = send_(user_id, broadcast.text);
+			} catch (...) {
+				// checked like a transport failure
+				auto failed = ::std::promise<HttpLoop::Response>{};
+				failed.set_exception(::std::current_exception());
+				response = failed.get_future();
+			}
+			in_flight.push_back({user_id, attempt, ::std::move(response)});
+		}
+		auto next_send = limiter_.Next();
+		auto can_send = !stopping && !queue.empty() && in_flight.size() < options_.max_in_flight;
+		if (in_flight.empty()) {
+			auto lock = ::std::unique_lock{mutex_};
+			cv_.wait_until(lock, next_send, [this]() { return stop_; });
+			continue;
+		}
+		auto& oldest = in_flight.front();
+		if (can_send && oldest.response.wait_until(next_send) != ::std::future_status::ready) {
+			continue;
+		}
+
+		auto result = check_(oldest.response);
+		if (result.retry_after.count()) {
+			limiter_.Hold(Clock::now() + result.retry_after);
+			metrics_.Add("broadcast.throttled");
+		}
+		if (result.delivery == Storage::Delivery::PENDING) {
+			if (result.retry_after.count()) {
+				// throttled, not failed: goes first once the hold is over
+				queue.emplace_front(oldest.user_id, oldest.attempt);
+			} else if (oldest.attempt < options_.max_attempts) {
+				queue.emplace_back(oldest.user_id, oldest.attempt + 1);
+				metrics_.Add("broadcast.retries");
+			} else {
+				result.delivery = Storage::Delivery::FAILED;
+			}
+		}
+		switch (result.delivery) {
+		case Storage::Delivery::SENT:
+			++report.sent;
+			metrics_.Add("broadcast.sent");
+			break;
+		case Storage::Delivery::BLOCKED:
+			++report.blocked;
+			metrics_.Add("broadcast.blocked");
+			break;
+		case Storage::Delivery::FAILED:
+			++report.failed;
+			metrics_.Add("broadcast.failed");
+			break;
+		case Storage::Delivery::PENDING:
+			break;
+		}
+		if (result.delivery != Storage::Delivery::PENDING) {
+			done.emplace_back(oldest.user_id, result.delivery);
+			++report.attempted;
+		}
+		in_flight.pop_front();
+		if (done.size() >= options_.checkpoint_size) {
+			Checkpoint(broadcast.id, done);
+		}
+	}
+	if (!Checkpoint(broadcast.id, done)) {
+		Logger::Error("broadcast", "checkpoint lost, recipients will be sent again")
+			("id", broadcast.id)("recipients", done.size());
+	}
+
+	report.elapsed = ::std::chrono::duration_cast<::std::chrono::milliseconds>(Clock::now() - start);
+	auto seconds = ::std::max(report.elapsed.count(), ::std::int64_t{1}) / 1000.0;
+	if (stopping && !queue.empty()) {
+		Logger::Info("broadcast", "interrupted")("id", report.id)("attempted", report.attempted)
+			("left", queue.size());
+		return;
+	}
+	Logger::Info("broadcast", "finished")("id", report.id)("total", report.total)
+		("sent", report.sent)("blocked", report.blocked)("failed", report.failed)
+		("ms", report.elapsed.count())("per_s", report.attempted / seconds);
+	metrics_.Set("broadcast.last_per_s", static_cast<::std::int64_t>(report.attempted / seconds));
+	auto lock = ::std::lock_guard{mutex_};
+	reports_.push_back(report);
+}
+
+bool Broadcaster::Stopping()
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return stop_;
+}
+
+// Keeps the outcomes for the next try if storage is unavailable.
+bool Broadcaster::Checkpoint(::std::int64_t id,
+		::std::vector<::std::pair<UserId, Storage::Delivery>>& done)
+{
+	if (done.empty()) {
+		return true;
+	}
+	try {
+		storage_.RecordDeliveries(id, done);
+		metrics_.Add("broadcast.checkpoints");
+		done.clear();
+		return true;
+	} catch (::std::exception const& e) {
+		Logger::Warning("broadcast", "checkpoint failed")("id", id)("error", e.what());
+		return false;
+	}
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_loop.hh"
+#include "metrics.hh"
+#include "rate_limiter.hh"
+#include "storage.hh"
+
+// Fans broadcasts out on a thread of its own, paced by a limiter it shares
+// with the bot's other background sends and with a bounded number of
+// messages in flight.
+// Outcomes are checkpointed to storage in batches, so a crash sends at
+// most one batch again. Broadcasts are picked up from storage, which lets
+// any process create them; only one process should run a Broadcaster.
+class Broadcaster {
+public:
+	using Clock = ::std::chrono::steady_clock;
+	using UserId = Storage::UserId;
+
+	struct Result {
+		Storage::Delivery delivery{Storage::Delivery::SENT}; // PENDING: try again
+		Clock::duration retry_after{}; // flood control, holds every send
+	};
+
+	// Starts sending text to a user.
+	using Send = ::std::function<::std::future<HttpLoop::Response>(UserId user_id,
+			::std::string const& text)>;
+	// Waits for the answer to a send and tells how it went.
+	using Check = ::std::function<Result(::std::future<HttpLoop::Response>& response)>;
+
+	struct Options {
+		::std::size_t max_in_flight{4}; // well under HttpLoop's 8 connections per host
+		::std::size_t checkpoint_size{64};
+		int max_attempts{3};
+		::std::chrono::seconds poll_interval{10};
+	};
+
+	// What one run of a broadcast did; a resumed broadcast reports only
+	// the recipients left when it resumed.
+	struct Report {
+		::std::int64_t id{};
+		UserId created_by{};
+		::std::size_t total{};
+		::std::size_t attempted{};
+		::std::size_t sent{};
+		::std::size_t blocked{};
+		::std::size_t failed{};
+		::std::chrono::milliseconds elapsed{};
+	};
+
+	Broadcaster(Storage& storage, RateLimiter& limiter, Send send, Check check,
+			Options const& options, Metrics& metrics);
+	~Broadcaster();
+
+	Broadcaster(Broadcaster const&) = delete;
+	Broadcaster& operator=(Broadcaster const&) = delete;
+
+	// Looks for new broadcasts now rather than at the next poll.
+	void Wake();
+	// Broadcasts finished since the last call.
+	::std::vector<Report> TakeReports();
+
+private:
+	Storage& storage_;
+	RateLimiter& limiter_;
+	Send send_{};
+	Check check_{};
+	Options options_{};
+	Metrics& metrics_;
+
+	::std::mutex mutex_{};
+	::std::condition_variable cv_{};
+	bool stop_{false};
+	bool wake_{true}; // resume what a previous run left
+	::std::vector<Report> reports_{};
+	::std::thread thread_{};
+
+	void Run();
+	void Deliver(Storage::Broadcast const& broadcast);
+	bool Stopping();
+	bool Checkpoint(::std::int64_t id, ::std::vector<::std::pair<UserId, Storage::Delivery>>& done);
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,475 @@
+#include "calendar.hh"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <iterator>
+
+#include <Poco/JSON/Array.h>
+#include <Poco/JSON/Object.h>
+#include <Poco/TextIterator.h>
+#include <Poco/UTF8Encoding.h>
+
+#include "day_number.hh"
+#include "logger.hh"
+
+namespace p = ::Poco;
+namespace p_json = ::Poco::JSON;
+namespace p_dyn = ::Poco::Dynamic;
+
+namespace {
+
+void AppendInt(::std::string& out, int value, char sep = '\0')
+{
+	char buf[16];
+	auto [end, ec] = ::std::to_chars(::std::begin(buf), ::std::end(buf), value);
+	out.append(buf, end);
+	if (sep) {
+		out.push_back(sep);
+	}
+}
+
+bool ParseInt(::std::string_view& s, int& value, bool sign = false)
+{
+	if (sign && !s.empty() && s.front() == '+') {
+		s.remove_prefix(1);
+	} else if (!sign && !s.empty() && s.front() == '-') {
+		return false;
+	}
+	auto [end, ec] = ::std::from_chars(s.data(), s.data() + s.size(), value);
+	if (ec != ::std::errc{}) {
+		return false;
+	}
+	s.remove_prefix(end - s.data());
+	return true;
+}
+
+bool Expect(::std::string_view& s, char c)
+{
+	if (s.empty() || s.front() != c) {
+		return false;
+	}
+	s.remove_prefix(1);
+	return true;
+}
+
+// y.m.d; any single character separates the fields. Only real dates of
+// years 1 to 9999 pass, so that day numbers can't overflow.
+bool ParseDate(::std::string_view& s, Calendar::Date& date)
+{
+	auto skip = [&s]() { return !s.empty() && (s.remove_prefix(1), true); };
+	if (!ParseInt(s, date.year) || !skip()
+			|| !ParseInt(s, date.month) || !skip()
+			|| !ParseInt(s, date.day)) {
+		return false;
+	}
+	if (date.year < 1 || date.year > 9999 || date.month < 1 || date.month > 12 || date.day < 1) {
+		return false;
+	}
+	auto next_month = DaysFromCivil(date.year + date.month / 12, date.month % 12 + 1, 1);
+	return date.day <= next_month - DaysFromCivil(date.year, date.month, 1);
+}
+
+} // namespace
+
+Calendar::Keyboard::Keyboard(Date const& date)
+{
+	SetCenter(date);
+}
+
+void Calendar::Keyboard::SetCenter(Date const& d)
+{
+	first_date = {d, false};
+	ToStartOfWeek();
+	MoveWeek(-(n_cols - 1) / 2);
+}
+
+void Calendar::Keyboard::MoveWeek(int shift)
+{
+	bool back = false;
+	if (shift < 0) {
+		back = true;
+		shift = -shift;
+	}
+	for (; shift; --shift) {
+		Advance(back);
+	}
+}
+
+void Calendar::Keyboard::MoveMonth(int shift)
+{
+	auto tm = first_date.first.To<::std::tm>();
+	tm.tm_mon += shift + (first_date.second ? 1 : 0);
+	tm.tm_mday = 1;
+	::std::mktime(&tm);
+	first_date.first = Date::From(tm);
+	ToStartOfWeek();
+}
+
+void Calendar::Keyboard::ToStartOfWeek()
+{
+	auto tm = first_date.first.To<::std::tm>();
+	::std::mktime(&tm);
+	tm.tm_mday -= (tm.tm_wday + DAYS_PER_WEEK - 1) % DAYS_PER_WEEK;
+	auto old_mon = tm.tm_mon;
+	::std::mktime(&tm);
+	first_date.second = (old_mon != tm.tm_mon);
+	first_date.first = Date::From(tm);
+}
+
+void Calendar::Keyboard::Advance(bool back)
+{
+	auto tm = first_date.first.To<::std::tm>();
+	auto cur = tm;
+	if (back) {
+		tm.tm_mday -= DAYS_PER_WEEK;
+	} else {
+		tm.tm_mday += DAYS_PER_WEEK;
+	}
+	::std::mktime(&tm);
+	if (first_date.second) {
+		first_date.second = false;
+		if (back) {
+			tm = cur;
+		}
+	} else if (tm.tm_mon != cur.tm_mon) {
+		first_date.second = true;
+		if (!back) {
+			tm = cur;
+		}
+	}
+	first_date.first = Date::From(tm);
+}
+
+Calendar::Date Calendar::Keyboard::LastDate() const
+{
+	auto tm = first_date.first.To<::std::tm>();
+	tm.tm_mday += (DAYS_PER_WEEK * n_cols) - 1;
+	::std::mktime(&tm);
+	return Date::From(tm);
+}
+
+::std::pmr::vector<::std::pair<Calendar::Date, bool>> Calendar::Keyboard::GenerateGrid(
+		::std::pmr::memory_resource* mr) const
+{
+	::std::pmr::vector<::std::pair<Date, bool>> grid(DAYS_PER_WEEK * n_cols, mr);
+	if (!grid.size()) {
+		return grid;
+	}
+	int skip = 0;
+	auto tm = first_date.first.To<::std::tm>();
+	::std::mktime(&tm);
+	tm.tm_mday += DAYS_PER_WEEK -
+		(tm.tm_wday + DAYS_PER_WEEK - 1) % DAYS_PER_WEEK;
+	::std::mktime(&tm);
+	tm.tm_mday -= DAYS_PER_WEEK;
+	int mon = tm.tm_mon;
+	::std::mktime(&tm);
+	if (mon != tm.tm_mon && first_date.second) {
+		tm.tm_mon += 1;
+		tm.tm_mday = 1;
+		::std::mktime(&tm);
+		skip = (tm.tm_wday + DAYS_PER_WEEK - 2) % DAYS_PER_WEEK + 1;
+	}
+	for (int i = 0;;) {
+		grid[i] = {Date::From(tm), skip};
+		if (++i >= static_cast<int>(grid.size())) {
+			break;
+		}
+		if (skip) {
+			--skip;
+		} else {
+			tm.tm_mday += 1;
+			mon = tm.tm_mon;
+			::std::mktime(&tm);
+			if (mon != tm.tm_mon) {
+				skip = 7;
+			}
+		}
+	}
+	return grid;
+}
+
+template<> ::std::tm Calendar::Date::To() const
+{
+	::std::tm tm {};
+	tm.tm_mday = day;
+	tm.tm_mon = month - 1;
+	tm.tm_year = year - 1900;
+	return tm;
+}
+
+template<> ::std::string Calendar::Date::To() const
+{
+	auto result = ::std::string{};
+	AppendInt(result, year, '.');
+	AppendInt(result, month, '.');
+	AppendInt(result, day);
+	return result;
+}
+
+Calendar::Date Calendar::Date::From(::std::tm const& tm)
+{
+	Date d{};
+	d.day = tm.tm_mday;
+	d.month = tm.tm_mon + 1;
+	d.year = tm.tm_year + 1900;
+	return d;
+}
+
+Calendar::Date Calendar::Date::From(::std::string_view s)
+{
+	auto rest = s;
+	Date d{};
+	if (!ParseDate(rest, d) || !rest.empty()) {
+		Logger::Debug("calendar", "invalid date string")("value", s);
+		return {};
+	}
+	return d;
+}
+
+int Calendar::Date::DayNumber() const
+{
+	return DaysFromCivil(year, month, day);
+}
+
+Calendar::Date Calendar::Date::FromDayNumber(int days)
+{
+	Date d{};
+	CivilFromDays(days, d.year, d.month, d.day);
+	return d;
+}
+
+::std::string Calendar::CallbackData::Serialize(Keyboard const& kb)
+{
+	auto result = ::std::string{};
+	result.reserve(24);
+	AppendInt(result, kb.first_date.first.year, '.');
+	AppendInt(result, kb.first_date.first.month, '.');
+	AppendInt(result, kb.first_date.first.day, ',');
+	AppendInt(result, static_cast<int>(kb.first_date.second), ',');
+	AppendInt(result, static_cast<int>(kb.mode), ',');
+	AppendInt(result, kb.n_cols);
+	return result;
+}
+
+::std::string Calendar::CallbackData::Serialize(::std::string_view kb, Key const& key)
+{
+	auto result = ::std::string{};
+	result.reserve(kb.size() + 16);
+	result.append(kb).push_back(',');
+	AppendInt(result, static_cast<int>(key.type), ',');
+	if (key.type == Key::Type::DAY) {
+		AppendInt(result, key.data.date.year, '.');
+		AppendInt(result, key.data.date.month, '.');
+		AppendInt(result, key.data.date.day);
+	}
+	return result;
+}
+
+// date,gap,mode,n_cols,key.type,key.data where key.data is a date for DAY
+// keys. Parsed in place: this runs for every button press.
+bool Calendar::CallbackData::Parse(::std::string_view s)
+{
+	auto rest = s;
+	int gap{}, mode{}, type{};
+	if (!ParseDate(rest, kb.first_date.first) || !Expect(rest, ',')
+			|| !ParseInt(rest, gap) || !Expect(rest, ',')
+			|| !ParseInt(rest, mode, true) || !Expect(rest, ',')
+			|| !ParseInt(rest, kb.n_cols) || !Expect(rest, ',')
+			|| !ParseInt(rest, type) || !Expect(rest, ',')) {
+		Logger::Debug("calendar", "invalid callback data")("value", s);
+		return false;
+	}
+	// everything below came from the client, and is used to size and index
+	if (gap < 0 || gap > 1
+			|| mode < static_cast<int>(Keyboard::Mode::VIEW) || mode > static_cast<int>(Keyboard::Mode::EDIT)
+			|| kb.n_cols < 1 || kb.n_cols > Keyboard::MAX_COLS
+			|| type < static_cast<int>(Key::Type::EMPTY) || type > static_cast<int>(Key::Type::DAY)) {
+		Logger::Debug("calendar", "callback data out of range")("value", s);
+		return false;
+	}
+	kb.first_date.second = static_cast<bool>(gap);
+	kb.mode = static_cast<Keyboard::Mode>(mode);
+	key.type = static_cast<Key::Type>(type);
+	if (key.type == Key::Type::DAY) {
+		if (!ParseDate(rest, key.data.date) || !rest.empty()) {
+			Logger::Debug("calendar", "invalid callback key data")("value", s);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+p_dyn::Var Calendar::RenderKeyboard(Keyboard const& kb, Grid const& grid,
+		::std::pmr::vector<DayView> const& days, Date const& today)
+{
+	using Array = p_json::Array;
+	using Object = p_json::Object;
+
+	auto ks = CallbackData::Serialize(kb);
+	auto kb_ja = Array::Ptr{new Array};
+
+	{
+		auto row_ja = Array::Ptr{new Array};
+		kb_ja->add(row_ja);
+		{
+			auto bn_jo = Object::Ptr{new Object};
+			row_ja->add(bn_jo);
+			auto const& [first_date, first_is_gap] = grid.front();
+			auto const& [last_date, last_is_gap] = grid.back();
+			auto text = ::std::string{};
+			if (first_is_gap) {
+				text.append(MONTH_NAMES[last_date.month - 1]);
+				text.append(" ");
+				text.append(::std::to_string(last_date.year));
+			} else if (last_is_gap || first_date.month == last_date.month) {
+				text.append(MONTH_NAMES[first_date.month - 1]);
+				text.append(" ");
+				text.append(::std::to_string(first_date.year));
+			} else {
+				text.append(MONTH_NAMES[first_date.month - 1]);
+				text.append(" ");
+				text.append(::std::to_string(first_date.year));
+				text.append(" — ");
+				text.append(MONTH_NAMES[last_date.month - 1]);
+				text.append(" ");
+				text.append(::std::to_string(last_date.year));
+			}
+			bn_jo->set("text", text);
+			bn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::MONTH}));
+		}
+	}
+
+	for (int row = 0; row < DAYS_PER_WEEK; ++row) {
+		auto row_ja = Array::Ptr{new Array};
+		kb_ja->add(row_ja);
+		for (int col = 0; col < (1 + kb.n_cols); ++col) {
+			auto bn_jo = Object::Ptr{new Object};
+			row_ja->add(bn_jo);
+			if (col == 0) {
+				bn_jo->set("text", DAY_NAMES[row]);
+				bn_jo->set("callback_data",
+						CallbackData::Serialize(ks, {Key::Type::EMPTY}));
+			} else {
+				auto index = row + ((col - 1) * DAYS_PER_WEEK);
+				auto const& [date, is_gap] = grid[index];
+				if (is_gap) {
+					bn_jo->set("text", " ");
+					bn_jo->set("callback_data",
+							CallbackData::Serialize(ks, {Key::Type::EMPTY}));
+				} else {
+					auto day = ::std::to_string(date.day);
+					if (day.size() == 1) {
+						day = ::std::string{" "} + day;
+					}
+					if (date == today) {
+						day = UnderlineUtf8String(day);
+					}
+					auto n_users = ::std::min(days[index].count, ::std::size(EMOJI_NUMBERS) - 1);
+					auto text = ::std::string{};
+					if (kb.mode == Keyboard::Mode::EDIT) {
+						if (days[index].selected) {
+							text.append("✅ ");
+						} else if (n_users) {
+							text.append(EMOJI_NUMBERS[n_users]);
+							text.append(" ");
+						} else {
+							text.append("  ·   ");
+						}
+					} else {
+						if (n_users) {
+							text.append(EMOJI_NUMBERS[n_users]);
+							text.append(" ");
+						} else {
+							text.append("      ");
+						}
+					}
+					text.append(day);
+					bn_jo->set("text", text);
+					bn_jo->set("callback_data",
+							CallbackData::Serialize(ks, {Key::Type::DAY, date}));
+				}
+			}
+		}
+	}
+
+	{
+		auto row_ja = Array::Ptr{new Array};
+		kb_ja->add(row_ja);
+		{
+			auto bn_jo = Object::Ptr{new Object};
+			row_ja->add(bn_jo);
+			bn_jo->set("text", "<<");
+			bn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::PREV_M}));
+		} {
+			auto bn_jo = Object::Ptr{new Object};
+			row_ja->add(bn_jo);
+			bn_jo->set("text", "<");
+			bn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::PREV_W}));
+		} {
+			auto bn_jo = Object::Ptr{new Object};
+			row_ja->add(bn_jo);
+			bn_jo->set("text", "•");
+			bn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::TODAY}));
+		} {
+			auto bn_jo = Object::Ptr{new Object};
+			row_ja->add(bn_jo);
+			bn_jo->set("text", ">");
+			bn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::NEXT_W}));
+		} {
+			auto bn_jo = Object::Ptr{new Object};
+			row_ja->add(bn_jo);
+			bn_jo->set("text", ">>");
+			bn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::NEXT_M}));
+		}
+	} {
+		auto row_ja = Array::Ptr{new Array};
+		kb_ja->add(row_ja);
+		auto lbn_jo = Object::Ptr{new Object};
+		row_ja->add(lbn_jo);
+		auto rbn_jo = Object::Ptr{new Object};
+		row_ja->add(rbn_jo);
+		if (kb.mode == Keyboard::Mode::VIEW) {
+			lbn_jo->set("text", "добавить");
+			lbn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::EDIT}));
+			rbn_jo->set("text", "закрыть");
+			rbn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::CLOSE}));
+		} else if (kb.mode == Keyboard::Mode::EDIT) {
+			lbn_jo->set("text", "отмена");
+			lbn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::CANCEL}));
+			rbn_jo->set("text", "сохранить");
+			rbn_jo->set("callback_data",
+					CallbackData::Serialize(ks, {Key::Type::SAVE}));
+		}
+	}
+	return kb_ja;
+}
+
+::std::string Calendar::UnderlineUtf8String(::std::string const& s)
+{
+	auto underlined = ::std::string{};
+	static constexpr int UTF8_MAX_BYTES = 4;
+	::std::array<uint8_t, UTF8_MAX_BYTES> buf{};
+	p::UTF8Encoding enc{};
+	auto ich = p::TextIterator{s, enc};
+	auto iend = p::TextIterator{s};
+	for (; ich != iend; ++ich) {
+		int n_bytes = enc.convert(*ich, buf.data(), UTF8_MAX_BYTES);
+		underlined.append(reinterpret_cast<char*>(buf.data()), n_bytes);
+		underlined.append("̲");
+	}
+	return underlined;
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <ctime>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <Poco/Dynamic/Var.h>
+
+// The attendance calendar: dates, the paged week-column keyboard, the
+// callback data its buttons carry and the inline keyboard markup. Nothing
+// here touches the network, storage or bot state, so it builds into the
+// bench and fuzz binaries as well.
+class Calendar {
+public:
+	static constexpr char const* EMOJI_NUMBERS[] = {
+		"0️⃣", "1️⃣", "2️⃣", "3️⃣", "4️⃣", "5️⃣", "6️⃣", "7️⃣", "8️⃣", "9️⃣", "🔟"};
+	static constexpr char const* DAY_NAMES[] = {"ПН", "ВТ", "СР", "ЧТ", "ПТ", "СБ", "ВС"};
+	static constexpr char const* MONTH_NAMES[] = {
+			"Январь", "Февраль", "Март", "Апрель", "Май", "Июнь",
+			"Июль", "Август", "Сентябрь", "Октябрь", "Ноябрь", "Декабрь"};
+	static constexpr int DAYS_PER_WEEK = 7;
+
+	struct Date {
+		int year{};
+		int month{};
+		int day{};
+
+		bool operator<(Date const& rhs) const;
+		bool operator==(Date const& rhs) const;
+
+		// days since 1970-01-01 in the proleptic Gregorian calendar
+		int DayNumber() const;
+		static Date FromDayNumber(int days);
+
+		// returns a zero date if s is not y.m.d
+		static Date From(::std::string_view s);
+		static Date From(::std::tm const& tm);
+		template<typename T> T To() const;
+	};
+
+	using Grid = ::std::pmr::vector<::std::pair<Date, bool>>; // date,is_gap
+
+	struct Keyboard {
+		::std::pair<Date, bool> first_date{}; // date,is_gap
+		enum class Mode {
+			VIEW, EDIT
+		} mode{Mode::VIEW};
+		// a row is the day's name and a button per column, and Telegram
+		// allows 8 buttons to a row
+		static constexpr int MAX_COLS = 7;
+		int n_cols{4};
+
+		Keyboard() = default;
+		explicit Keyboard(Date const& date);
+
+		void SetCenter(Date const& date);
+		void MoveMonth(int shift);
+		void MoveWeek(int shift);
+		void ToStartOfWeek();
+
+		Date const& FirstDate() const { return first_date.first; };
+		Date LastDate() const;
+
+		Mode GetMode() const { return mode; }
+		void SetMode(Mode m) { mode = m; }
+
+		Grid GenerateGrid(::std::pmr::memory_resource* mr = ::std::pmr::get_default_resource()) const;
+
+	private:
+		void Advance(bool back = false);
+	};
+
+	struct Key {
+		enum class Type : int {
+			EMPTY, CLOSE, EDIT, CANCEL, SAVE,
+			NEXT_W, PREV_W, NEXT_M, PREV_M, TODAY, MONTH, DAY
+		} type{Type::EMPTY};
+		union Data {
+			Date date{};
+			int index;
+		} data{};
+	};
+
+	struct CallbackData {
+		Keyboard kb{};
+		Key key{};
+
+		static ::std::string Serialize(Keyboard const& kb);
+		static ::std::string Serialize(::std::string_view kb, Key const& key);
+		bool Parse(::std::string_view s);
+	};
+
+	// What a day button shows besides its date.
+	struct DayView {
+		::std::size_t count{}; // other attendees
+		bool selected{}; // EDIT mode: marked by the viewer
+	};
+
+	// days[i] belongs to grid[i]; gap entries are ignored.
+	static ::Poco::Dynamic::Var RenderKeyboard(Keyboard const& kb, Grid const& grid,
+			::std::pmr::vector<DayView> const& days, Date const& today);
+	static ::std::string UnderlineUtf8String(::std::string const& s);
+};
+
+template<> ::std::string Calendar::Date::To() const;
+template<> ::std::tm Calendar::Date::To() const;
+
+inline bool Calendar::Date::operator==(Date const& rhs) const
+{
+	return (year == rhs.year) && (month == rhs.month) && (day == rhs.day);
+}
+
+inline bool Calendar::Date::operator<(Date const& rhs) const
+{
+	return (year < rhs.year) ||
+		(year == rhs.year && ((month < rhs.month) ||
+			(month == rhs.month && day < rhs.day)));
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,29 @@
+#pragma once
+
+// Conversions between civil dates and day numbers, the days since
+// 1970-01-01 in the proleptic Gregorian calendar.
+
+inline int DaysFromCivil(int year, int month, int day)
+{
+	auto y = year - (month <= 2 ? 1 : 0);
+	auto era = (y >= 0 ? y : y - 399) / 400;
+	auto yoe = y - era * 400;
+	auto doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	auto doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+inline void CivilFromDays(int days, int& year, int& month, int& day)
+{
+	days += 719468;
+	auto era = (days >= 0 ? days : days - 146096) / 146097;
+	auto doe = days - era * 146097;
+	auto yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	auto doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	auto mp = (5 * doy + 2) / 153;
+	day = doy - (153 * mp + 2) / 5 + 1;
+	month = mp < 10 ? mp + 3 : mp - 9;
+	year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+}
+
+// vim: set ts=4 sw=4 noet :
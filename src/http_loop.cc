@@ -0,0 +1,943 @@
+#include "http_loop.hh"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include "logger.hh"
+
+namespace {
+
+::std::string_view Trim(::std::string_view s)
+{
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+		s.remove_prefix(1);
+	}
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+		s.remove_suffix(1);
+	}
+	return s;
+}
+
+bool IEquals(::std::string_view a, ::std::string_view b)
+{
+	return a.size() == b.size() && !::strncasecmp(a.data(), b.data(), a.size());
+}
+
+::std::string ErrnoString(char const* what, int err)
+{
+	return ::std::string{what}.append(": ").append(::std::strerror(err));
+}
+
+} // namespace
+
+::std::string const* HttpLoop::Response::Header(::std::string_view name) const
+{
+	for (auto const& [key, value] : headers) {
+		if (IEquals(key, name)) {
+			return &value;
+		}
+	}
+	return nullptr;
+}
+
+bool HttpLoop::Response::HeaderIs(::std::string_view name, ::std::string_view value) const
+{
+	auto const* header = Header(name);
+	return header && IEquals(*header, value);
+}
+
+HttpLoop::HttpLoop(SSL_CTX* ssl_ctx)
+	: ssl_ctx_{ssl_ctx}
+{
+	if (ssl_ctx_) {
+		// The callback also catches TLS 1.3 tickets, which arrive only
+		// after the handshake has finished.
+		::SSL_CTX_set_session_cache_mode(ssl_ctx_,
+				SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		::SSL_CTX_sess_set_new_cb(ssl_ctx_, &OnNewSession);
+	}
+	epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) {
+		throw Error{ErrnoString("epoll_create1", errno)};
+	}
+	wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd_ < 0) {
+		auto err = errno;
+		::close(epoll_fd_);
+		throw Error{ErrnoString("eventfd", err)};
+	}
+	::epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0; // connection ids start at 1
+	::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+	thread_ = ::std::thread{[this]() { Loop(); }};
+}
+
+HttpLoop::~HttpLoop()
+{
+	Post([this]() { stop_ = true; });
+	thread_.join();
+	Abort(::std::make_exception_ptr(Error{"http loop stopped"}));
+	for (auto& [key, session] : sessions_) {
+		::SSL_SESSION_free(session);
+	}
+	::close(wake_fd_);
+	::close(epoll_fd_);
+}
+
+void HttpLoop::Submit(Request req, Callback cb)
+{
+	Post([this, pending = Pending{::std::move(req), ::std::move(cb)}]() mutable {
+		Start(::std::move(pending));
+	});
+}
+
+::std::future<HttpLoop::Response> HttpLoop::Submit(Request req)
+{
+	auto promise = ::std::make_shared<::std::promise<Response>>();
+	auto future = promise->get_future();
+	Submit(::std::move(req), [promise](::std::exception_ptr ex, Response resp) {
+		if (ex) {
+			promise->set_exception(ex);
+		} else {
+			promise->set_value(::std::move(resp));
+		}
+	});
+	return future;
+}
+
+HttpLoop::Response HttpLoop::Execute(Request req)
+{
+	return Submit(::std::move(req)).get();
+}
+
+HttpLoop::TimerId HttpLoop::AddTimer(::std::chrono::milliseconds delay, ::std::function<void()> fn)
+{
+	auto id = next_timer_id_++;
+	auto when = Clock::now() + delay;
+	Post([this, id, when, fn = ::std::move(fn)]() mutable {
+		ArmTimer(id, when, ::std::move(fn));
+	});
+	return id;
+}
+
+void HttpLoop::CancelTimer(TimerId id)
+{
+	Post([this, id]() { DisarmTimer(id); });
+}
+
+void HttpLoop::KeepWarm(Request req)
+{
+	Post([this, req = ::std::move(req)]() mutable {
+		auto key = KeyOf(req);
+		warm_[key].req = ::std::move(req);
+		EnsureWarm(key);
+	});
+}
+
+HttpLoop::Stats HttpLoop::GetStats() const
+{
+	auto stats = Stats{};
+	stats.handshakes = handshakes_;
+	stats.resumed = resumed_;
+	stats.handshake_time = ::std::chrono::microseconds{handshake_us_};
+	stats.standby_used = standby_used_;
+	return stats;
+}
+
+void HttpLoop::Post(::std::function<void()> fn)
+{
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		incoming_.push_back(::std::move(fn));
+	}
+	Wake();
+}
+
+void HttpLoop::Wake()
+{
+	::std::uint64_t one = 1;
+	auto n = ::write(wake_fd_, &one, sizeof(one));
+	(void) n; // a full counter already means a pending wake-up
+}
+
+void HttpLoop::Loop()
+{
+	::std::array<::epoll_event, MAX_EVENTS> events{};
+	while (!stop_) {
+		auto timeout = RunTimers();
+		auto n = ::epoll_wait(epoll_fd_, events.data(), MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			Logger::Error("http", "epoll_wait failed")("error", ::std::strerror(errno));
+		}
+		for (int i = 0; i < n; ++i) {
+			auto id = events[i].data.u64;
+			if (!id) {
+				::std::uint64_t value{};
+				auto r = ::read(wake_fd_, &value, sizeof(value));
+				(void) r;
+				continue;
+			}
+			// an earlier event of this batch may have closed the connection
+			if (auto iconn = conns_.find(id); iconn != conns_.end()) {
+				Drive(*iconn->second, events[i].events);
+			}
+		}
+		RunIncoming();
+	}
+}
+
+void HttpLoop::RunIncoming()
+{
+	auto tasks = decltype(incoming_){};
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		tasks.swap(incoming_);
+	}
+	for (auto& task : tasks) {
+		task();
+	}
+}
+
+int HttpLoop::RunTimers()
+{
+	while (!timers_.empty()) {
+		auto itimer = timers_.begin();
+		auto now = Clock::now();
+		if (itimer->first.first > now) {
+			auto ms = ::std::chrono::ceil<::std::chrono::milliseconds>(itimer->first.first - now);
+			return static_cast<int>(::std::min<::std::chrono::milliseconds::rep>(ms.count(), INT_MAX));
+		}
+		auto fn = ::std::move(itimer->second);
+		timer_index_.erase(itimer->first.second);
+		timers_.erase(itimer);
+		fn();
+	}
+	return -1;
+}
+
+HttpLoop::TimerId HttpLoop::ArmTimer(Clock::time_point when, ::std::function<void()> fn)
+{
+	auto id = next_timer_id_++;
+	ArmTimer(id, when, ::std::move(fn));
+	return id;
+}
+
+void HttpLoop::ArmTimer(TimerId id, Clock::time_point when, ::std::function<void()> fn)
+{
+	timers_.emplace(::std::make_pair(when, id), ::std::move(fn));
+	timer_index_.emplace(id, when);
+}
+
+void HttpLoop::DisarmTimer(TimerId id)
+{
+	auto itimer = timer_index_.find(id);
+	if (itimer == timer_index_.end()) {
+		return;
+	}
+	timers_.erase(::std::make_pair(itimer->second, id));
+	timer_index_.erase(itimer);
+}
+
+void HttpLoop::Start(Pending pending)
+{
+	auto key = KeyOf(pending.req);
+	if (auto& idle = idle_[key]; !idle.empty()) {
+		auto id = idle.back();
+		idle.pop_back();
+		auto& conn = *conns_.at(id);
+		conn.reused = true;
+		if (conn.spare) {
+			conn.spare = false;
+			++standby_used_;
+		}
+		Dispatch(conn, ::std::move(pending));
+		EnsureWarm(key);
+		return;
+	}
+	// a standby still connecting is closer to ready than a new connection
+	if (auto iwarm = warm_.find(key); iwarm != warm_.end() && iwarm->second.standby) {
+		auto& conn = *conns_.at(iwarm->second.standby);
+		iwarm->second.standby = 0;
+		conn.spare = false;
+		++standby_used_;
+		Dispatch(conn, ::std::move(pending));
+		EnsureWarm(key);
+		return;
+	}
+	if (n_conns_[key] >= MAX_CONNS_PER_HOST) {
+		waiting_[key].push_back(::std::move(pending));
+		return;
+	}
+	Connection* conn{};
+	try {
+		conn = Connect(key, pending.req);
+	} catch (Error const&) {
+		pending.cb(::std::current_exception(), {});
+		return;
+	}
+	Dispatch(*conn, ::std::move(pending));
+}
+
+void HttpLoop::Dispatch(Connection& conn, Pending pending)
+{
+	using State = Connection::State;
+
+	if (conn.timer) {
+		DisarmTimer(conn.timer);
+	}
+	conn.out = Serialize(pending.req);
+	conn.out_pos = 0;
+	conn.in.clear();
+	conn.resp = {};
+	conn.head_done = false;
+	conn.chunked = false;
+	conn.keep_alive = true;
+	conn.until_close = false;
+	conn.content_length = 0;
+	auto timeout = pending.req.timeout;
+	conn.pending = ::std::move(pending);
+	conn.timer = ArmTimer(Clock::now() + timeout, [this, id = conn.id]() {
+		if (auto iconn = conns_.find(id); iconn != conns_.end()) {
+			iconn->second->timer = 0;
+			Fail(*iconn->second, ::std::make_exception_ptr(
+					TimeoutError{"http request timed out"}));
+		}
+	});
+	if (conn.state == State::IDLE) {
+		conn.state = State::SENDING;
+		Drive(conn, EPOLLOUT);
+	}
+}
+
+HttpLoop::Connection* HttpLoop::Connect(::std::string const& key, Request const& req)
+{
+	auto const& addr = Resolve(req.host, req.port);
+	auto fd = ::socket(addr.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw Error{ErrnoString("socket", errno)};
+	}
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (::connect(fd, reinterpret_cast<::sockaddr const*>(&addr.addr), addr.len) < 0 &&
+			errno != EINPROGRESS) {
+		auto err = errno;
+		::close(fd);
+		throw Error{ErrnoString("connect", err)};
+	}
+
+	auto conn = ::std::make_unique<Connection>();
+	conn->id = next_id_++;
+	conn->key = key;
+	conn->fd = fd;
+	conn->started = Clock::now();
+	if (req.tls) {
+		conn->ssl = ::SSL_new(ssl_ctx_);
+		if (!conn->ssl) {
+			::close(fd);
+			throw Error{"tls: " + SslError()};
+		}
+		::SSL_set_fd(conn->ssl, fd);
+		::SSL_set_tlsext_host_name(conn->ssl, req.host.c_str());
+		::SSL_set_connect_state(conn->ssl);
+		::SSL_set_ex_data(conn->ssl, SslIndex(), this);
+		SSL_set_app_data(conn->ssl, conn.get());
+		if (auto isession = sessions_.find(key); isession != sessions_.end()) {
+			::SSL_set_session(conn->ssl, isession->second);
+		}
+	}
+
+	::epoll_event ev{};
+	ev.events = EPOLLOUT;
+	ev.data.u64 = conn->id;
+	if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		auto err = errno;
+		if (conn->ssl) {
+			::SSL_free(conn->ssl);
+		}
+		::close(fd);
+		throw Error{ErrnoString("epoll_ctl", err)};
+	}
+	conn->watched = EPOLLOUT;
+
+	++n_conns_[key];
+	auto* result = conn.get();
+	conns_.emplace(result->id, ::std::move(conn));
+	return result;
+}
+
+// Resolution blocks the loop thread, so results are cached for DNS_TTL.
+HttpLoop::Address const& HttpLoop::Resolve(::std::string const& host, ::std::uint16_t port)
+{
+	auto port_str = ::std::to_string(port);
+	auto key = host + ":" + port_str;
+	auto now = Clock::now();
+	if (auto iaddr = dns_cache_.find(key); iaddr != dns_cache_.end() && iaddr->second.expires > now) {
+		return iaddr->second;
+	}
+	::addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	::addrinfo* res{};
+	if (auto rc = ::getaddrinfo(host.c_str(), port_str.c_str(), &hints, &res); rc) {
+		throw Error{::std::string{"resolve "}.append(host).append(": ").append(::gai_strerror(rc))};
+	}
+	auto addr = Address{};
+	::std::memcpy(&addr.addr, res->ai_addr, res->ai_addrlen);
+	addr.len = res->ai_addrlen;
+	addr.expires = now + DNS_TTL;
+	::freeaddrinfo(res);
+	return dns_cache_[key] = addr;
+}
+
+void HttpLoop::Drive(Connection& conn, ::std::uint32_t events)
+{
+	using State = Connection::State;
+
+	try {
+		if (conn.state == State::IDLE) {
+			// a pooled connection was closed by the server or got garbage
+			auto key = conn.key;
+			Close(conn);
+			Release(key);
+			return;
+		}
+		if (conn.state == State::CONNECTING) {
+			if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+				return;
+			}
+			int err{};
+			::socklen_t len = sizeof(err);
+			::getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err) {
+				throw Error{ErrnoString("connect", err)};
+			}
+			conn.state = conn.ssl ? State::HANDSHAKE : State::SENDING;
+		}
+		if (conn.state == State::HANDSHAKE) {
+			if (!Handshake(conn)) {
+				return;
+			}
+			conn.state = State::SENDING;
+		}
+		if (conn.state == State::SENDING && !conn.pending.cb) {
+			Park(conn);
+			return;
+		}
+		if (conn.state == State::SENDING) {
+			if (!Flush(conn)) {
+				return;
+			}
+			conn.state = State::RECEIVING;
+			Watch(conn, EPOLLIN);
+		}
+		if (conn.state == State::RECEIVING) {
+			auto eof = Fill(conn);
+			if (ParseResponse(conn, eof)) {
+				Complete(conn);
+				return;
+			}
+			if (eof) {
+				throw Error{"connection closed by peer"};
+			}
+		}
+	} catch (Error const&) {
+		// A pooled connection may have been closed by the server just before
+		// we reused it; give the request one more try on a fresh one. Once
+		// all of it is written the server may have acted on it, so only an
+		// idempotent request goes again from there.
+		if (conn.reused && !conn.head_done && conn.in.empty() && !conn.pending.attempt
+				&& (conn.state != State::RECEIVING || conn.pending.req.idempotent)) {
+			auto pending = ::std::move(conn.pending);
+			conn.pending = {};
+			++pending.attempt;
+			auto key = conn.key;
+			Close(conn);
+			Start(::std::move(pending));
+			Release(key);
+			return;
+		}
+		Fail(conn, ::std::current_exception());
+	}
+}
+
+bool HttpLoop::Handshake(Connection& conn)
+{
+	auto rc = ::SSL_do_handshake(conn.ssl);
+	if (rc == 1) {
+		++handshakes_;
+		resumed_ += ::SSL_session_reused(conn.ssl) ? 1 : 0;
+		handshake_us_ += ::std::chrono::duration_cast<::std::chrono::microseconds>(
+				Clock::now() - conn.started).count();
+		return true;
+	}
+	switch (::SSL_get_error(conn.ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+		Watch(conn, EPOLLIN);
+		return false;
+	case SSL_ERROR_WANT_WRITE:
+		Watch(conn, EPOLLOUT);
+		return false;
+	default:
+		// the cached session may be what the server refused
+		StoreSession(conn.key, nullptr);
+		throw Error{"tls handshake: " + SslError()};
+	}
+}
+
+bool HttpLoop::Flush(Connection& conn)
+{
+	while (conn.out_pos < conn.out.size()) {
+		auto data = conn.out.data() + conn.out_pos;
+		auto len = conn.out.size() - conn.out_pos;
+		if (conn.ssl) {
+			auto n = ::SSL_write(conn.ssl, data, static_cast<int>(::std::min<::std::size_t>(len, INT_MAX)));
+			if (n <= 0) {
+				switch (::SSL_get_error(conn.ssl, n)) {
+				case SSL_ERROR_WANT_READ:
+					Watch(conn, EPOLLIN);
+					return false;
+				case SSL_ERROR_WANT_WRITE:
+					Watch(conn, EPOLLOUT);
+					return false;
+				default:
+					throw Error{"tls write: " + SslError()};
+				}
+			}
+			conn.out_pos += n;
+		} else {
+			auto n = ::send(conn.fd, data, len, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					Watch(conn, EPOLLOUT);
+					return false;
+				}
+				throw Error{ErrnoString("send", errno)};
+			}
+			conn.out_pos += n;
+		}
+	}
+	conn.out.clear();
+	conn.out_pos = 0;
+	return true;
+}
+
+// Reads everything available; returns true once the peer has closed.
+bool HttpLoop::Fill(Connection& conn)
+{
+	::std::array<char, 16384> buf{};
+	for (;;) {
+		if (conn.ssl) {
+			auto n = ::SSL_read(conn.ssl, buf.data(), buf.size());
+			if (n > 0) {
+				conn.in.append(buf.data(), n);
+				continue;
+			}
+			switch (::SSL_get_error(conn.ssl, n)) {
+			case SSL_ERROR_WANT_READ:
+				Watch(conn, EPOLLIN);
+				return false;
+			case SSL_ERROR_WANT_WRITE:
+				Watch(conn, EPOLLOUT);
+				return false;
+			case SSL_ERROR_ZERO_RETURN:
+			case SSL_ERROR_SYSCALL: // a truncated close, judged by the framing
+				::ERR_clear_error();
+				return true;
+			default:
+				throw Error{"tls read: " + SslError()};
+			}
+		} else {
+			auto n = ::recv(conn.fd, buf.data(), buf.size(), 0);
+			if (n > 0) {
+				conn.in.append(buf.data(), n);
+				continue;
+			}
+			if (!n) {
+				return true;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				Watch(conn, EPOLLIN);
+				return false;
+			}
+			throw Error{ErrnoString("recv", errno)};
+		}
+	}
+}
+
+bool HttpLoop::ParseResponse(Connection& conn, bool eof)
+{
+	auto& in = conn.in;
+	auto& resp = conn.resp;
+
+	if (!conn.head_done) {
+		auto head_end = in.find("\r\n\r\n");
+		if (head_end == ::std::string::npos) {
+			return false;
+		}
+		auto head = ::std::string_view{in}.substr(0, head_end);
+		auto eol = head.find("\r\n");
+		auto status_line = head.substr(0, eol);
+		auto sp = status_line.find(' ');
+		if (status_line.substr(0, 5) != "HTTP/" || sp == ::std::string_view::npos) {
+			throw Error{"malformed http status line"};
+		}
+		auto rest = status_line.substr(sp + 1);
+		auto code = rest.substr(0, rest.find(' '));
+		if (auto [p, ec] = ::std::from_chars(code.data(), code.data() + code.size(), resp.status);
+				ec != ::std::errc{}) {
+			throw Error{"malformed http status code"};
+		}
+		if (auto sp2 = rest.find(' '); sp2 != ::std::string_view::npos) {
+			resp.reason = rest.substr(sp2 + 1);
+		}
+		conn.keep_alive = (status_line.substr(0, 8) != "HTTP/1.0");
+
+		auto lines = (eol == ::std::string_view::npos) ? ::std::string_view{} : head.substr(eol + 2);
+		while (!lines.empty()) {
+			auto next = lines.find("\r\n");
+			auto line = lines.substr(0, next);
+			lines = (next == ::std::string_view::npos) ? ::std::string_view{} : lines.substr(next + 2);
+			auto colon = line.find(':');
+			if (colon == ::std::string_view::npos) {
+				continue;
+			}
+			resp.headers.emplace_back(Trim(line.substr(0, colon)), Trim(line.substr(colon + 1)));
+		}
+		in.erase(0, head_end + 4);
+		conn.head_done = true;
+
+		if (auto v = resp.Header("Connection")) {
+			if (IEquals(*v, "close")) {
+				conn.keep_alive = false;
+			} else if (IEquals(*v, "keep-alive")) {
+				conn.keep_alive = true;
+			}
+		}
+		if (auto v = resp.Header("Transfer-Encoding"); v && v->find("chunked") != ::std::string::npos) {
+			conn.chunked = true;
+		} else if (auto v = resp.Header("Content-Length")) {
+			if (auto [p, ec] = ::std::from_chars(v->data(), v->data() + v->size(), conn.content_length);
+					ec != ::std::errc{}) {
+				throw Error{"malformed http content length"};
+			}
+		} else if (resp.status == 204 || resp.status == 304 || resp.status / 100 == 1) {
+			conn.content_length = 0;
+		} else {
+			conn.until_close = true;
+			conn.keep_alive = false;
+		}
+	}
+
+	if (conn.chunked) {
+		for (;;) {
+			auto eol = in.find("\r\n");
+			if (eol == ::std::string::npos) {
+				return false;
+			}
+			::std::size_t size{};
+			if (auto [p, ec] = ::std::from_chars(in.data(), in.data() + eol, size, 16); ec != ::std::errc{}) {
+				throw Error{"malformed http chunk size"};
+			}
+			if (!size) {
+				// the last chunk is followed by optional trailers and an empty line
+				if (!in.compare(eol + 2, 2, "\r\n")) {
+					in.erase(0, eol + 4);
+					return true;
+				}
+				auto trailers_end = in.find("\r\n\r\n", eol + 2);
+				if (trailers_end == ::std::string::npos) {
+					return false;
+				}
+				in.erase(0, trailers_end + 4);
+				return true;
+			}
+			if (in.size() < eol + 2 + size + 2) {
+				return false;
+			}
+			resp.body.append(in, eol + 2, size);
+			in.erase(0, eol + 2 + size + 2);
+		}
+	}
+
+	if (conn.until_close) {
+		resp.body.append(in);
+		in.clear();
+		return eof;
+	}
+
+	if (in.size() < conn.content_length) {
+		return false;
+	}
+	if (in.size() == conn.content_length) {
+		resp.body = ::std::move(in);
+		in.clear();
+	} else {
+		resp.body.assign(in, 0, conn.content_length);
+		in.erase(0, conn.content_length);
+	}
+	return true;
+}
+
+void HttpLoop::Watch(Connection& conn, ::std::uint32_t events)
+{
+	if (conn.watched == events) {
+		return;
+	}
+	::epoll_event ev{};
+	ev.events = events;
+	ev.data.u64 = conn.id;
+	if (::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev) < 0) {
+		throw Error{ErrnoString("epoll_ctl", errno)};
+	}
+	conn.watched = events;
+}
+
+void HttpLoop::Complete(Connection& conn)
+{
+	using State = Connection::State;
+
+	DisarmTimer(conn.timer);
+	conn.timer = 0;
+	auto pending = ::std::move(conn.pending);
+	conn.pending = {};
+	auto resp = ::std::move(conn.resp);
+	conn.resp = {};
+	auto key = conn.key;
+
+	if (conn.keep_alive && conn.in.empty()) {
+		conn.state = State::IDLE;
+		Watch(conn, EPOLLIN);
+		if (auto& waiting = waiting_[key]; !waiting.empty()) {
+			auto next = ::std::move(waiting.front());
+			waiting.pop_front();
+			conn.reused = true;
+			Dispatch(conn, ::std::move(next));
+		} else if (auto& idle = idle_[key]; idle.size() < MAX_IDLE_PER_HOST) {
+			idle.push_back(conn.id);
+		} else {
+			Close(conn);
+		}
+	} else {
+		Close(conn);
+		Release(key);
+	}
+	pending.cb(nullptr, ::std::move(resp));
+}
+
+void HttpLoop::Fail(Connection& conn, ::std::exception_ptr ex)
+{
+	auto pending = ::std::move(conn.pending);
+	conn.pending = {};
+	auto key = conn.key;
+	Close(conn);
+	if (pending.cb) {
+		pending.cb(ex, {});
+	}
+	Release(key);
+}
+
+void HttpLoop::Close(Connection& conn)
+{
+	if (conn.timer) {
+		DisarmTimer(conn.timer);
+	}
+	auto& idle = idle_[conn.key];
+	idle.erase(::std::remove(idle.begin(), idle.end(), conn.id), idle.end());
+	--n_conns_[conn.key];
+	if (auto iwarm = warm_.find(conn.key); iwarm != warm_.end() && iwarm->second.standby == conn.id) {
+		auto& warm = iwarm->second;
+		warm.standby = 0;
+		warm.retry_at = Clock::now() + WARM_RETRY_DELAY;
+		ArmTimer(warm.retry_at, [this, key = conn.key]() { EnsureWarm(key); });
+	}
+	::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+	if (conn.ssl) {
+		::SSL_shutdown(conn.ssl); // best effort close_notify, never waited for
+		::SSL_free(conn.ssl);
+		::ERR_clear_error();
+	}
+	::close(conn.fd);
+	conns_.erase(conn.id);
+}
+
+// Starts a request that was queued behind the per-host connection limit.
+void HttpLoop::Release(::std::string const& key)
+{
+	auto iwaiting = waiting_.find(key);
+	if (iwaiting == waiting_.end() || iwaiting->second.empty() ||
+			n_conns_[key] >= MAX_CONNS_PER_HOST) {
+		EnsureWarm(key);
+		return;
+	}
+	auto pending = ::std::move(iwaiting->second.front());
+	iwaiting->second.pop_front();
+	Start(::std::move(pending));
+}
+
+// Opens the standby connection for a KeepWarm() host unless an idle one is
+// already pooled or one is on its way.
+void HttpLoop::EnsureWarm(::std::string const& key)
+{
+	auto iwarm = warm_.find(key);
+	if (stop_ || iwarm == warm_.end()) {
+		return;
+	}
+	auto& warm = iwarm->second;
+	auto now = Clock::now();
+	if (warm.standby || !idle_[key].empty() || n_conns_[key] >= MAX_CONNS_PER_HOST ||
+			now < warm.retry_at) {
+		return;
+	}
+	Connection* conn{};
+	try {
+		conn = Connect(key, warm.req);
+	} catch (Error const& e) {
+		Logger::Warning("http", "warm connect failed")("host", key)("error", e.what());
+		warm.retry_at = now + WARM_RETRY_DELAY;
+		ArmTimer(warm.retry_at, [this, key]() { EnsureWarm(key); });
+		return;
+	}
+	conn->spare = true;
+	warm.standby = conn->id;
+	conn->timer = ArmTimer(now + warm.req.timeout, [this, id = conn->id]() {
+		if (auto iconn = conns_.find(id); iconn != conns_.end()) {
+			iconn->second->timer = 0;
+			Fail(*iconn->second, ::std::make_exception_ptr(
+					TimeoutError{"http connect timed out"}));
+		}
+	});
+}
+
+// A standby finished connecting with no request attached; pool it.
+void HttpLoop::Park(Connection& conn)
+{
+	DisarmTimer(conn.timer);
+	conn.timer = 0;
+	conn.state = Connection::State::IDLE;
+	Watch(conn, EPOLLIN);
+	if (auto iwarm = warm_.find(conn.key); iwarm != warm_.end() && iwarm->second.standby == conn.id) {
+		iwarm->second.standby = 0;
+	}
+	if (auto& waiting = waiting_[conn.key]; !waiting.empty()) {
+		auto next = ::std::move(waiting.front());
+		waiting.pop_front();
+		conn.spare = false;
+		++standby_used_;
+		Dispatch(conn, ::std::move(next));
+		return;
+	}
+	idle_[conn.key].push_back(conn.id);
+}
+
+void HttpLoop::StoreSession(::std::string const& key, SSL_SESSION* session)
+{
+	auto isession = sessions_.find(key);
+	if (isession != sessions_.end()) {
+		::SSL_SESSION_free(isession->second);
+		sessions_.erase(isession);
+	}
+	if (session) {
+		sessions_.emplace(key, session);
+	}
+}
+
+void HttpLoop::Abort(::std::exception_ptr ex)
+{
+	for (auto& [id, conn] : conns_) {
+		if (conn->pending.cb) {
+			conn->pending.cb(ex, {});
+		}
+		if (conn->ssl) {
+			::SSL_free(conn->ssl);
+		}
+		::close(conn->fd);
+	}
+	conns_.clear();
+	for (auto& [key, waiting] : waiting_) {
+		for (auto& pending : waiting) {
+			pending.cb(ex, {});
+		}
+	}
+	waiting_.clear();
+}
+
+::std::string HttpLoop::Serialize(Request const& req)
+{
+	auto out = ::std::string{};
+	out.reserve(256 + req.target.size() + req.body.size());
+	out.append(req.method).append(" ").append(req.target).append(" HTTP/1.1\r\n");
+	out.append("Host: ").append(req.host);
+	if (req.port != (req.tls ? 443 : 80)) {
+		out.append(":").append(::std::to_string(req.port));
+	}
+	out.append("\r\n");
+	for (auto const& [name, value] : req.headers) {
+		out.append(name).append(": ").append(value).append("\r\n");
+	}
+	if (!req.body.empty() || req.method == "POST") {
+		out.append("Content-Length: ").append(::std::to_string(req.body.size())).append("\r\n");
+	}
+	out.append("\r\n");
+	out.append(req.body);
+	return out;
+}
+
+::std::string HttpLoop::KeyOf(Request const& req)
+{
+	return ::std::string{req.tls ? "https://" : "http://"}
+		.append(req.host).append(":").append(::std::to_string(req.port));
+}
+
+// Runs inside SSL calls on the loop thread, for every SSL_CTX user; only
+// connections of this loop carry the ex data.
+int HttpLoop::OnNewSession(SSL* ssl, SSL_SESSION* session)
+{
+	auto* loop = static_cast<HttpLoop*>(::SSL_get_ex_data(ssl, SslIndex()));
+	auto* conn = static_cast<Connection*>(SSL_get_app_data(ssl));
+	if (!loop || !conn) {
+		return 0;
+	}
+	loop->StoreSession(conn->key, session);
+	return 1; // the reference is ours now
+}
+
+int HttpLoop::SslIndex()
+{
+	static int const index = ::SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+	return index;
+}
+
+::std::string HttpLoop::SslError()
+{
+	auto code = ::ERR_get_error();
+	::ERR_clear_error();
+	if (!code) {
+		return "unknown error";
+	}
+	::std::array<char, 256> buf{};
+	::ERR_error_string_n(code, buf.data(), buf.size());
+	return buf.data();
+}
+
+// vim: set ts=4 sw=4 noet :
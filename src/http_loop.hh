@@ -0,0 +1,216 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+
+// Non-blocking HTTP/1.1 client. One event loop thread multiplexes every
+// request over epoll, TLS runs on non-blocking sockets, and keep-alive
+// connections are pooled per (host, port, tls). Callbacks and timers run on
+// the loop thread and must not block. TLS sessions are cached per host and
+// resumed on reconnect.
+class HttpLoop {
+public:
+	using Clock = ::std::chrono::steady_clock;
+	using Headers = ::std::vector<::std::pair<::std::string, ::std::string>>;
+	using TimerId = ::std::uint64_t;
+
+	struct Request {
+		::std::string method{"GET"};
+		::std::string host{};
+		::std::uint16_t port{80};
+		bool tls{false};
+		::std::string target{"/"};
+		Headers headers{};
+		::std::string body{};
+		::std::chrono::milliseconds timeout{10000};
+		// safe to send again once the server may have seen it
+		bool idempotent{false};
+	};
+
+	struct Response {
+		int status{};
+		::std::string reason{};
+		Headers headers{};
+		::std::string body{};
+
+		::std::string const* Header(::std::string_view name) const;
+		// the header is there with this value, both ignoring case
+		bool HeaderIs(::std::string_view name, ::std::string_view value) const;
+	};
+
+	struct Error : ::std::runtime_error {
+		using ::std::runtime_error::runtime_error;
+	};
+
+	struct TimeoutError : Error {
+		using Error::Error;
+	};
+
+	using Callback = ::std::function<void(::std::exception_ptr, Response)>;
+
+	struct Stats {
+		::std::uint64_t handshakes{};
+		::std::uint64_t resumed{};
+		// connect plus TLS handshake, summed over all handshakes
+		::std::chrono::microseconds handshake_time{};
+		::std::uint64_t standby_used{};
+	};
+
+	explicit HttpLoop(SSL_CTX* ssl_ctx);
+	~HttpLoop();
+
+	HttpLoop(HttpLoop const&) = delete;
+	HttpLoop& operator=(HttpLoop const&) = delete;
+
+	void Submit(Request req, Callback cb);
+	::std::future<Response> Submit(Request req);
+	// Blocks the caller until the response arrives; never call it from the
+	// loop thread itself.
+	Response Execute(Request req);
+
+	TimerId AddTimer(::std::chrono::milliseconds delay, ::std::function<void()> fn);
+	void CancelTimer(TimerId id);
+	void Post(::std::function<void()> fn);
+
+	// Keeps one spare connection to the host of req connected and, for TLS,
+	// handshaken, so a request never waits for a connect on the critical
+	// path. Only host, port, tls and timeout are used.
+	void KeepWarm(Request req);
+
+	Stats GetStats() const;
+
+private:
+	static constexpr ::std::size_t MAX_CONNS_PER_HOST = 8;
+	static constexpr ::std::size_t MAX_IDLE_PER_HOST = 4;
+	static constexpr int MAX_EVENTS = 64;
+	static constexpr auto DNS_TTL = ::std::chrono::minutes{5};
+	static constexpr auto WARM_RETRY_DELAY = ::std::chrono::seconds{5};
+
+	struct Pending {
+		Request req{};
+		Callback cb{};
+		int attempt{};
+	};
+
+	struct Connection {
+		enum class State {
+			CONNECTING, HANDSHAKE, SENDING, RECEIVING, IDLE
+		};
+
+		::std::uint64_t id{};
+		::std::string key{};
+		int fd{-1};
+		SSL* ssl{};
+		State state{State::CONNECTING};
+		::std::uint32_t watched{};
+		bool reused{};
+		Clock::time_point started{};
+		bool spare{}; // opened by EnsureWarm and not used yet
+
+		Pending pending{};
+		TimerId timer{};
+		::std::string out{};
+		::std::size_t out_pos{};
+		::std::string in{};
+
+		Response resp{};
+		bool head_done{};
+		bool chunked{};
+		bool keep_alive{true};
+		bool until_close{};
+		::std::size_t content_length{};
+	};
+
+	struct Warm {
+		Request req{};
+		::std::uint64_t standby{}; // connection still connecting, if any
+		Clock::time_point retry_at{};
+	};
+
+	struct Address {
+		::sockaddr_storage addr{};
+		::socklen_t len{};
+		Clock::time_point expires{};
+	};
+
+	SSL_CTX* ssl_ctx_{};
+	int epoll_fd_{-1};
+	int wake_fd_{-1};
+	bool stop_{false};
+	::std::atomic<TimerId> next_timer_id_{1};
+	::std::thread thread_{};
+
+	::std::atomic<::std::uint64_t> handshakes_{};
+	::std::atomic<::std::uint64_t> resumed_{};
+	::std::atomic<::std::int64_t> handshake_us_{};
+	::std::atomic<::std::uint64_t> standby_used_{};
+
+	::std::mutex mutex_{};
+	::std::vector<::std::function<void()>> incoming_{};
+
+	// Everything below is owned by the loop thread.
+	::std::uint64_t next_id_{1};
+	::std::unordered_map<::std::uint64_t, ::std::unique_ptr<Connection>> conns_{};
+	::std::unordered_map<::std::string, ::std::vector<::std::uint64_t>> idle_{};
+	::std::unordered_map<::std::string, ::std::size_t> n_conns_{};
+	::std::unordered_map<::std::string, ::std::deque<Pending>> waiting_{};
+	::std::unordered_map<::std::string, Address> dns_cache_{};
+	::std::unordered_map<::std::string, SSL_SESSION*> sessions_{};
+	::std::unordered_map<::std::string, Warm> warm_{};
+	::std::map<::std::pair<Clock::time_point, TimerId>, ::std::function<void()>> timers_{};
+	::std::unordered_map<TimerId, Clock::time_point> timer_index_{};
+
+	void Loop();
+	void Wake();
+	void RunIncoming();
+	int RunTimers();
+	TimerId ArmTimer(Clock::time_point when, ::std::function<void()> fn);
+	void ArmTimer(TimerId id, Clock::time_point when, ::std::function<void()> fn);
+	void DisarmTimer(TimerId id);
+
+	void Start(Pending pending);
+	void Dispatch(Connection& conn, Pending pending);
+	Connection* Connect(::std::string const& key, Request const& req);
+	Address const& Resolve(::std::string const& host, ::std::uint16_t port);
+	void Drive(Connection& conn, ::std::uint32_t events);
+	bool Handshake(Connection& conn);
+	bool Flush(Connection& conn);
+	bool Fill(Connection& conn);
+	bool ParseResponse(Connection& conn, bool eof);
+	void Watch(Connection& conn, ::std::uint32_t events);
+	void Complete(Connection& conn);
+	void Fail(Connection& conn, ::std::exception_ptr ex);
+	void Close(Connection& conn);
+	void Release(::std::string const& key);
+	void Abort(::std::exception_ptr ex);
+	void EnsureWarm(::std::string const& key);
+	void Park(Connection& conn);
+	void StoreSession(::std::string const& key, SSL_SESSION* session);
+
+	static ::std::string Serialize(Request const& req);
+	static ::std::string KeyOf(Request const& req);
+	static ::std::string SslError();
+	static int OnNewSession(SSL* ssl, SSL_SESSION* session);
+	static int SslIndex();
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,799 @@
+#include "log_storage.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Poco/Checksum.h>
+
+#include "day_number.hh"
+#include "logger.hh"
+
+namespace {
+
+::std::runtime_error SystemError(::std::string const& what)
+{
+	return ::std::runtime_error{"storage: " + what + ": " + ::std::strerror(errno)};
+}
+
+template<typename T>
+	T ReadValue(char const* p)
+{
+	T value{};
+	::std::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+template<typename T>
+	void AppendValue(::std::string& out, T value)
+{
+	out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+::std::uint32_t RecordCrc(char const* header, ::std::string_view payload)
+{
+	auto crc = ::Poco::Checksum{::Poco::Checksum::TYPE_CRC32};
+	crc.update(header, 4);
+	crc.update(payload.data(), static_cast<unsigned>(payload.size()));
+	return crc.checksum();
+}
+
+void WriteAll(int fd, ::std::string const& data)
+{
+	for (::std::size_t done = 0; done < data.size();) {
+		auto n = ::write(fd, data.data() + done, data.size() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			throw SystemError("write");
+		}
+		done += n;
+	}
+}
+
+::std::int64_t UnixNow()
+{
+	return ::std::chrono::duration_cast<::std::chrono::seconds>(
+		::std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+LogStorage::LogStorage(::std::string path)
+	: path_{::std::move(path)}
+{
+	Open();
+	Load();
+	// A legacy invite is given its expiry when it is loaded. Compacting
+	// writes that down, or each restart would give it another week.
+	if (legacy_invites_) {
+		Logger::Info("storage", "fixing legacy invite expiry")("records", legacy_invites_);
+		Compact();
+		legacy_invites_ = 0;
+	}
+}
+
+LogStorage::~LogStorage()
+{
+	Unmap();
+	::close(fd_);
+}
+
+bool LogStorage::IsUserRegistered(UserId user_id)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return users_.count(user_id) != 0;
+}
+
+void LogStorage::RegisterUser(UserId user_id)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto payload = ::std::string{};
+	AppendValue(payload, user_id);
+	auto from = tail_;
+	Append(Op::USER, payload);
+	if (!Replay(Op::USER, payload, false)) {
+		::std::memset(map_ + from, 0, tail_ - from);
+		tail_ = from;
+		return;
+	}
+	Sync(from);
+}
+
+::std::vector<Storage::UserId> LogStorage::GetRegisteredUsers()
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return {users_.begin(), users_.end()};
+}
+
+void LogStorage::PushInvite(::std::string const& invite, UserId invited_by, ::std::chrono::seconds ttl)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto payload = EncodeInvite(invite, {invited_by, UnixNow() + ttl.count()});
+	auto from = tail_;
+	Append(Op::INVITE, payload);
+	Replay(Op::INVITE, payload, false);
+	Sync(from);
+}
+
+bool LogStorage::PopInvite(::std::string const& invite)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto iinvite = invites_.find(invite);
+	if (iinvite == invites_.end() || iinvite->second.expires_at <= UnixNow()) {
+		return false;
+	}
+	auto from = tail_;
+	Append(Op::INVITE_POP, invite);
+	Replay(Op::INVITE_POP, invite, false);
+	Sync(from);
+	return true;
+}
+
+::std::size_t LogStorage::PurgeInvites(::std::size_t limit)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto now = UnixNow();
+	auto expired = ::std::vector<::std::string>{};
+	for (auto const& [invite, state] : invites_) {
+		if (expired.size() == limit) {
+			break;
+		}
+		if (state.expires_at <= now) {
+			expired.push_back(invite);
+		}
+	}
+	if (expired.empty()) {
+		return 0;
+	}
+	auto from = tail_;
+	for (auto const& invite : expired) {
+		Append(Op::INVITE_POP, invite);
+		Replay(Op::INVITE_POP, invite, false);
+	}
+	Sync(from);
+	return expired.size();
+}
+
+::std::vector<::std::pair<int, Storage::UserId>> LogStorage::ReadAttendances(
+		int first_day, int last_day)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto first = attendances_.lower_bound({first_day, ::std::numeric_limits<UserId>::min()});
+	auto last = attendances_.upper_bound({last_day, ::std::numeric_limits<UserId>::max()});
+	return {first, last};
+}
+
+::std::vector<::std::pair<int, ::std::size_t>> LogStorage::CountAttendances(
+		int first_day, int last_day)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto first = attendances_.lower_bound({first_day, ::std::numeric_limits<UserId>::min()});
+	auto last = attendances_.upper_bound({last_day, ::std::numeric_limits<UserId>::max()});
+	auto result = ::std::vector<::std::pair<int, ::std::size_t>>{};
+	for (auto it = first; it != last; ++it) {
+		if (result.empty() || result.back().first != it->first) {
+			result.emplace_back(it->first, 0);
+		}
+		++result.back().second;
+	}
+	return result;
+}
+
+void LogStorage::ApplyAttendances(::std::vector<Change> const& batch)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto from = tail_;
+	for (auto const& change : batch) {
+		auto op = change.remove ? Op::UNATTEND : Op::ATTEND;
+		auto payload = EncodeAttendance(change.day, change.user_id);
+		auto at = tail_;
+		Append(op, payload);
+		if (!Replay(op, payload, false)) {
+			::std::memset(map_ + at, 0, tail_ - at);
+			tail_ = at;
+		}
+	}
+	if (tail_ != from) {
+		Sync(from);
+	}
+}
+
+Storage::Stats LogStorage::ReadStats(int first_month, int last_month)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto stats = Stats{};
+	auto first = monthly_.lower_bound({first_month, ::std::numeric_limits<UserId>::min()});
+	auto last = monthly_.upper_bound({last_month, ::std::numeric_limits<UserId>::max()});
+	for (auto it = first; it != last; ++it) {
+		stats.users.push_back({it->first.first, it->first.second, it->second});
+	}
+	auto next_month = last_month + 1;
+	auto iday = daily_.lower_bound(DaysFromCivil(first_month / 12, first_month % 12 + 1, 1));
+	auto iend = daily_.lower_bound(DaysFromCivil(next_month / 12, next_month % 12 + 1, 1));
+	for (; iday != iend; ++iday) {
+		int year{}, month{}, mday{};
+		CivilFromDays(iday->first, year, month, mday);
+		auto month_number = year * 12 + month - 1;
+		if (stats.months.empty() || stats.months.back().month != month_number) {
+			stats.months.push_back({month_number, 0, 0});
+		}
+		auto& summary = stats.months.back();
+		summary.busiest_day = ::std::max(summary.busiest_day, iday->second);
+		++summary.active_days;
+	}
+	return stats;
+}
+
+::std::int64_t LogStorage::CreateBroadcast(UserId created_by, ::std::string const& text,
+		::std::vector<UserId> const& recipients)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto id = next_broadcast_id_++;
+	if (recipients.empty()) {
+		return id; // finished before it started, nothing to keep
+	}
+	auto state = BroadcastState{};
+	state.created_by = created_by;
+	state.text = text;
+	for (auto user_id : recipients) {
+		state.recipients.emplace(user_id, Delivery::PENDING);
+	}
+	auto from = tail_;
+	for (auto const& [op, payload] : EncodeBroadcast(id, state)) {
+		Append(op, payload);
+		Replay(op, payload, false);
+	}
+	Sync(from);
+	return id;
+}
+
+::std::vector<Storage::Broadcast> LogStorage::ReadUnfinishedBroadcasts()
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto broadcasts = ::std::vector<Broadcast>{};
+	for (auto const& [id, state] : broadcasts_) {
+		if (!state.pending) {
+			continue;
+		}
+		auto& broadcast = broadcasts.emplace_back();
+		broadcast.id = id;
+		broadcast.created_by = state.created_by;
+		broadcast.text = state.text;
+		broadcast.total = state.recipients.size();
+		for (auto const& [user_id, delivery] : state.recipients) {
+			if (delivery == Delivery::PENDING) {
+				broadcast.pending.push_back(user_id);
+			}
+		}
+	}
+	return broadcasts;
+}
+
+void LogStorage::RecordDeliveries(::std::int64_t broadcast_id,
+		::std::vector<::std::pair<UserId, Delivery>> const& deliveries)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto from = tail_;
+	for (auto const& [user_id, delivery] : deliveries) {
+		if (delivery != Delivery::BLOCKED) {
+			continue;
+		}
+		auto payload = ::std::string{};
+		AppendValue(payload, user_id);
+		auto at = tail_;
+		Append(Op::BLOCK, payload);
+		if (!Replay(Op::BLOCK, payload, false)) {
+			::std::memset(map_ + at, 0, tail_ - at);
+			tail_ = at;
+		}
+	}
+	for (::std::size_t i = 0; i < deliveries.size(); i += USERS_PER_RECORD) {
+		auto payload = ::std::string{};
+		AppendValue(payload, broadcast_id);
+		for (auto j = i; j < ::std::min(i + USERS_PER_RECORD, deliveries.size()); ++j) {
+			AppendValue(payload, deliveries[j].first);
+			AppendValue(payload, static_cast<::std::uint8_t>(deliveries[j].second));
+		}
+		Append(Op::DELIVERIES, payload);
+		Replay(Op::DELIVERIES, payload, false);
+	}
+	if (tail_ != from) {
+		Sync(from);
+	}
+}
+
+::std::vector<Storage::UserId> LogStorage::GetBlockedUsers()
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return {blocked_.begin(), blocked_.end()};
+}
+
+bool LogStorage::IsUserBlocked(UserId user_id)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return blocked_.count(user_id) != 0;
+}
+
+void LogStorage::UnblockUser(UserId user_id)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (!blocked_.count(user_id)) {
+		return;
+	}
+	auto payload = ::std::string{};
+	AppendValue(payload, user_id);
+	auto from = tail_;
+	Append(Op::UNBLOCK, payload);
+	Replay(Op::UNBLOCK, payload, false);
+	Sync(from);
+}
+
+::std::vector<Storage::Reminder> LogStorage::ReadReminders()
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto reminders = ::std::vector<Reminder>{};
+	for (auto const& [user_id, minute] : reminders_) {
+		reminders.push_back({user_id, minute});
+	}
+	return reminders;
+}
+
+void LogStorage::SetReminder(UserId user_id, int minute)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (auto ireminder = reminders_.find(user_id); ireminder != reminders_.end()
+			&& ireminder->second == minute) {
+		return;
+	}
+	auto payload = ::std::string{};
+	AppendValue(payload, user_id);
+	AppendValue(payload, minute);
+	auto from = tail_;
+	Append(Op::REMINDER, payload);
+	Replay(Op::REMINDER, payload, false);
+	Sync(from);
+}
+
+void LogStorage::DeleteReminder(UserId user_id)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (!reminders_.count(user_id)) {
+		return;
+	}
+	auto payload = ::std::string{};
+	AppendValue(payload, user_id);
+	auto from = tail_;
+	Append(Op::UNREMINDER, payload);
+	Replay(Op::UNREMINDER, payload, false);
+	Sync(from);
+}
+
+void LogStorage::Maintain()
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (dead_ > live_ && tail_ > MIN_COMPACT_SIZE) {
+		Compact();
+	}
+}
+
+void LogStorage::Open()
+{
+	fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (fd_ < 0) {
+		throw SystemError("open " + path_);
+	}
+	struct ::stat st{};
+	if (::fstat(fd_, &st) < 0) {
+		throw SystemError("stat " + path_);
+	}
+	auto size = static_cast<::std::size_t>(st.st_size);
+	if (!size) {
+		if (::ftruncate(fd_, MIN_CAPACITY) < 0) {
+			throw SystemError("truncate " + path_);
+		}
+		Map(MIN_CAPACITY);
+		::std::memcpy(map_, MAGIC, sizeof(MAGIC));
+		::std::memcpy(map_ + sizeof(MAGIC), &VERSION, sizeof(VERSION));
+		Sync(0);
+		return;
+	}
+	if (size < FILE_HEADER_SIZE) {
+		throw ::std::runtime_error{"storage: " + path_ + " is truncated"};
+	}
+	Map(size);
+	if (::std::memcmp(map_, MAGIC, sizeof(MAGIC)) ||
+			ReadValue<::std::uint32_t>(map_ + sizeof(MAGIC)) != VERSION) {
+		throw ::std::runtime_error{"storage: " + path_ + " is not a version " +
+			::std::to_string(VERSION) + " log"};
+	}
+}
+
+void LogStorage::Map(::std::size_t capacity)
+{
+	auto p = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (p == MAP_FAILED) {
+		throw SystemError("mmap " + path_);
+	}
+	map_ = static_cast<char*>(p);
+	capacity_ = capacity;
+}
+
+void LogStorage::Unmap()
+{
+	if (!map_) {
+		return;
+	}
+	::msync(map_, tail_, MS_SYNC);
+	::munmap(map_, capacity_);
+	map_ = nullptr;
+	capacity_ = 0;
+}
+
+void LogStorage::Load()
+{
+	auto pos = FILE_HEADER_SIZE;
+	while (pos + RECORD_HEADER_SIZE <= capacity_) {
+		auto header = map_ + pos;
+		auto op = static_cast<Op>(header[0]);
+		if (op == Op::END) {
+			break;
+		}
+		auto size = ReadValue<::std::uint16_t>(header + 2);
+		auto end = pos + RECORD_HEADER_SIZE + size;
+		auto payload = ::std::string_view{header + RECORD_HEADER_SIZE, size};
+		if (end > capacity_ || op > Op::INVITE ||
+				ReadValue<::std::uint32_t>(header + 4) != RecordCrc(header, payload)) {
+			// a record torn by a crash mid-write ends the log
+			Logger::Warning("storage", "discarding log tail")("offset", pos);
+			::std::memset(header, 0, capacity_ - pos);
+			break;
+		}
+		Replay(op, payload, true);
+		pos = end;
+	}
+	tail_ = pos;
+}
+
+// Applies a record to the index and reports whether it changed anything.
+bool LogStorage::Replay(Op op, ::std::string_view payload, bool loading)
+{
+	auto expect = [&](bool ok) {
+		if (!ok) {
+			throw ::std::runtime_error{"storage: malformed record in " + path_};
+		}
+	};
+	auto changed = true;
+	switch (op) {
+	case Op::USER:
+		expect(payload.size() == sizeof(UserId));
+		changed = users_.insert(ReadValue<UserId>(payload.data())).second;
+		live_ += changed;
+		break;
+	case Op::INVITE_PUSH:
+	case Op::INVITE: {
+		auto state = InviteState{};
+		auto header = sizeof(UserId);
+		if (op == Op::INVITE) {
+			header += sizeof(::std::int64_t);
+			expect(payload.size() > header);
+			state.expires_at = ReadValue<::std::int64_t>(payload.data() + sizeof(UserId));
+		} else {
+			expect(payload.size() > header);
+			state.expires_at = UnixNow() + ::std::chrono::duration_cast<::std::chrono::seconds>(
+				LEGACY_INVITE_TTL).count();
+			legacy_invites_ += loading;
+		}
+		state.invited_by = ReadValue<UserId>(payload.data());
+		auto inserted = invites_.insert_or_assign(::std::string{payload.substr(header)}, state).second;
+		// a replaced invite leaves its old record behind
+		(inserted ? live_ : dead_) += 1;
+		break;
+	}
+	case Op::INVITE_POP:
+		changed = invites_.erase(::std::string{payload}) != 0;
+		break;
+	case Op::ATTEND:
+	case Op::UNATTEND: {
+		expect(payload.size() == sizeof(int) + sizeof(UserId));
+		auto key = ::std::pair{ReadValue<int>(payload.data()), ReadValue<UserId>(payload.data() + sizeof(int))};
+		if (op == Op::ATTEND) {
+			changed = attendances_.insert(key).second;
+			live_ += changed;
+		} else {
+			changed = attendances_.erase(key) != 0;
+		}
+		if (changed) {
+			Roll(key.first, key.second, op == Op::ATTEND ? +1 : -1);
+		}
+		break;
+	}
+	case Op::BROADCAST:
+	case Op::RECIPIENTS:
+	case Op::DELIVERIES:
+		ReplayBroadcast(op, payload);
+		return true;
+	case Op::BLOCK:
+		expect(payload.size() == sizeof(UserId));
+		changed = blocked_.insert(ReadValue<UserId>(payload.data())).second;
+		live_ += changed;
+		break;
+	case Op::UNBLOCK:
+		expect(payload.size() == sizeof(UserId));
+		changed = blocked_.erase(ReadValue<UserId>(payload.data())) != 0;
+		break;
+	case Op::REMINDER: {
+		expect(payload.size() == sizeof(UserId) + sizeof(int));
+		auto inserted = reminders_.insert_or_assign(ReadValue<UserId>(payload.data()),
+			ReadValue<int>(payload.data() + sizeof(UserId))).second;
+		// a replaced reminder leaves its old record behind
+		(inserted ? live_ : dead_) += 1;
+		break;
+	}
+	case Op::UNREMINDER:
+		expect(payload.size() == sizeof(UserId));
+		changed = reminders_.erase(ReadValue<UserId>(payload.data())) != 0;
+		break;
+	default:
+		expect(false);
+	}
+	if ((op == Op::INVITE_POP || op == Op::UNATTEND || op == Op::UNBLOCK || op == Op::UNREMINDER)
+			&& changed) {
+		// the removal and the record it cancels are both garbage now
+		--live_;
+		dead_ += 2;
+	}
+	if (!changed && loading) {
+		++dead_;
+	}
+	return changed;
+}
+
+// Broadcast records do their own accounting: they stay live while their
+// broadcast has anyone pending.
+void LogStorage::ReplayBroadcast(Op op, ::std::string_view payload)
+{
+	auto expect = [&](bool ok) {
+		if (!ok) {
+			throw ::std::runtime_error{"storage: malformed record in " + path_};
+		}
+	};
+	expect(payload.size() >= sizeof(::std::int64_t));
+	auto id = ReadValue<::std::int64_t>(payload.data());
+	payload.remove_prefix(sizeof(id));
+	if (op == Op::BROADCAST) {
+		expect(payload.size() >= sizeof(UserId));
+		auto& state = broadcasts_[id];
+		state.created_by = ReadValue<UserId>(payload.data());
+		state.text = ::std::string{payload.substr(sizeof(UserId))};
+		state.records = 1;
+		++live_;
+		next_broadcast_id_ = ::std::max(next_broadcast_id_, id + 1);
+		return;
+	}
+	auto ibroadcast = broadcasts_.find(id);
+	if (ibroadcast == broadcasts_.end()) {
+		++dead_;
+		return;
+	}
+	auto& state = ibroadcast->second;
+	++state.records;
+	++live_;
+	if (op == Op::RECIPIENTS) {
+		expect(payload.size() % sizeof(UserId) == 0);
+		for (::std::size_t pos = 0; pos < payload.size(); pos += sizeof(UserId)) {
+			auto user_id = ReadValue<UserId>(payload.data() + pos);
+			state.pending += state.recipients.emplace(user_id, Delivery::PENDING).second;
+		}
+		return;
+	}
+	constexpr auto ENTRY_SIZE = sizeof(UserId) + 1;
+	expect(payload.size() % ENTRY_SIZE == 0);
+	for (::std::size_t pos = 0; pos < payload.size(); pos += ENTRY_SIZE) {
+		auto irecipient = state.recipients.find(ReadValue<UserId>(payload.data() + pos));
+		auto delivery = static_cast<Delivery>(payload[pos + sizeof(UserId)]);
+		if (irecipient == state.recipients.end()) {
+			continue;
+		}
+		if (irecipient->second == Delivery::PENDING && delivery != Delivery::PENDING) {
+			--state.pending;
+		}
+		irecipient->second = delivery;
+	}
+	if (!state.pending) {
+		live_ -= state.records;
+		dead_ += state.records;
+		broadcasts_.erase(ibroadcast);
+	}
+}
+
+void LogStorage::Roll(int day, UserId user_id, int delta)
+{
+	int year{}, month{}, mday{};
+	CivilFromDays(day, year, month, mday);
+	auto imonthly = monthly_.try_emplace({year * 12 + month - 1, user_id}).first;
+	if (!(imonthly->second += delta)) {
+		monthly_.erase(imonthly);
+	}
+	auto idaily = daily_.try_emplace(day).first;
+	if (!(idaily->second += delta)) {
+		daily_.erase(idaily);
+	}
+}
+
+void LogStorage::Append(Op op, ::std::string_view payload)
+{
+	if (payload.size() > 0xffff) {
+		throw ::std::runtime_error{"storage: record too large"};
+	}
+	auto record = ::std::string{};
+	EncodeRecord(record, op, payload);
+	if (tail_ + record.size() > capacity_) {
+		auto capacity = capacity_;
+		while (tail_ + record.size() > capacity) {
+			capacity *= 2;
+		}
+		if (::ftruncate(fd_, capacity) < 0) {
+			throw SystemError("grow " + path_);
+		}
+		Unmap();
+		Map(capacity);
+	}
+	::std::memcpy(map_ + tail_, record.data(), record.size());
+	tail_ += record.size();
+}
+
+void LogStorage::Sync(::std::size_t from)
+{
+	auto page = static_cast<::std::size_t>(::sysconf(_SC_PAGESIZE));
+	auto start = from / page * page;
+	if (::msync(map_ + start, ::std::max(tail_, FILE_HEADER_SIZE) - start, MS_SYNC) < 0) {
+		throw SystemError("msync " + path_);
+	}
+}
+
+// Rewrites the live state into a fresh log and atomically replaces the
+// old file with it.
+void LogStorage::Compact()
+{
+	auto data = ::std::string{MAGIC, sizeof(MAGIC)};
+	AppendValue(data, VERSION);
+	data.resize(FILE_HEADER_SIZE, '\0');
+	for (auto user_id : users_) {
+		auto payload = ::std::string{};
+		AppendValue(payload, user_id);
+		EncodeRecord(data, Op::USER, payload);
+	}
+	for (auto const& [invite, state] : invites_) {
+		EncodeRecord(data, Op::INVITE, EncodeInvite(invite, state));
+	}
+	for (auto const& [day, user_id] : attendances_) {
+		EncodeRecord(data, Op::ATTEND, EncodeAttendance(day, user_id));
+	}
+	for (auto user_id : blocked_) {
+		auto payload = ::std::string{};
+		AppendValue(payload, user_id);
+		EncodeRecord(data, Op::BLOCK, payload);
+	}
+	for (auto const& [user_id, minute] : reminders_) {
+		auto payload = ::std::string{};
+		AppendValue(payload, user_id);
+		AppendValue(payload, minute);
+		EncodeRecord(data, Op::REMINDER, payload);
+	}
+	auto broadcast_records = ::std::size_t{};
+	for (auto& [id, state] : broadcasts_) {
+		auto records = EncodeBroadcast(id, state);
+		for (auto const& [op, payload] : records) {
+			EncodeRecord(data, op, payload);
+		}
+		state.records = records.size();
+		broadcast_records += records.size();
+	}
+	auto capacity = MIN_CAPACITY;
+	while (capacity < 2 * data.size()) {
+		capacity *= 2;
+	}
+
+	auto tmp_path = path_ + ".compact";
+	auto fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		throw SystemError("open " + tmp_path);
+	}
+	try {
+		WriteAll(fd, data);
+		if (::ftruncate(fd, capacity) < 0 || ::fdatasync(fd) < 0) {
+			throw SystemError("sync " + tmp_path);
+		}
+		if (::rename(tmp_path.c_str(), path_.c_str()) < 0) {
+			throw SystemError("rename " + tmp_path);
+		}
+	} catch (...) {
+		::close(fd);
+		::unlink(tmp_path.c_str());
+		throw;
+	}
+
+	auto old_size = tail_;
+	Unmap();
+	::close(fd_);
+	fd_ = fd;
+	Map(capacity);
+	tail_ = data.size();
+	live_ = users_.size() + invites_.size() + attendances_.size() + blocked_.size()
+		+ reminders_.size() + broadcast_records;
+	dead_ = 0;
+	Logger::Info("storage", "compacted")("from_bytes", old_size)("to_bytes", tail_);
+}
+
+// Record layout, host byte order: op (1), reserved (1), payload size (2),
+// CRC-32 of the first four bytes and the payload (4), payload.
+void LogStorage::EncodeRecord(::std::string& out, Op op, ::std::string_view payload)
+{
+	auto header = ::std::string{};
+	AppendValue(header, static_cast<::std::uint8_t>(op));
+	AppendValue(header, ::std::uint8_t{});
+	AppendValue(header, static_cast<::std::uint16_t>(payload.size()));
+	AppendValue(header, RecordCrc(header.data(), payload));
+	out += header;
+	out += payload;
+}
+
+::std::string LogStorage::EncodeAttendance(int day, UserId user_id)
+{
+	auto payload = ::std::string{};
+	AppendValue(payload, day);
+	AppendValue(payload, user_id);
+	return payload;
+}
+
+::std::string LogStorage::EncodeInvite(::std::string const& invite, InviteState const& state)
+{
+	auto payload = ::std::string{};
+	AppendValue(payload, state.invited_by);
+	AppendValue(payload, state.expires_at);
+	payload += invite;
+	return payload;
+}
+
+// BROADCAST: id, creator, text. RECIPIENTS: id, users. DELIVERIES: id,
+// then user and delivery (1) for each outcome so far.
+::std::vector<::std::pair<LogStorage::Op, ::std::string>> LogStorage::EncodeBroadcast(
+		::std::int64_t id, BroadcastState const& state)
+{
+	auto records = ::std::vector<::std::pair<Op, ::std::string>>{};
+	auto& head = records.emplace_back(Op::BROADCAST, ::std::string{}).second;
+	AppendValue(head, id);
+	AppendValue(head, state.created_by);
+	head += state.text;
+	auto delivered = ::std::vector<::std::pair<UserId, Delivery>>{};
+	auto n_users = ::std::size_t{};
+	for (auto const& [user_id, delivery] : state.recipients) {
+		if (n_users++ % USERS_PER_RECORD == 0) {
+			AppendValue(records.emplace_back(Op::RECIPIENTS, ::std::string{}).second, id);
+		}
+		AppendValue(records.back().second, user_id);
+		if (delivery != Delivery::PENDING) {
+			delivered.emplace_back(user_id, delivery);
+		}
+	}
+	for (::std::size_t i = 0; i < delivered.size(); ++i) {
+		if (i % USERS_PER_RECORD == 0) {
+			AppendValue(records.emplace_back(Op::DELIVERIES, ::std::string{}).second, id);
+		}
+		AppendValue(records.back().second, delivered[i].first);
+		AppendValue(records.back().second, static_cast<::std::uint8_t>(delivered[i].second));
+	}
+	return records;
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "storage.hh"
+
+// Embedded storage: an append-only log of changes in a memory-mapped file
+// replayed into an in-memory index at startup. Reads never touch the file.
+// Once dead records outnumber live ones the log is compacted by writing
+// the live state to a new file and renaming it over the old one.
+class LogStorage : public Storage {
+public:
+	explicit LogStorage(::std::string path);
+	~LogStorage() override;
+
+	LogStorage(LogStorage const&) = delete;
+	LogStorage& operator=(LogStorage const&) = delete;
+
+	bool IsUserRegistered(UserId user_id) override;
+	void RegisterUser(UserId user_id) override;
+	::std::vector<UserId> GetRegisteredUsers() override;
+	void PushInvite(::std::string const& invite, UserId invited_by,
+			::std::chrono::seconds ttl) override;
+	bool PopInvite(::std::string const& invite) override;
+	::std::size_t PurgeInvites(::std::size_t limit) override;
+	::std::vector<::std::pair<int, UserId>> ReadAttendances(int first_day, int last_day) override;
+	::std::vector<::std::pair<int, ::std::size_t>> CountAttendances(
+			int first_day, int last_day) override;
+	void ApplyAttendances(::std::vector<Change> const& batch) override;
+	Stats ReadStats(int first_month, int last_month) override;
+	::std::int64_t CreateBroadcast(UserId created_by, ::std::string const& text,
+			::std::vector<UserId> const& recipients) override;
+	::std::vector<Broadcast> ReadUnfinishedBroadcasts() override;
+	void RecordDeliveries(::std::int64_t broadcast_id,
+			::std::vector<::std::pair<UserId, Delivery>> const& deliveries) override;
+	::std::vector<UserId> GetBlockedUsers() override;
+	bool IsUserBlocked(UserId user_id) override;
+	void UnblockUser(UserId user_id) override;
+	::std::vector<Reminder> ReadReminders() override;
+	void SetReminder(UserId user_id, int minute) override;
+	void DeleteReminder(UserId user_id) override;
+	void Maintain() override;
+
+private:
+	enum class Op : ::std::uint8_t {
+		END, USER, INVITE_PUSH, INVITE_POP, ATTEND, UNATTEND,
+		BROADCAST, RECIPIENTS, DELIVERIES, BLOCK, UNBLOCK, REMINDER, UNREMINDER,
+		INVITE // INVITE_PUSH with an expiry
+	};
+
+	struct InviteState {
+		UserId invited_by{};
+		::std::int64_t expires_at{}; // seconds since the epoch
+	};
+
+	// Only unfinished broadcasts are kept; the records of one that
+	// completes turn dead all at once.
+	struct BroadcastState {
+		UserId created_by{};
+		::std::string text{};
+		::std::map<UserId, Delivery> recipients{};
+		::std::size_t pending{};
+		::std::size_t records{};
+	};
+
+	static constexpr char MAGIC[8] = {'T', 'G', 'B', 'O', 'T', 'L', 'O', 'G'};
+	static constexpr ::std::uint32_t VERSION = 1;
+	static constexpr ::std::size_t FILE_HEADER_SIZE = 16;
+	static constexpr ::std::size_t RECORD_HEADER_SIZE = 8;
+	static constexpr ::std::size_t MIN_CAPACITY = 1 << 20;
+	static constexpr ::std::size_t MIN_COMPACT_SIZE = 1 << 20;
+	// users per RECIPIENTS or DELIVERIES record, within the 64 KiB payload
+	static constexpr ::std::size_t USERS_PER_RECORD = 4096;
+
+	::std::string path_{};
+	int fd_{-1};
+	char* map_{};
+	::std::size_t capacity_{};
+	::std::size_t tail_{};
+	::std::size_t live_{}; // records that still hold state
+	::std::size_t dead_{}; // records compaction would drop
+	::std::size_t legacy_invites_{}; // INVITE_PUSH records seen by Load()
+
+	::std::mutex mutex_{};
+	::std::unordered_set<UserId> users_{};
+	::std::unordered_map<::std::string, InviteState> invites_{};
+	::std::set<::std::pair<int, UserId>> attendances_{};
+	// rollups, kept in step by Replay()
+	::std::map<::std::pair<int, UserId>, int> monthly_{};
+	::std::map<int, int> daily_{};
+	::std::map<::std::int64_t, BroadcastState> broadcasts_{};
+	::std::int64_t next_broadcast_id_{1};
+	::std::unordered_set<UserId> blocked_{};
+	::std::unordered_map<UserId, int> reminders_{};
+
+	void Open();
+	void Map(::std::size_t capacity);
+	void Unmap();
+	void Load();
+	bool Replay(Op op, ::std::string_view payload, bool loading);
+	void Roll(int day, UserId user_id, int delta);
+	void ReplayBroadcast(Op op, ::std::string_view payload);
+	void Append(Op op, ::std::string_view payload);
+	void Sync(::std::size_t from);
+	void Compact();
+
+	static void EncodeRecord(::std::string& out, Op op, ::std::string_view payload);
+	static ::std::string EncodeAttendance(int day, UserId user_id);
+	static ::std::string EncodeInvite(::std::string const& invite, InviteState const& state);
+	static ::std::vector<::std::pair<Op, ::std::string>> EncodeBroadcast(::std::int64_t id,
+			BroadcastState const& state);
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,337 @@
+#include "logger.hh"
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include <unistd.h>
+
+namespace {
+
+using Clock = ::std::chrono::steady_clock;
+
+constexpr ::std::size_t RING_SIZE = 4096; // a power of two
+constexpr auto DRAIN_INTERVAL = ::std::chrono::milliseconds{20};
+constexpr auto RATE_WINDOW = ::std::chrono::seconds{10};
+constexpr int RATE_BURST = 5;
+
+char const* const LEVEL_NAMES[] = {"debug", "info", "warning", "error"};
+// sd-daemon(3) priorities, understood by journald on stderr
+char const* const LEVEL_PRIORITIES[] = {"<7>", "<6>", "<4>", "<3>"};
+
+// Bounded multi-producer single-consumer ring after Vyukov: each slot's
+// sequence number says whether it is free for the producer at that
+// position or filled for the consumer.
+struct Ring {
+	struct Slot {
+		::std::atomic<::std::size_t> seq{};
+		Logger::Level level{};
+		::std::uint64_t key{};
+		::std::string text{};
+	};
+
+	::std::array<Slot, RING_SIZE> slots{};
+	alignas(64) ::std::atomic<::std::size_t> head{};
+	alignas(64) ::std::size_t tail{};
+
+	Ring()
+	{
+		for (::std::size_t i = 0; i < RING_SIZE; ++i) {
+			slots[i].seq.store(i, ::std::memory_order_relaxed);
+		}
+	}
+
+	bool Push(Logger::Level level, ::std::uint64_t key, ::std::string&& text)
+	{
+		auto pos = head.load(::std::memory_order_relaxed);
+		for (;;) {
+			auto& slot = slots[pos & (RING_SIZE - 1)];
+			auto seq = slot.seq.load(::std::memory_order_acquire);
+			auto diff = static_cast<::std::ptrdiff_t>(seq) - static_cast<::std::ptrdiff_t>(pos);
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, ::std::memory_order_relaxed)) {
+					slot.level = level;
+					slot.key = key;
+					slot.text = ::std::move(text);
+					slot.seq.store(pos + 1, ::std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = head.load(::std::memory_order_relaxed);
+			}
+		}
+	}
+
+	template<typename F>
+	bool Pop(F&& f)
+	{
+		auto& slot = slots[tail & (RING_SIZE - 1)];
+		if (slot.seq.load(::std::memory_order_acquire) != tail + 1) {
+			return false;
+		}
+		f(slot.level, slot.key, slot.text);
+		slot.text.clear();
+		slot.seq.store(tail + RING_SIZE, ::std::memory_order_release);
+		++tail;
+		return true;
+	}
+};
+
+// Signals interrupt the write rather than lose what is left of it.
+void WriteAll(::std::string_view data)
+{
+	for (::std::size_t pos = 0; pos < data.size();) {
+		auto n = ::write(STDERR_FILENO, data.data() + pos, data.size() - pos);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break; // nowhere left to report it
+		}
+		pos += n;
+	}
+}
+
+struct Writer {
+	Ring ring{};
+	::std::atomic<bool> running{};
+	::std::atomic<bool> stop{};
+	::std::atomic<::std::uint64_t> dropped{};
+	::std::thread thread{};
+	bool journal{::std::getenv("JOURNAL_STREAM") != nullptr};
+
+	// owned by the writer thread
+	struct Rate {
+		Clock::time_point window{};
+		int count{};
+		int suppressed{};
+		Logger::Level level{};
+		::std::string last{}; // the last line suppressed
+	};
+	::std::unordered_map<::std::uint64_t, Rate> rates{};
+	::std::string out{};
+
+	void Emit(Logger::Level level, ::std::string_view text)
+	{
+		if (journal) {
+			out.append(LEVEL_PRIORITIES[static_cast<int>(level)]);
+		}
+		out.append(text).push_back('\n');
+	}
+
+	void Take(Logger::Level level, ::std::uint64_t key, ::std::string const& text, Clock::time_point now)
+	{
+		if (level < Logger::Level::WARNING) {
+			Emit(level, text);
+			return;
+		}
+		auto& rate = rates[key];
+		if (now - rate.window >= RATE_WINDOW) {
+			Report(rate);
+			rate = Rate{now};
+		}
+		if (++rate.count <= RATE_BURST) {
+			Emit(level, text);
+		} else {
+			++rate.suppressed;
+			rate.level = level;
+			rate.last = text;
+		}
+	}
+
+	void Report(Rate const& rate)
+	{
+		if (rate.suppressed) {
+			Emit(rate.level, rate.last + " suppressed=" + ::std::to_string(rate.suppressed));
+		}
+	}
+
+	// Windows that ran out without the message coming back; a storm that
+	// has ended still gets its count reported.
+	void Expire(Clock::time_point now)
+	{
+		for (auto irate = rates.begin(); irate != rates.end();) {
+			if (now - irate->second.window < RATE_WINDOW) {
+				++irate;
+				continue;
+			}
+			Report(irate->second);
+			irate = rates.erase(irate);
+		}
+	}
+
+	void Flush()
+	{
+		WriteAll(out);
+		out.clear();
+	}
+
+	void Drain()
+	{
+		auto now = Clock::now();
+		while (ring.Pop([&](auto level, auto key, auto const& text) { Take(level, key, text, now); })) {
+		}
+		Expire(now);
+		if (auto n = dropped.exchange(0)) {
+			Emit(Logger::Level::WARNING, "level=warning component=logger msg=\"ring full\" dropped="
+					+ ::std::to_string(n));
+		}
+		Flush();
+	}
+
+	~Writer()
+	{
+		if (thread.joinable()) {
+			stop = true;
+			thread.join();
+		}
+	}
+
+	void Run()
+	{
+		while (!stop.load(::std::memory_order_acquire)) {
+			Drain();
+			::std::this_thread::sleep_for(DRAIN_INTERVAL);
+		}
+		Drain();
+	}
+};
+
+Writer& GetWriter()
+{
+	static Writer writer{};
+	return writer;
+}
+
+bool NeedsQuotes(::std::string_view s)
+{
+	if (s.empty()) {
+		return true;
+	}
+	for (auto c : s) {
+		if (c == ' ' || c == '"' || c == '=' || c == '\\' || static_cast<unsigned char>(c) < 0x20) {
+			return true;
+		}
+	}
+	return false;
+}
+
+} // namespace
+
+Logger::Line::Line(Level level, ::std::string_view component, ::std::string_view message)
+	: level_{level}
+	, live_{Enabled(level)}
+{
+	if (!live_) {
+		return;
+	}
+	// repeats of one message from one component share a rate limit
+	key_ = ::std::hash<::std::string_view>{}(component) * 31 + ::std::hash<::std::string_view>{}(message);
+	text_.reserve(64 + message.size());
+	text_.append("level=").append(LEVEL_NAMES[static_cast<int>(level)]);
+	Append("component", component, false);
+	Append("msg", message, true);
+}
+
+Logger::Line::~Line()
+{
+	if (live_) {
+		Push(level_, key_, ::std::move(text_));
+	}
+}
+
+Logger::Line& Logger::Line::Fields(::std::string_view fields)
+{
+	if (live_ && !fields.empty()) {
+		text_.append(" ").append(fields);
+	}
+	return *this;
+}
+
+void Logger::Line::Append(::std::string_view key, ::std::string_view value, bool quote)
+{
+	text_.append(" ").append(key).append("=");
+	if (!quote || !NeedsQuotes(value)) {
+		text_.append(value);
+		return;
+	}
+	text_.push_back('"');
+	for (auto c : value) {
+		switch (c) {
+		case '"': text_.append("\\\""); break;
+		case '\\': text_.append("\\\\"); break;
+		case '\n': text_.append("\\n"); break;
+		case '\t': text_.append("\\t"); break;
+		default:
+			if (static_cast<unsigned char>(c) >= 0x20) {
+				text_.push_back(c);
+			}
+		}
+	}
+	text_.push_back('"');
+}
+
+void Logger::ToggleDebug()
+{
+	auto level = level_.load();
+	if (level == static_cast<int>(Level::DEBUG)) {
+		level_.store(saved_level_.load());
+	} else {
+		saved_level_.store(level);
+		level_.store(static_cast<int>(Level::DEBUG));
+	}
+}
+
+Logger::Level Logger::ParseLevel(::std::string_view name, Level fallback)
+{
+	for (int i = 0; i < static_cast<int>(::std::size(LEVEL_NAMES)); ++i) {
+		if (name == LEVEL_NAMES[i]) {
+			return static_cast<Level>(i);
+		}
+	}
+	return fallback;
+}
+
+void Logger::Start()
+{
+	auto& writer = GetWriter();
+	if (writer.running.exchange(true)) {
+		return;
+	}
+	writer.stop = false;
+	writer.thread = ::std::thread{[&writer]() { writer.Run(); }};
+}
+
+void Logger::Stop()
+{
+	auto& writer = GetWriter();
+	if (!writer.running.load()) {
+		return;
+	}
+	writer.stop.store(true, ::std::memory_order_release);
+	writer.thread.join();
+	writer.running = false;
+	writer.Drain(); // whatever raced with the last drain of the thread
+}
+
+void Logger::Push(Level level, ::std::uint64_t key, ::std::string&& text)
+{
+	auto& writer = GetWriter();
+	if (!writer.running.load(::std::memory_order_acquire)) {
+		text.push_back('\n');
+		WriteAll(text);
+		return;
+	}
+	if (!writer.ring.Push(level, key, ::std::move(text))) {
+		writer.dropped.fetch_add(1, ::std::memory_order_relaxed);
+	}
+}
+
+// vim: set ts=4 sw=4 noet :
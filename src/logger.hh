@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Leveled key=value logging off the calling thread. Lines are formatted by
+// the caller, pushed into a bounded lock-free ring and written to stderr in
+// batches by a background thread; a full ring drops lines rather than
+// blocking. Repeated warnings and errors are rate limited per message, and
+// how many were held back is logged when the window ends.
+//
+//	Logger::Error("journal", "write failed")("error", ::std::strerror(errno));
+//
+// Without Start() every line is written synchronously.
+class Logger {
+public:
+	enum class Level : int {
+		DEBUG, INFO, WARNING, ERROR
+	};
+
+	// One line under construction, queued when the temporary dies.
+	class Line {
+	public:
+		Line(Level level, ::std::string_view component, ::std::string_view message);
+		Line(Line const&) = delete;
+		Line& operator=(Line const&) = delete;
+		~Line();
+
+		template<typename T>
+		Line& operator()(::std::string_view key, T const& value)
+		{
+			if (live_) {
+				if constexpr (::std::is_same_v<T, bool>) {
+					Append(key, value ? "true" : "false", false);
+				} else if constexpr (::std::is_arithmetic_v<T>) {
+					Append(key, ::std::to_string(value), false);
+				} else {
+					Append(key, ::std::string_view{value}, true);
+				}
+			}
+			return *this;
+		}
+
+		// appends pairs already in key=value form
+		Line& Fields(::std::string_view fields);
+
+	private:
+		Level level_{};
+		bool live_{};
+		::std::uint64_t key_{};
+		::std::string text_{};
+
+		void Append(::std::string_view key, ::std::string_view value, bool quote);
+	};
+
+	static Line Debug(::std::string_view component, ::std::string_view message)
+	{
+		return {Level::DEBUG, component, message};
+	}
+	static Line Info(::std::string_view component, ::std::string_view message)
+	{
+		return {Level::INFO, component, message};
+	}
+	static Line Warning(::std::string_view component, ::std::string_view message)
+	{
+		return {Level::WARNING, component, message};
+	}
+	static Line Error(::std::string_view component, ::std::string_view message)
+	{
+		return {Level::ERROR, component, message};
+	}
+
+	static bool Enabled(Level level) { return static_cast<int>(level) >= level_; }
+	static void SetLevel(Level level) { level_ = static_cast<int>(level); }
+	// Flips between DEBUG and the configured level; async-signal-safe.
+	static void ToggleDebug();
+	static Level ParseLevel(::std::string_view name, Level fallback);
+
+	static void Start();
+	// Drains what is queued and joins the writer thread.
+	static void Stop();
+
+private:
+	static inline ::std::atomic<int> level_{static_cast<int>(Level::INFO)};
+	static inline ::std::atomic<int> saved_level_{static_cast<int>(Level::INFO)};
+
+	static void Push(Level level, ::std::uint64_t key, ::std::string&& text);
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// Map with least-recently-used eviction under a memory budget and a time to
+// live since the last access. Entry costs are estimated at insertion:
+// container overhead plus whatever the optional cost function reports for
+// the heap memory owned by the value.
+template<typename Key, typename Value, typename Hash = ::std::hash<Key>>
+class LruCache {
+public:
+	using Clock = ::std::chrono::steady_clock;
+	using CostFn = ::std::size_t (*)(Value const&);
+
+	struct Stats {
+		::std::size_t evictions{};
+		::std::size_t expirations{};
+	};
+
+	LruCache() = default;
+
+	void Configure(::std::size_t budget, Clock::duration ttl, CostFn cost_fn = nullptr)
+	{
+		budget_ = budget;
+		ttl_ = ttl;
+		cost_fn_ = cost_fn;
+		Shrink();
+	}
+
+	// Returns the live entry and marks it as used, or nullptr.
+	Value* Find(Key const& key)
+	{
+		auto ientry = index_.find(key);
+		if (ientry == index_.end()) {
+			return nullptr;
+		}
+		auto now = Clock::now();
+		auto it = ientry->second;
+		if (now - it->last_access > ttl_) {
+			Drop(it);
+			++stats_.expirations;
+			return nullptr;
+		}
+		it->last_access = now;
+		entries_.splice(entries_.begin(), entries_, it);
+		return &it->value;
+	}
+
+	// Returns the entry for the key, default constructing a missing one.
+	Value& Get(Key const& key)
+	{
+		if (auto value = Find(key)) {
+			return *value;
+		}
+		return Put(key, Value{});
+	}
+
+	Value& Put(Key const& key, Value value)
+	{
+		if (auto ientry = index_.find(key); ientry != index_.end()) {
+			Drop(ientry->second);
+		}
+		entries_.push_front({key, ::std::move(value), Clock::now(), 0});
+		auto it = entries_.begin();
+		it->cost = ENTRY_OVERHEAD + (cost_fn_ ? cost_fn_(it->value) : 0);
+		cost_ += it->cost;
+		index_.emplace(key, it);
+		Shrink();
+		return it->value;
+	}
+
+	// Re-estimates the cost of an entry modified in place. One that is now
+	// over the budget on its own is evicted as well.
+	void Recharge(Key const& key)
+	{
+		auto ientry = index_.find(key);
+		if (ientry == index_.end()) {
+			return;
+		}
+		auto it = ientry->second;
+		cost_ -= it->cost;
+		it->cost = ENTRY_OVERHEAD + (cost_fn_ ? cost_fn_(it->value) : 0);
+		cost_ += it->cost;
+		entries_.splice(entries_.begin(), entries_, it);
+		Shrink(false);
+	}
+
+	bool Erase(Key const& key)
+	{
+		auto ientry = index_.find(key);
+		if (ientry == index_.end()) {
+			return false;
+		}
+		Drop(ientry->second);
+		return true;
+	}
+
+	// Drops everything idle for longer than the time to live.
+	void Expire()
+	{
+		auto now = Clock::now();
+		while (!entries_.empty() && now - entries_.back().last_access > ttl_) {
+			Drop(::std::prev(entries_.end()));
+			++stats_.expirations;
+		}
+	}
+
+	// Visits entries from least to most recently used, the order in which
+	// Put() rebuilds the same recency order.
+	template<typename F> void ForEach(F f) const
+	{
+		for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+			f(it->key, it->value);
+		}
+	}
+
+	::std::size_t Size() const { return index_.size(); }
+	::std::size_t Cost() const { return cost_; }
+	Stats const& GetStats() const { return stats_; }
+
+private:
+	struct Entry {
+		Key key;
+		Value value;
+		Clock::time_point last_access;
+		::std::size_t cost;
+	};
+
+	using Iterator = typename ::std::list<Entry>::iterator;
+
+	// list node links, hash node with key, iterator, next pointer and hash
+	static constexpr ::std::size_t ENTRY_OVERHEAD =
+		sizeof(Entry) + 2 * sizeof(void*) +
+		sizeof(Key) + sizeof(Iterator) + 2 * sizeof(void*);
+
+	::std::list<Entry> entries_{}; // most recently used first
+	::std::unordered_map<Key, Iterator, Hash> index_{};
+	::std::size_t budget_{static_cast<::std::size_t>(-1)};
+	Clock::duration ttl_{Clock::duration::max()};
+	CostFn cost_fn_{};
+	::std::size_t cost_{};
+	Stats stats_{};
+
+	void Drop(Iterator it)
+	{
+		cost_ -= it->cost;
+		index_.erase(it->key);
+		entries_.erase(it);
+	}
+
+	// Get and Put hand out the most recent entry, so there it stays even
+	// if it alone is too big; elsewhere it goes like any other.
+	void Shrink(bool keep_recent = true)
+	{
+		while (cost_ > budget_ && entries_.size() > (keep_recent ? 1 : 0)) {
+			Drop(::std::prev(entries_.end()));
+			++stats_.evictions;
+		}
+	}
+};
+
+// vim: set ts=4 sw=4 noet :
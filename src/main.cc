@@ -1,6 +1,8 @@
 #include <csignal>
 
+#include "logger.hh"
 #include "telegram_bot.hh"
+#include "tracer.hh"
 
 static volatile ::std::sig_atomic_t g_quit = 0;
 
@@ -9,24 +11,48 @@ static void SignalHandler(int)
 	g_quit = 1;
 }
 
-int main(int, char**)
+static void DebugSignalHandler(int signum)
+{
+	if (signum == SIGUSR1) {
+		Logger::ToggleDebug();
+	} else {
+		Tracer::RequestDump();
+	}
+}
+
+int main(int argc, char** argv)
 {
 	struct ::sigaction sa {};
 	sa.sa_handler = SignalHandler;
 	::sigemptyset(&sa.sa_mask);
 	::sigaction(SIGINT, &sa, nullptr);
+	::sigaction(SIGTERM, &sa, nullptr);
 
+	// kill -USR1 toggles debug logging, -USR2 dumps the trace spans
+	struct ::sigaction dbg {};
+	dbg.sa_handler = DebugSignalHandler;
+	dbg.sa_flags = SA_RESTART;
+	::sigemptyset(&dbg.sa_mask);
+	::sigaction(SIGUSR1, &dbg, nullptr);
+	::sigaction(SIGUSR2, &dbg, nullptr);
+
+	// TLS writes on a socket closed by the peer must fail, not kill us
+	struct ::sigaction ign {};
+	ign.sa_handler = SIG_IGN;
+	::sigemptyset(&ign.sa_mask);
+	::sigaction(SIGPIPE, &ign, nullptr);
+
+	Logger::Start();
 	auto stop_pred = []() noexcept { return g_quit; };
 	auto err = TelegramBot::NoError();
-	TelegramBot bot{err};
-	if (err) {
-		return -1;
-	}
-	bot.Run(stop_pred, err);
-	if (err) {
-		return -1;
+	{
+		TelegramBot bot{argc > 1 ? argv[1] : "telegram-bot.conf", err};
+		if (!err) {
+			bot.Run(stop_pred, err);
+		}
 	}
-	return 0;
+	Logger::Stop();
+	return err ? -1 : 0;
 }
 
 // vim: set ts=4 sw=4 noet :
@@ -0,0 +1,45 @@
+#include "metrics.hh"
+
+void Metrics::Add(::std::string_view name, ::std::int64_t delta)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (auto ivalue = values_.find(name); ivalue != values_.end()) {
+		ivalue->second += delta;
+	} else {
+		values_.emplace(name, delta);
+	}
+}
+
+void Metrics::Set(::std::string_view name, ::std::int64_t value)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (auto ivalue = values_.find(name); ivalue != values_.end()) {
+		ivalue->second = value;
+	} else {
+		values_.emplace(name, value);
+	}
+}
+
+::std::int64_t Metrics::Get(::std::string_view name) const
+{
+	auto lock = ::std::lock_guard{mutex_};
+	if (auto ivalue = values_.find(name); ivalue != values_.end()) {
+		return ivalue->second;
+	}
+	return 0;
+}
+
+::std::string Metrics::Format() const
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto result = ::std::string{};
+	for (auto const& [name, value] : values_) {
+		if (!result.empty()) {
+			result.append(" ");
+		}
+		result.append(name).append("=").append(::std::to_string(value));
+	}
+	return result;
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Named counters and gauges shared by the bot and its background threads.
+// Reported periodically as a single key=value line.
+class Metrics {
+public:
+	void Add(::std::string_view name, ::std::int64_t delta = 1);
+	void Set(::std::string_view name, ::std::int64_t value);
+	::std::int64_t Get(::std::string_view name) const;
+	::std::string Format() const;
+
+private:
+	mutable ::std::mutex mutex_{};
+	::std::map<::std::string, ::std::int64_t, ::std::less<>> values_{};
+};
+
+// vim: set ts=4 sw=4 noet :
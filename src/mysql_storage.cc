@@ -0,0 +1,721 @@
+#include "mysql_storage.hh"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <set>
+#include <thread>
+
+#include <Poco/Data/DataException.h>
+#include <Poco/Data/Date.h>
+#include <Poco/Data/MySQL/Connector.h>
+#include <Poco/Data/RecordSet.h>
+#include <Poco/Exception.h>
+
+#include "day_number.hh"
+#include "logger.hh"
+
+namespace p = ::Poco;
+namespace p_data = ::Poco::Data;
+namespace p_kw = ::Poco::Data::Keywords;
+
+namespace {
+
+int MonthOf(int day_number)
+{
+	int year{}, month{}, day{};
+	CivilFromDays(day_number, year, month, day);
+	return year * 12 + month - 1;
+}
+
+p_data::Date ToDbDate(int day_number)
+{
+	int year{}, month{}, day{};
+	CivilFromDays(day_number, year, month, day);
+	return {year, month, day};
+}
+
+int FromDbDate(p_data::Date const& date)
+{
+	return DaysFromCivil(date.year(), date.month(), date.day());
+}
+
+// Applied in order to bring a database up to the next version. Each one
+// must also cope with a database that got its tables from the unversioned
+// schema, which created everything up to the invite expiry on every start.
+void CreateBaseTables(p_data::Session& session)
+{
+	session << "CREATE TABLE IF NOT EXISTS RegisteredUsers ("
+		"UserId BIGINT PRIMARY KEY);", p_kw::now;
+	session << "CREATE TABLE IF NOT EXISTS Attendances ("
+		"Date DATE, "
+		"UserId BIGINT, "
+		"PRIMARY KEY (Date, UserId))", p_kw::now;
+	session << "CREATE TABLE IF NOT EXISTS Invites ("
+		"Invite VARCHAR(64) PRIMARY KEY, "
+		"InvitedBy BIGINT)", p_kw::now;
+}
+
+// rebuilt rather than topped up, whatever an unversioned start left
+void CreateRollups(p_data::Session& session)
+{
+	session << "CREATE TABLE IF NOT EXISTS AttendanceMonthly ("
+		"Month INT, "
+		"UserId BIGINT, "
+		"Days INT, "
+		"PRIMARY KEY (Month, UserId))", p_kw::now;
+	session << "CREATE TABLE IF NOT EXISTS AttendanceDaily ("
+		"Date DATE PRIMARY KEY, "
+		"Users INT)", p_kw::now;
+	session.begin();
+	session << "DELETE FROM AttendanceDaily", p_kw::now;
+	session << "INSERT INTO AttendanceDaily "
+		"SELECT Date, COUNT(*) FROM Attendances GROUP BY Date", p_kw::now;
+	session << "DELETE FROM AttendanceMonthly", p_kw::now;
+	session << "INSERT INTO AttendanceMonthly "
+		"SELECT YEAR(Date) * 12 + MONTH(Date) - 1, UserId, COUNT(*) "
+		"FROM Attendances GROUP BY 1, UserId", p_kw::now;
+	session.commit();
+}
+
+void CreateBroadcasts(p_data::Session& session)
+{
+	session << "CREATE TABLE IF NOT EXISTS Broadcasts ("
+		"Id BIGINT AUTO_INCREMENT PRIMARY KEY, "
+		"CreatedBy BIGINT, "
+		"Text TEXT, "
+		"CreatedAt TIMESTAMP DEFAULT CURRENT_TIMESTAMP)", p_kw::now;
+	session << "CREATE TABLE IF NOT EXISTS BroadcastRecipients ("
+		"BroadcastId BIGINT, "
+		"UserId BIGINT, "
+		"State TINYINT, "
+		"PRIMARY KEY (BroadcastId, UserId), "
+		"INDEX Pending (State, BroadcastId))", p_kw::now;
+	session << "CREATE TABLE IF NOT EXISTS BlockedUsers ("
+		"UserId BIGINT PRIMARY KEY)", p_kw::now;
+}
+
+void CreateReminders(p_data::Session& session)
+{
+	session << "CREATE TABLE IF NOT EXISTS Reminders ("
+		"UserId BIGINT PRIMARY KEY, "
+		"Minute SMALLINT)", p_kw::now;
+}
+
+// invites from before expiry get the legacy lifetime from now
+void AddInviteExpiry(p_data::Session& session)
+{
+	int n_expiry{};
+	session << "SELECT COUNT(*) FROM information_schema.COLUMNS "
+		"WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='Invites' AND COLUMN_NAME='ExpiresAt'",
+		p_kw::into(n_expiry), p_kw::now;
+	if (n_expiry) {
+		return;
+	}
+	auto legacy_ttl = static_cast<int>(
+		::std::chrono::duration_cast<::std::chrono::seconds>(Storage::LEGACY_INVITE_TTL).count());
+	session << "ALTER TABLE Invites "
+		"ADD COLUMN CreatedAt TIMESTAMP DEFAULT CURRENT_TIMESTAMP, "
+		"ADD COLUMN ExpiresAt TIMESTAMP NULL, "
+		"ADD INDEX Expires (ExpiresAt)", p_kw::now;
+	session << "UPDATE Invites SET ExpiresAt=NOW() + INTERVAL ? SECOND",
+		p_kw::bind(legacy_ttl), p_kw::now;
+}
+
+// Never edit or reorder; append. Version n is the database after the
+// first n of them.
+constexpr void (*MIGRATIONS[])(p_data::Session&) = {
+	CreateBaseTables,
+	CreateRollups,
+	CreateBroadcasts,
+	CreateReminders,
+	AddInviteExpiry,
+};
+
+int SchemaVersion(p_data::Session& session)
+{
+	int n_tables{};
+	session << "SELECT COUNT(*) FROM information_schema.TABLES "
+		"WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='SchemaVersion'",
+		p_kw::into(n_tables), p_kw::now;
+	if (!n_tables) {
+		return 0;
+	}
+	int version{};
+	session << "SELECT Version FROM SchemaVersion WHERE Id=1", p_kw::into(version), p_kw::now;
+	return version;
+}
+
+} // namespace
+
+MySqlStorage::MySqlStorage(::std::string const& connection, PoolOptions const& options,
+		Metrics& metrics)
+	: options_{options}
+	, metrics_{metrics}
+{
+	p_data::MySQL::Connector::registerConnector();
+	pool_ = ::std::make_unique<p_data::SessionPool>("MySQL", connection,
+		options_.min_sessions, options_.max_sessions,
+		static_cast<int>(options_.idle_time.count()));
+	auto session = Checkout();
+	Migrate(session);
+	pinged_ = Clock::now();
+}
+
+MySqlStorage::~MySqlStorage()
+{
+	pool_->shutdown();
+}
+
+// A current schema costs two reads and no DDL. Otherwise the pending
+// migrations run under a named lock, so that sharded workers starting
+// together migrate once, and the version moves after each of them: DDL
+// commits implicitly, so a migration that fails halfway is run again in
+// full on the next start.
+void MySqlStorage::Migrate(p_data::Session& session)
+{
+	auto const latest = static_cast<int>(::std::size(MIGRATIONS));
+	auto version = SchemaVersion(session);
+	if (version == latest) {
+		return;
+	}
+	if (version > latest) {
+		throw p::IllegalStateException{"schema is newer than this build",
+			::std::to_string(version)};
+	}
+	auto timeout = static_cast<int>(::std::chrono::duration_cast<::std::chrono::seconds>(
+		MIGRATION_LOCK_TIMEOUT).count());
+	// one lock per database, so bots sharing a server but not a database
+	// don't wait on each other; MySQL takes names of up to 64 characters
+	auto lock = ::std::string{};
+	session << "SELECT LEFT(CONCAT('telegram-bot.schema.', DATABASE()), 64)",
+		p_kw::into(lock), p_kw::now;
+	int locked{};
+	session << "SELECT GET_LOCK(?, ?)", p_kw::use(lock), p_kw::bind(timeout),
+		p_kw::into(locked), p_kw::now;
+	if (locked != 1) {
+		throw p::TimeoutException{"schema migration lock", lock};
+	}
+	try {
+		session << "CREATE TABLE IF NOT EXISTS SchemaVersion ("
+			"Id TINYINT PRIMARY KEY, "
+			"Version INT)", p_kw::now;
+		// someone else may have migrated while we waited
+		for (version = SchemaVersion(session); version < latest; ++version) {
+			auto start = Clock::now();
+			MIGRATIONS[version](session);
+			auto next = version + 1;
+			session << "REPLACE INTO SchemaVersion VALUES (1, ?)", p_kw::bind(next), p_kw::now;
+			Logger::Info("storage", "schema migrated")("version", next)
+				("ms", ::std::chrono::duration_cast<::std::chrono::milliseconds>(
+					Clock::now() - start).count());
+		}
+	} catch (...) {
+		// The migration's error is the one worth reporting. A release that
+		// fails too means a lost connection, and the lock went with it.
+		try {
+			session << "DO RELEASE_LOCK(?)", p_kw::use(lock), p_kw::now;
+		} catch (p::Exception const& e) {
+			Logger::Warning("storage", "schema lock release failed")("error", e.displayText());
+		}
+		throw;
+	}
+	session << "DO RELEASE_LOCK(?)", p_kw::use(lock), p_kw::now;
+}
+
+bool MySqlStorage::IsUserRegistered(UserId user_id)
+{
+	auto session = Checkout();
+	auto select = p_data::Statement{session};
+	select << "SELECT * FROM RegisteredUsers WHERE UserId=?",
+		p_kw::bind(user_id),
+		p_kw::now;
+	auto rs = p_data::RecordSet{select};
+	return rs.extractedRowCount() != 0;
+}
+
+void MySqlStorage::RegisterUser(UserId user_id)
+{
+	auto session = Checkout();
+	session << "INSERT INTO RegisteredUsers VALUES(?) ON DUPLICATE KEY UPDATE UserId=UserId",
+		p_kw::bind(user_id),
+		p_kw::now;
+}
+
+::std::vector<Storage::UserId> MySqlStorage::GetRegisteredUsers()
+{
+	auto session = Checkout();
+	auto select = p_data::Statement{session};
+	select << "SELECT UserId FROM RegisteredUsers",
+		p_kw::now;
+	auto rs = p_data::RecordSet{select};
+	auto user_ids = ::std::vector<UserId>{};
+	for (auto& row : rs) {
+		UserId user_id{};
+		row.get(0).convert(user_id);
+		user_ids.push_back(user_id);
+	}
+	return user_ids;
+}
+
+void MySqlStorage::PushInvite(::std::string const& invite, UserId invited_by,
+		::std::chrono::seconds ttl)
+{
+	auto ttl_s = static_cast<int>(ttl.count());
+	auto session = Checkout();
+	session << "INSERT INTO Invites (Invite, InvitedBy, ExpiresAt) VALUES(?, ?, NOW() + INTERVAL ? SECOND)",
+		p_kw::bind(invite),
+		p_kw::bind(invited_by),
+		p_kw::bind(ttl_s),
+		p_kw::now;
+}
+
+// One statement decides the race: whoever deletes the row redeems it.
+bool MySqlStorage::PopInvite(::std::string const& invite)
+{
+	auto session = Checkout();
+	auto del = p_data::Statement{session};
+	del << "DELETE FROM Invites WHERE Invite=? AND ExpiresAt>NOW()",
+		p_kw::bind(invite);
+	return del.execute() == 1;
+}
+
+// Bounded so each call holds its locks only briefly.
+::std::size_t MySqlStorage::PurgeInvites(::std::size_t limit)
+{
+	auto limit_n = static_cast<int>(limit);
+	auto session = Checkout();
+	auto del = p_data::Statement{session};
+	del << "DELETE FROM Invites WHERE ExpiresAt<=NOW() LIMIT ?",
+		p_kw::bind(limit_n);
+	return del.execute();
+}
+
+::std::vector<::std::pair<int, Storage::UserId>> MySqlStorage::ReadAttendances(
+		int first_day, int last_day)
+{
+	auto db_first = ToDbDate(first_day);
+	auto db_last = ToDbDate(last_day);
+	auto session = Checkout();
+	p_data::Statement select(session);
+	select << "SELECT * FROM Attendances WHERE ?<=Date AND Date<=?",
+		p_kw::bind(db_first),
+		p_kw::bind(db_last),
+		p_kw::now;
+	p_data::RecordSet rs(select);
+	auto result = ::std::vector<::std::pair<int, UserId>>{};
+	result.reserve(rs.extractedRowCount());
+	for (auto& row : rs) {
+		UserId user_id{};
+		row.get(1).convert(user_id);
+		result.emplace_back(FromDbDate(row.get(0).extract<p_data::Date>()), user_id);
+	}
+	return result;
+}
+
+// The primary key (Date, UserId) is clustered, so this is a range scan
+// of the index alone and only one row per day crosses the wire.
+::std::vector<::std::pair<int, ::std::size_t>> MySqlStorage::CountAttendances(
+		int first_day, int last_day)
+{
+	auto db_first = ToDbDate(first_day);
+	auto db_last = ToDbDate(last_day);
+	auto session = Checkout();
+	p_data::Statement select(session);
+	select << "SELECT Date, COUNT(*) FROM Attendances WHERE ?<=Date AND Date<=? GROUP BY Date",
+		p_kw::bind(db_first),
+		p_kw::bind(db_last),
+		p_kw::now;
+	p_data::RecordSet rs(select);
+	auto result = ::std::vector<::std::pair<int, ::std::size_t>>{};
+	result.reserve(rs.extractedRowCount());
+	for (auto& row : rs) {
+		::std::size_t count{};
+		row.get(1).convert(count);
+		result.emplace_back(FromDbDate(row.get(0).extract<p_data::Date>()), count);
+	}
+	return result;
+}
+
+// Only the last change of each (date, user) in the batch matters, which
+// also makes the inserts and deletes disjoint so they can go out as two
+// bulk statements in one transaction.
+void MySqlStorage::ApplyAttendances(::std::vector<Change> const& batch)
+{
+	auto last = ::std::map<::std::pair<int, UserId>, bool>{};
+	for (auto const& change : batch) {
+		last[{change.day, change.user_id}] = change.remove;
+	}
+	auto days = ::std::set<int>{};
+	auto user_months = ::std::set<::std::pair<int, UserId>>{};
+	auto ins_dates = ::std::vector<p_data::Date>{};
+	auto ins_users = ::std::vector<UserId>{};
+	auto del_dates = ::std::vector<p_data::Date>{};
+	auto del_users = ::std::vector<UserId>{};
+	for (auto const& [key, remove] : last) {
+		(remove ? del_dates : ins_dates).push_back(ToDbDate(key.first));
+		(remove ? del_users : ins_users).push_back(key.second);
+		days.insert(key.first);
+		user_months.insert({MonthOf(key.first), key.second});
+	}
+
+	// The rollup rows of everything touched are recounted from the
+	// attendances rather than adjusted, so committing a batch again (as
+	// the journal does after a crash) leaves them correct.
+	auto day_dates = ::std::vector<p_data::Date>{};
+	for (auto day : days) {
+		day_dates.push_back(ToDbDate(day));
+	}
+	auto day_dates_too = day_dates;
+	auto months = ::std::vector<int>{};
+	auto month_users = ::std::vector<UserId>{};
+	auto month_firsts = ::std::vector<p_data::Date>{};
+	auto month_lasts = ::std::vector<p_data::Date>{};
+	for (auto const& key : user_months) {
+		auto year = key.first / 12;
+		auto month = key.first % 12 + 1;
+		months.push_back(key.first);
+		month_users.push_back(key.second);
+		month_firsts.push_back({year, month, 1});
+		month_lasts.push_back(ToDbDate(
+			DaysFromCivil(year + month / 12, month % 12 + 1, 1) - 1));
+	}
+	auto month_users_too = month_users;
+
+	auto session = Checkout();
+	session.begin();
+	try {
+		if (!ins_dates.empty()) {
+			session << "INSERT INTO Attendances VALUES(?, ?) ON DUPLICATE KEY UPDATE Date=Date",
+				p_kw::use(ins_dates),
+				p_kw::use(ins_users),
+				p_kw::now;
+		}
+		if (!del_dates.empty()) {
+			session << "DELETE FROM Attendances WHERE Date=? AND UserId=?",
+				p_kw::use(del_dates),
+				p_kw::use(del_users),
+				p_kw::now;
+		}
+		if (!day_dates.empty()) {
+			session << "REPLACE INTO AttendanceDaily "
+				"SELECT ?, COUNT(*) FROM Attendances WHERE Date=?",
+				p_kw::use(day_dates),
+				p_kw::use(day_dates_too),
+				p_kw::now;
+			session << "REPLACE INTO AttendanceMonthly "
+				"SELECT ?, ?, COUNT(*) FROM Attendances "
+				"WHERE ?<=Date AND Date<=? AND UserId=?",
+				p_kw::use(months),
+				p_kw::use(month_users),
+				p_kw::use(month_firsts),
+				p_kw::use(month_lasts),
+				p_kw::use(month_users_too),
+				p_kw::now;
+			// only the rows just recounted, by key; neither count is indexed
+			session << "DELETE FROM AttendanceDaily WHERE Date=? AND Users=0",
+				p_kw::use(day_dates),
+				p_kw::now;
+			session << "DELETE FROM AttendanceMonthly WHERE Month=? AND UserId=? AND Days=0",
+				p_kw::use(months),
+				p_kw::use(month_users),
+				p_kw::now;
+		}
+		session.commit();
+	} catch (...) {
+		try {
+			session.rollback();
+		} catch (p::Exception const&) {
+		}
+		throw;
+	}
+}
+
+// Both rollups come back in one round trip, told apart by the first column.
+Storage::Stats MySqlStorage::ReadStats(int first_month, int last_month)
+{
+	auto db_first = p_data::Date{first_month / 12, first_month % 12 + 1, 1};
+	auto next_month = last_month + 1;
+	auto db_last = ToDbDate(DaysFromCivil(next_month / 12, next_month % 12 + 1, 1) - 1);
+	auto session = Checkout();
+	p_data::Statement select(session);
+	select << "SELECT 0, Month, UserId, Days FROM AttendanceMonthly "
+			"WHERE ?<=Month AND Month<=? "
+		"UNION ALL "
+		"SELECT 1, YEAR(Date) * 12 + MONTH(Date) - 1, MAX(Users), COUNT(*) "
+			"FROM AttendanceDaily WHERE ?<=Date AND Date<=? GROUP BY 2",
+		p_kw::bind(first_month),
+		p_kw::bind(last_month),
+		p_kw::bind(db_first),
+		p_kw::bind(db_last),
+		p_kw::now;
+	p_data::RecordSet rs(select);
+	auto stats = Stats{};
+	for (auto& row : rs) {
+		int kind{}, month{};
+		row.get(0).convert(kind);
+		row.get(1).convert(month);
+		if (!kind) {
+			auto& user = stats.users.emplace_back();
+			user.month = month;
+			row.get(2).convert(user.user_id);
+			row.get(3).convert(user.days);
+		} else {
+			auto& summary = stats.months.emplace_back();
+			summary.month = month;
+			row.get(2).convert(summary.busiest_day);
+			row.get(3).convert(summary.active_days);
+		}
+	}
+	return stats;
+}
+
+::std::int64_t MySqlStorage::CreateBroadcast(UserId created_by, ::std::string const& text,
+		::std::vector<UserId> const& recipients)
+{
+	auto session = Checkout();
+	session.begin();
+	try {
+		session << "INSERT INTO Broadcasts (CreatedBy, Text) VALUES(?, ?)",
+			p_kw::bind(created_by),
+			p_kw::bind(text),
+			p_kw::now;
+		::std::int64_t id{};
+		session << "SELECT LAST_INSERT_ID()", p_kw::into(id), p_kw::now;
+		if (!recipients.empty()) {
+			auto ids = ::std::vector<::std::int64_t>(recipients.size(), id);
+			session << "INSERT INTO BroadcastRecipients VALUES(?, ?, 0) "
+					"ON DUPLICATE KEY UPDATE State=State",
+				p_kw::use(ids),
+				p_kw::use(recipients),
+				p_kw::now;
+		}
+		session.commit();
+		return id;
+	} catch (...) {
+		try {
+			session.rollback();
+		} catch (p::Exception const&) {
+		}
+		throw;
+	}
+}
+
+// Every recipient of a broadcast still under way, so the totals come out
+// of the same read; the Pending index finds those broadcasts.
+::std::vector<Storage::Broadcast> MySqlStorage::ReadUnfinishedBroadcasts()
+{
+	auto session = Checkout();
+	p_data::Statement select(session);
+	select << "SELECT b.Id, b.CreatedBy, b.Text, r.UserId, r.State "
+			"FROM Broadcasts b JOIN BroadcastRecipients r ON r.BroadcastId=b.Id "
+			"WHERE b.Id IN (SELECT BroadcastId FROM BroadcastRecipients WHERE State=0) "
+			"ORDER BY b.Id",
+		p_kw::now;
+	p_data::RecordSet rs(select);
+	auto broadcasts = ::std::vector<Broadcast>{};
+	for (auto& row : rs) {
+		::std::int64_t id{};
+		row.get(0).convert(id);
+		if (broadcasts.empty() || broadcasts.back().id != id) {
+			auto& broadcast = broadcasts.emplace_back();
+			broadcast.id = id;
+			row.get(1).convert(broadcast.created_by);
+			row.get(2).convert(broadcast.text);
+		}
+		auto& broadcast = broadcasts.back();
+		++broadcast.total;
+		int state{};
+		row.get(4).convert(state);
+		if (static_cast<Delivery>(state) == Delivery::PENDING) {
+			UserId user_id{};
+			row.get(3).convert(user_id);
+			broadcast.pending.push_back(user_id);
+		}
+	}
+	return broadcasts;
+}
+
+void MySqlStorage::RecordDeliveries(::std::int64_t broadcast_id,
+		::std::vector<::std::pair<UserId, Delivery>> const& deliveries)
+{
+	if (deliveries.empty()) {
+		return;
+	}
+	auto states = ::std::vector<int>{};
+	auto ids = ::std::vector<::std::int64_t>(deliveries.size(), broadcast_id);
+	auto users = ::std::vector<UserId>{};
+	auto blocked = ::std::vector<UserId>{};
+	for (auto const& [user_id, delivery] : deliveries) {
+		states.push_back(static_cast<int>(delivery));
+		users.push_back(user_id);
+		if (delivery == Delivery::BLOCKED) {
+			blocked.push_back(user_id);
+		}
+	}
+	auto session = Checkout();
+	session.begin();
+	try {
+		session << "UPDATE BroadcastRecipients SET State=? WHERE BroadcastId=? AND UserId=?",
+			p_kw::use(states),
+			p_kw::use(ids),
+			p_kw::use(users),
+			p_kw::now;
+		if (!blocked.empty()) {
+			session << "INSERT INTO BlockedUsers VALUES(?) ON DUPLICATE KEY UPDATE UserId=UserId",
+				p_kw::use(blocked),
+				p_kw::now;
+		}
+		session.commit();
+	} catch (...) {
+		try {
+			session.rollback();
+		} catch (p::Exception const&) {
+		}
+		throw;
+	}
+}
+
+::std::vector<Storage::UserId> MySqlStorage::GetBlockedUsers()
+{
+	auto session = Checkout();
+	auto select = p_data::Statement{session};
+	select << "SELECT UserId FROM BlockedUsers",
+		p_kw::now;
+	auto rs = p_data::RecordSet{select};
+	auto user_ids = ::std::vector<UserId>{};
+	for (auto& row : rs) {
+		UserId user_id{};
+		row.get(0).convert(user_id);
+		user_ids.push_back(user_id);
+	}
+	return user_ids;
+}
+
+bool MySqlStorage::IsUserBlocked(UserId user_id)
+{
+	auto session = Checkout();
+	auto select = p_data::Statement{session};
+	select << "SELECT UserId FROM BlockedUsers WHERE UserId=?",
+		p_kw::bind(user_id),
+		p_kw::now;
+	auto rs = p_data::RecordSet{select};
+	return rs.extractedRowCount() != 0;
+}
+
+void MySqlStorage::UnblockUser(UserId user_id)
+{
+	auto session = Checkout();
+	session << "DELETE FROM BlockedUsers WHERE UserId=?",
+		p_kw::bind(user_id),
+		p_kw::now;
+}
+
+::std::vector<Storage::Reminder> MySqlStorage::ReadReminders()
+{
+	auto session = Checkout();
+	auto select = p_data::Statement{session};
+	select << "SELECT UserId, Minute FROM Reminders",
+		p_kw::now;
+	auto rs = p_data::RecordSet{select};
+	auto reminders = ::std::vector<Reminder>{};
+	for (auto& row : rs) {
+		auto& reminder = reminders.emplace_back();
+		row.get(0).convert(reminder.user_id);
+		row.get(1).convert(reminder.minute);
+	}
+	return reminders;
+}
+
+void MySqlStorage::SetReminder(UserId user_id, int minute)
+{
+	auto session = Checkout();
+	session << "INSERT INTO Reminders VALUES(?, ?) ON DUPLICATE KEY UPDATE Minute=VALUES(Minute)",
+		p_kw::bind(user_id),
+		p_kw::bind(minute),
+		p_kw::now;
+}
+
+void MySqlStorage::DeleteReminder(UserId user_id)
+{
+	auto session = Checkout();
+	session << "DELETE FROM Reminders WHERE UserId=?",
+		p_kw::bind(user_id),
+		p_kw::now;
+}
+
+// Keeps the idle sessions alive and lets the pool weed out dead ones;
+// the pool also checks a session's connection when handing it out.
+void MySqlStorage::Maintain()
+{
+	auto now = Clock::now();
+	if (now - pinged_ >= options_.ping_interval) {
+		pinged_ = now;
+		PingIdle();
+	}
+	metrics_.Set("db.pool.used", pool_->used());
+	metrics_.Set("db.pool.idle", pool_->idle());
+	metrics_.Set("db.pool.dead", pool_->dead());
+	metrics_.Set("db.pool.allocated", pool_->allocated());
+}
+
+// Pings every idle session, all checked out at once so that each ping
+// goes to a different one. A session that fails reconnects now rather
+// than when a handler next gets it.
+void MySqlStorage::PingIdle()
+{
+	auto sessions = ::std::vector<p_data::Session>{};
+	try {
+		for (auto n = pool_->idle(); n > 0; --n) {
+			sessions.push_back(pool_->get());
+		}
+	} catch (p_data::SessionPoolExhaustedException const&) {
+		// handlers took the rest meanwhile, and they are in use
+	}
+	auto failed = 0;
+	for (auto& session : sessions) {
+		try {
+			session << "SELECT 1", p_kw::now;
+		} catch (p::Exception const& e) {
+			++failed;
+			Logger::Warning("storage", "idle session ping failed")("error", e.displayText());
+			try {
+				session.reconnect();
+			} catch (p::Exception const& e) {
+				Logger::Error("storage", "reconnect failed")("error", e.displayText());
+			}
+		}
+	}
+	metrics_.Add("db.pings", sessions.size());
+	if (failed) {
+		metrics_.Add("db.ping_errors", failed);
+	}
+}
+
+// SessionPool::get() fails right away once max_sessions are out, so wait
+// for a session to come back with a short backoff up to the timeout.
+p_data::Session MySqlStorage::Checkout()
+{
+	auto deadline = Clock::now() + options_.checkout_timeout;
+	auto wait = ::std::chrono::milliseconds{1};
+	for (auto exhausted = false;;) {
+		try {
+			auto session = pool_->get();
+			metrics_.Add("db.checkouts");
+			return session;
+		} catch (p_data::SessionPoolExhaustedException const&) {
+			if (!exhausted) {
+				exhausted = true;
+				metrics_.Add("db.pool_exhausted");
+			}
+			if (Clock::now() >= deadline) {
+				metrics_.Add("db.checkout_timeouts");
+				throw;
+			}
+		}
+		::std::this_thread::sleep_for(wait);
+		wait = ::std::min(wait * 2, MAX_CHECKOUT_WAIT);
+	}
+}
+
+// vim: set ts=4 sw=4 noet :
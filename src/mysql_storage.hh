@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+
+#include <Poco/Data/Session.h>
+#include <Poco/Data/SessionPool.h>
+
+#include "metrics.hh"
+#include "storage.hh"
+
+// Storage on a MySQL server. Every operation checks a session out of a
+// pool for its own duration, so calls from different threads run on
+// separate connections.
+class MySqlStorage : public Storage {
+public:
+	struct PoolOptions {
+		int min_sessions{1};
+		int max_sessions{8};
+		::std::chrono::seconds idle_time{60};
+		::std::chrono::milliseconds checkout_timeout{2000};
+		::std::chrono::seconds ping_interval{30};
+	};
+
+	MySqlStorage(::std::string const& connection, PoolOptions const& options, Metrics& metrics);
+	~MySqlStorage() override;
+
+	bool IsUserRegistered(UserId user_id) override;
+	void RegisterUser(UserId user_id) override;
+	::std::vector<UserId> GetRegisteredUsers() override;
+	void PushInvite(::std::string const& invite, UserId invited_by,
+			::std::chrono::seconds ttl) override;
+	bool PopInvite(::std::string const& invite) override;
+	::std::size_t PurgeInvites(::std::size_t limit) override;
+	::std::vector<::std::pair<int, UserId>> ReadAttendances(int first_day, int last_day) override;
+	::std::vector<::std::pair<int, ::std::size_t>> CountAttendances(
+			int first_day, int last_day) override;
+	void ApplyAttendances(::std::vector<Change> const& batch) override;
+	Stats ReadStats(int first_month, int last_month) override;
+	::std::int64_t CreateBroadcast(UserId created_by, ::std::string const& text,
+			::std::vector<UserId> const& recipients) override;
+	::std::vector<Broadcast> ReadUnfinishedBroadcasts() override;
+	void RecordDeliveries(::std::int64_t broadcast_id,
+			::std::vector<::std::pair<UserId, Delivery>> const& deliveries) override;
+	::std::vector<UserId> GetBlockedUsers() override;
+	bool IsUserBlocked(UserId user_id) override;
+	void UnblockUser(UserId user_id) override;
+	::std::vector<Reminder> ReadReminders() override;
+	void SetReminder(UserId user_id, int minute) override;
+	void DeleteReminder(UserId user_id) override;
+	void Maintain() override;
+
+private:
+	using Clock = ::std::chrono::steady_clock;
+
+	static constexpr auto MAX_CHECKOUT_WAIT = ::std::chrono::milliseconds{50};
+	static constexpr auto MIGRATION_LOCK_TIMEOUT = ::std::chrono::seconds{60};
+
+	PoolOptions options_{};
+	Metrics& metrics_;
+	::std::unique_ptr<::Poco::Data::SessionPool> pool_{};
+	Clock::time_point pinged_{};
+
+	::Poco::Data::Session Checkout();
+	void Migrate(::Poco::Data::Session& session);
+	void PingIdle();
+};
+
+// vim: set ts=4 sw=4 noet :
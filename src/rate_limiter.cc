@@ -0,0 +1,44 @@
+#include "rate_limiter.hh"
+
+#include <algorithm>
+#include <thread>
+
+RateLimiter::RateLimiter(double rate)
+	: interval_{::std::chrono::duration_cast<Clock::duration>(
+		::std::chrono::duration<double>{1 / ::std::max(rate, 0.1)})}
+{
+}
+
+bool RateLimiter::TryAcquire()
+{
+	auto now = Clock::now();
+	auto lock = ::std::lock_guard{mutex_};
+	if (now < next_) {
+		return false;
+	}
+	// a taker a little late keeps the pace; an idle spell is not saved up
+	// for a burst
+	next_ = (now - next_ < interval_ ? next_ : now) + interval_;
+	return true;
+}
+
+void RateLimiter::Acquire()
+{
+	while (!TryAcquire()) {
+		::std::this_thread::sleep_until(Next());
+	}
+}
+
+RateLimiter::Clock::time_point RateLimiter::Next() const
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return next_;
+}
+
+void RateLimiter::Hold(Clock::time_point until)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	next_ = ::std::max(next_, until);
+}
+
+// vim: set ts=4 sw=4 noet :
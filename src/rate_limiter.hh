@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+
+// Paces sends that share Telegram's limit for the bot as a whole, one slot
+// every 1/rate seconds, from any thread. A 429 holds every taker, since
+// flood control is counted for the bot rather than for a single chat.
+class RateLimiter {
+public:
+	using Clock = ::std::chrono::steady_clock;
+
+	explicit RateLimiter(double rate);
+
+	RateLimiter(RateLimiter const&) = delete;
+	RateLimiter& operator=(RateLimiter const&) = delete;
+
+	// Takes the next slot if it is due.
+	bool TryAcquire();
+	// Sleeps until a slot is taken.
+	void Acquire();
+	// When the next slot is due; another taker may get it first.
+	Clock::time_point Next() const;
+	void Hold(Clock::time_point until);
+
+private:
+	Clock::duration interval_{};
+	mutable ::std::mutex mutex_{};
+	Clock::time_point next_{};
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,62 @@
+#include "retry_engine.hh"
+
+#include <algorithm>
+
+RetryEngine::RetryEngine(Options const& options, Metrics& metrics)
+	: options_{options}
+	, metrics_{metrics}
+{
+}
+
+void RetryEngine::Admit(::std::string_view endpoint)
+{
+	auto ibreaker = breakers_.find(::std::string{endpoint});
+	if (ibreaker == breakers_.end() || ibreaker->second.open_until == Clock::time_point{}) {
+		return;
+	}
+	auto& breaker = ibreaker->second;
+	if (Clock::now() < breaker.open_until || breaker.probing) {
+		metrics_.Add("api.breaker_rejected");
+		throw CircuitOpenError{"circuit open for " + ::std::string{endpoint}};
+	}
+	breaker.probing = true;
+}
+
+void RetryEngine::OnSuccess(::std::string_view endpoint)
+{
+	auto ibreaker = breakers_.find(::std::string{endpoint});
+	if (ibreaker == breakers_.end()) {
+		return;
+	}
+	if (ibreaker->second.probing) {
+		metrics_.Add("api.breaker_closed");
+	}
+	breakers_.erase(ibreaker);
+}
+
+void RetryEngine::OnFailure(::std::string_view endpoint)
+{
+	auto& breaker = breakers_[::std::string{endpoint}];
+	if (!breaker.probing && ++breaker.failures < options_.breaker_threshold) {
+		return;
+	}
+	breaker.probing = false;
+	breaker.open_until = Clock::now() + options_.breaker_cooldown;
+	metrics_.Add("api.breaker_opened");
+}
+
+RetryEngine::Clock::duration RetryEngine::Backoff(int attempt)
+{
+	auto cap = options_.base_delay * (::std::int64_t{1} << ::std::min(attempt - 1, 20));
+	cap = ::std::min(cap, options_.max_delay);
+	auto dist = ::std::uniform_int_distribution<::std::int64_t>{0, cap.count()};
+	return ::std::chrono::milliseconds{dist(prng_)};
+}
+
+RetryEngine::Clock::duration RetryEngine::RetryAfter(::std::chrono::seconds retry_after)
+{
+	auto dist = ::std::uniform_int_distribution<::std::int64_t>{0, options_.base_delay.count()};
+	return retry_after + ::std::chrono::milliseconds{dist(prng_)};
+}
+
+// vim: set ts=4 sw=4 noet :
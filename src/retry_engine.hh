@@ -0,0 +1,65 @@
+#pragma once
+
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "metrics.hh"
+
+// Backoff and circuit breaking for outbound API calls. Callers ask Admit()
+// before each attempt, report how the server behaved, and sleep Backoff()
+// between attempts. A breaker opens after a run of consecutive failures on
+// one endpoint, fails calls fast for the cooldown, then lets a single probe
+// through to decide whether to close again. Not thread-safe.
+class RetryEngine {
+public:
+	using Clock = ::std::chrono::steady_clock;
+
+	struct Options {
+		int max_attempts{4};
+		::std::chrono::milliseconds base_delay{100};
+		::std::chrono::milliseconds max_delay{5000};
+		// 429s waited out per call, in all; callers block meanwhile
+		::std::chrono::milliseconds max_retry_after{2000};
+		int breaker_threshold{5};
+		::std::chrono::milliseconds breaker_cooldown{5000};
+	};
+
+	struct CircuitOpenError : ::std::runtime_error {
+		using ::std::runtime_error::runtime_error;
+	};
+
+	RetryEngine(Options const& options, Metrics& metrics);
+
+	Options const& GetOptions() const { return options_; }
+
+	// Throws CircuitOpenError if the endpoint's breaker is open.
+	void Admit(::std::string_view endpoint);
+	// The server answered, even if with a client error.
+	void OnSuccess(::std::string_view endpoint);
+	// No usable answer: transport error, timeout or 5xx.
+	void OnFailure(::std::string_view endpoint);
+
+	// Full-jitter exponential delay before retry number `attempt` (1-based).
+	Clock::duration Backoff(int attempt);
+	// The server's own hint plus a little jitter, so that everything it
+	// throttled at once does not come back at once.
+	Clock::duration RetryAfter(::std::chrono::seconds retry_after);
+
+private:
+	struct Breaker {
+		int failures{};
+		Clock::time_point open_until{};
+		bool probing{};
+	};
+
+	Options options_{};
+	Metrics& metrics_;
+	::std::unordered_map<::std::string, Breaker> breakers_{};
+	::std::mt19937 prng_{::std::random_device{}()};
+};
+
+// vim: set ts=4 sw=4 noet :
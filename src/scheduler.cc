@@ -0,0 +1,165 @@
+#include "scheduler.hh"
+
+#include <algorithm>
+
+#include "logger.hh"
+
+Scheduler::Scheduler(Options const& options, Metrics& metrics)
+	: options_{options}
+	, metrics_{metrics}
+{
+	options_.tick = ::std::max(options_.tick, ::std::chrono::milliseconds{1});
+	options_.workers = ::std::max<::std::size_t>(options_.workers, 1);
+	timer_thread_ = ::std::thread{[this]() { RunTimer(); }};
+	for (::std::size_t i = 0; i < options_.workers; ++i) {
+		workers_.emplace_back([this]() { RunWorker(); });
+	}
+}
+
+// Jobs queued but not started are dropped.
+Scheduler::~Scheduler()
+{
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		stop_ = true;
+	}
+	timer_cv_.notify_all();
+	pool_cv_.notify_all();
+	timer_thread_.join();
+	for (auto& worker : workers_) {
+		worker.join();
+	}
+}
+
+Scheduler::Id Scheduler::After(Clock::duration delay, Job job)
+{
+	return Add(delay, {}, ::std::move(job));
+}
+
+Scheduler::Id Scheduler::Every(Clock::duration period, Job job)
+{
+	return Add(period, ::std::max<Clock::duration>(period, options_.tick), ::std::move(job));
+}
+
+void Scheduler::Cancel(Id id)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto ientry = entries_.find(id);
+	if (ientry == entries_.end()) {
+		return;
+	}
+	if (ientry->second.timer) {
+		wheel_.Cancel(ientry->second.timer);
+	}
+	entries_.erase(ientry);
+}
+
+::std::size_t Scheduler::Pending() const
+{
+	auto lock = ::std::lock_guard{mutex_};
+	return wheel_.Size();
+}
+
+Scheduler::Id Scheduler::Add(Clock::duration delay, Clock::duration period, Job job)
+{
+	auto lock = ::std::lock_guard{mutex_};
+	auto id = next_id_++;
+	auto& entry = entries_[id];
+	entry.period = period;
+	entry.job = ::std::make_shared<Job>(::std::move(job));
+	Arm(id, entry, delay);
+	return id;
+}
+
+// Called with the lock held. The wheel may lag behind the clock by the
+// ticks the timer thread has yet to process, so the expiry is counted
+// from the wheel's own time.
+void Scheduler::Arm(Id id, Entry& entry, Clock::duration delay)
+{
+	auto now = Clock::now();
+	if (!wheel_.Size()) {
+		// nothing to fire, so catching up is only moving the hand
+		auto ignored = ::std::vector<Id>{};
+		wheel_.Advance(TickOf(now) - ::std::min(TickOf(now), wheel_.Now()), ignored);
+	}
+	auto expiry = TickOf(now + delay + options_.tick - Clock::duration{1});
+	entry.timer = wheel_.Add(expiry - ::std::min(expiry, wheel_.Now()), id);
+	timer_cv_.notify_one();
+}
+
+// Called with the lock held.
+void Scheduler::Fire(Id id)
+{
+	auto ientry = entries_.find(id);
+	if (ientry == entries_.end()) {
+		return;
+	}
+	queue_.emplace_back(id, ientry->second.job);
+	if (ientry->second.period.count()) {
+		ientry->second.timer = 0;
+	} else {
+		entries_.erase(ientry);
+	}
+	pool_cv_.notify_one();
+}
+
+void Scheduler::RunTimer()
+{
+	auto due = ::std::vector<Id>{};
+	auto lock = ::std::unique_lock{mutex_};
+	while (!stop_) {
+		auto now = TickOf(Clock::now());
+		if (now > wheel_.Now()) {
+			wheel_.Advance(now - wheel_.Now(), due);
+			for (auto id : due) {
+				Fire(id);
+			}
+			due.clear();
+			metrics_.Set("scheduler.queued", queue_.size());
+		}
+		if (!wheel_.Size()) {
+			timer_cv_.wait(lock, [this]() { return stop_ || wheel_.Size(); });
+		} else {
+			timer_cv_.wait_until(lock, start_ + (wheel_.Now() + 1) * options_.tick);
+		}
+	}
+}
+
+void Scheduler::RunWorker()
+{
+	auto lock = ::std::unique_lock{mutex_};
+	for (;;) {
+		pool_cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+		if (stop_) {
+			return;
+		}
+		auto [id, job] = ::std::move(queue_.front());
+		queue_.pop_front();
+		lock.unlock();
+		auto started = Clock::now();
+		try {
+			(*job)();
+			metrics_.Add("scheduler.runs");
+		} catch (::std::exception const& e) {
+			metrics_.Add("scheduler.failures");
+			Logger::Error("scheduler", "job failed")("error", e.what());
+		} catch (...) {
+			metrics_.Add("scheduler.failures");
+			Logger::Error("scheduler", "job failed")("error", "unknown non-standard exception");
+		}
+		metrics_.Add("scheduler.run_ms", ::std::chrono::duration_cast<::std::chrono::milliseconds>(
+			Clock::now() - started).count());
+		lock.lock();
+		// periodic and not cancelled while it ran
+		if (auto ientry = entries_.find(id); ientry != entries_.end()) {
+			Arm(id, ientry->second, ientry->second.period);
+		}
+	}
+}
+
+::std::uint64_t Scheduler::TickOf(Clock::time_point time) const
+{
+	return ::std::max(time - start_, Clock::duration{}) / options_.tick;
+}
+
+// vim: set ts=4 sw=4 noet :
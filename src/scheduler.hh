@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "metrics.hh"
+#include "timer_wheel.hh"
+
+// Runs jobs after a delay or periodically, next to the update loop rather
+// than in it. A timer thread ticks a TimerWheel and hands due jobs to a
+// small pool of workers, so a slow job delays other jobs but never an
+// update. Jobs run on the pool threads and must only touch what is safe
+// to use from there.
+class Scheduler {
+public:
+	using Clock = ::std::chrono::steady_clock;
+	using Id = ::std::uint64_t;
+	using Job = ::std::function<void()>;
+
+	struct Options {
+		::std::chrono::milliseconds tick{100};
+		::std::size_t workers{2};
+	};
+
+	Scheduler(Options const& options, Metrics& metrics);
+	~Scheduler();
+
+	Scheduler(Scheduler const&) = delete;
+	Scheduler& operator=(Scheduler const&) = delete;
+
+	// Runs job once after delay, rounded up to a tick.
+	Id After(Clock::duration delay, Job job);
+	// Runs job every period, timed from the end of the previous run, so
+	// runs of one job never overlap.
+	Id Every(Clock::duration period, Job job);
+	// A run already started still finishes.
+	void Cancel(Id id);
+	::std::size_t Pending() const;
+
+private:
+	struct Entry {
+		TimerWheel<Id>::Id timer{}; // 0 while running
+		Clock::duration period{}; // zero for a one-off
+		::std::shared_ptr<Job> job{};
+	};
+
+	Options options_{};
+	Metrics& metrics_;
+	Clock::time_point start_{Clock::now()};
+
+	mutable ::std::mutex mutex_{};
+	::std::condition_variable timer_cv_{};
+	::std::condition_variable pool_cv_{};
+	bool stop_{false};
+	TimerWheel<Id> wheel_{};
+	::std::unordered_map<Id, Entry> entries_{};
+	Id next_id_{1};
+	::std::deque<::std::pair<Id, ::std::shared_ptr<Job>>> queue_{};
+	::std::thread timer_thread_{};
+	::std::vector<::std::thread> workers_{};
+
+	Id Add(Clock::duration delay, Clock::duration period, Job job);
+	void Arm(Id id, Entry& entry, Clock::duration delay);
+	void Fire(Id id);
+	void RunTimer();
+	void RunWorker();
+	::std::uint64_t TickOf(Clock::time_point time) const;
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,428 @@
+#include "shard.hh"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logger.hh"
+
+namespace {
+
+::std::string ErrnoString(char const* what, int err)
+{
+	return ::std::string{what}.append(": ").append(::std::strerror(err));
+}
+
+::std::uint64_t Fnv1a(::std::string_view s)
+{
+	auto hash = ::std::uint64_t{14695981039346656037ull};
+	for (auto c : s) {
+		hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// splitmix64 finalizer: spreads sequential chat ids and similar node names
+// evenly over the ring
+::std::uint64_t Mix(::std::uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+::sockaddr_un UnixAddress(::std::string const& path)
+{
+	auto addr = ::sockaddr_un{};
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw Shard::Error{"socket path too long: " + path};
+	}
+	addr.sun_family = AF_UNIX;
+	::std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return addr;
+}
+
+} // namespace
+
+Shard::Ring::Ring(::std::vector<::std::string> const& nodes)
+	: size_{nodes.size()}
+{
+	if (nodes.empty()) {
+		throw Error{"no shard workers"};
+	}
+	points_.reserve(nodes.size() * REPLICAS);
+	for (::std::size_t node = 0; node < nodes.size(); ++node) {
+		for (int i = 0; i < REPLICAS; ++i) {
+			points_.emplace_back(Mix(Fnv1a(nodes[node] + "#" + ::std::to_string(i))), node);
+		}
+	}
+	::std::sort(points_.begin(), points_.end());
+}
+
+::std::size_t Shard::Ring::Pick(::std::int64_t key) const
+{
+	auto hash = Mix(static_cast<::std::uint64_t>(key));
+	auto it = ::std::upper_bound(points_.begin(), points_.end(), hash,
+			[](::std::uint64_t h, auto const& point) { return h < point.first; });
+	return it == points_.end() ? points_.front().second : it->second;
+}
+
+Shard::Forwarder::Forwarder(::std::vector<::std::string> paths, ::std::size_t max_queued)
+	: max_queued_{max_queued}
+{
+	for (auto& path : paths) {
+		UnixAddress(path); // fail now on a bad path rather than on every reconnect
+		workers_.push_back(Worker{::std::move(path)});
+	}
+	epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) {
+		throw Error{ErrnoString("epoll_create1", errno)};
+	}
+	wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd_ < 0) {
+		auto err = errno;
+		::close(epoll_fd_);
+		throw Error{ErrnoString("eventfd", err)};
+	}
+	auto ev = ::epoll_event{};
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0; // workers are 1-based here
+	::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+	thread_ = ::std::thread{[this]() { Loop(); }};
+}
+
+Shard::Forwarder::~Forwarder()
+{
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		stop_ = true;
+	}
+	::std::uint64_t one = 1;
+	auto n = ::write(wake_fd_, &one, sizeof(one));
+	(void) n;
+	thread_.join();
+	for (auto& worker : workers_) {
+		if (!worker.frames.empty()) {
+			Logger::Warning("shard", "frames lost on shutdown")("worker", worker.path)
+				("frames", worker.frames.size());
+		}
+		Close(worker);
+	}
+	::close(wake_fd_);
+	::close(epoll_fd_);
+}
+
+void Shard::Forwarder::Send(::std::size_t worker, ::std::string_view payload)
+{
+	if (payload.size() > MAX_FRAME) {
+		throw Error{"frame too large"};
+	}
+	auto size = static_cast<::std::uint32_t>(payload.size());
+	auto frame = ::std::string{};
+	frame.reserve(4 + payload.size());
+	frame += static_cast<char>(size >> 24);
+	frame += static_cast<char>(size >> 16);
+	frame += static_cast<char>(size >> 8);
+	frame += static_cast<char>(size);
+	frame += payload;
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		incoming_.emplace_back(worker, ::std::move(frame));
+	}
+	::std::uint64_t one = 1;
+	auto n = ::write(wake_fd_, &one, sizeof(one));
+	(void) n; // a full counter already means a pending wake-up
+}
+
+Shard::Forwarder::Stats Shard::Forwarder::GetStats() const
+{
+	auto stats = Stats{};
+	stats.sent = sent_;
+	stats.dropped = dropped_;
+	stats.queued = queued_;
+	return stats;
+}
+
+void Shard::Forwarder::Loop()
+{
+	auto events = ::std::array<::epoll_event, MAX_EVENTS>{};
+	while (TakeIncoming()) {
+		// a worker that could not be reached is tried again after a delay
+		auto now = ::std::chrono::steady_clock::now();
+		auto timeout = -1;
+		for (auto& worker : workers_) {
+			if (worker.fd >= 0 || worker.frames.empty()) {
+				continue;
+			}
+			if (worker.retry_at <= now) {
+				Connect(worker);
+			}
+			if (worker.fd >= 0) {
+				Flush(worker);
+			}
+			if (worker.fd < 0) {
+				auto ms = ::std::chrono::ceil<::std::chrono::milliseconds>(worker.retry_at - now);
+				auto wait = static_cast<int>(::std::max<::std::chrono::milliseconds::rep>(ms.count(), 0));
+				timeout = timeout < 0 ? wait : ::std::min(timeout, wait);
+			}
+		}
+
+		auto n = ::epoll_wait(epoll_fd_, events.data(), MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			Logger::Error("shard", "epoll_wait failed")("error", ::std::strerror(errno));
+		}
+		for (int i = 0; i < n; ++i) {
+			if (auto id = events[i].data.u64; !id) {
+				::std::uint64_t value{};
+				auto r = ::read(wake_fd_, &value, sizeof(value));
+				(void) r;
+			} else if (auto& worker = workers_[id - 1]; worker.fd < 0) {
+				continue;
+			} else if (worker.frames.empty() && events[i].events & (EPOLLHUP | EPOLLERR)) {
+				// nothing to send, so only reconnect once there is
+				Logger::Info("shard", "worker disconnected")("worker", worker.path);
+				Close(worker);
+			} else {
+				Flush(worker);
+			}
+		}
+	}
+}
+
+// Moves what Send queued onto the workers' queues; false once stopped.
+bool Shard::Forwarder::TakeIncoming()
+{
+	auto frames = decltype(incoming_){};
+	{
+		auto lock = ::std::lock_guard{mutex_};
+		if (stop_) {
+			return false;
+		}
+		frames.swap(incoming_);
+	}
+	for (auto& [index, frame] : frames) {
+		auto& worker = workers_[index];
+		if (worker.bytes + frame.size() > max_queued_) {
+			dropped_.fetch_add(1, ::std::memory_order_relaxed);
+			Logger::Error("shard", "queue full, frame dropped")("worker", worker.path)
+				("queued_bytes", worker.bytes);
+			continue;
+		}
+		worker.bytes += frame.size();
+		queued_.fetch_add(frame.size(), ::std::memory_order_relaxed);
+		worker.frames.push_back(::std::move(frame));
+		if (worker.fd >= 0) {
+			Flush(worker);
+		}
+	}
+	return true;
+}
+
+void Shard::Forwarder::Connect(Worker& worker)
+{
+	auto addr = UnixAddress(worker.path);
+	auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		Logger::Error("shard", "socket failed")("error", ::std::strerror(errno));
+		worker.retry_at = ::std::chrono::steady_clock::now() + RECONNECT_DELAY;
+		return;
+	}
+	// unix sockets connect at once or not at all; a full backlog is EAGAIN
+	if (::connect(fd, reinterpret_cast<::sockaddr const*>(&addr), sizeof(addr)) < 0) {
+		Logger::Warning("shard", "connect failed")("worker", worker.path)
+			("queued_bytes", worker.bytes)("error", ::std::strerror(errno));
+		::close(fd);
+		worker.retry_at = ::std::chrono::steady_clock::now() + RECONNECT_DELAY;
+		return;
+	}
+	worker.fd = fd;
+	worker.watched = 0;
+	auto ev = ::epoll_event{};
+	ev.data.u64 = &worker - workers_.data() + 1;
+	::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+	Logger::Info("shard", "connected")("worker", worker.path);
+}
+
+// Writes until the queue is empty or the socket is full, and watches for
+// room in the latter case.
+void Shard::Forwarder::Flush(Worker& worker)
+{
+	while (!worker.frames.empty()) {
+		auto const& frame = worker.frames.front();
+		auto n = ::send(worker.fd, frame.data() + worker.pos, frame.size() - worker.pos,
+				MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				Watch(worker, EPOLLOUT);
+				return;
+			}
+			Logger::Warning("shard", "worker disconnected")("worker", worker.path)
+				("error", ::std::strerror(errno));
+			Close(worker);
+			return;
+		}
+		worker.pos += n;
+		if (worker.pos < frame.size()) {
+			continue;
+		}
+		worker.bytes -= frame.size();
+		queued_.fetch_sub(frame.size(), ::std::memory_order_relaxed);
+		worker.frames.pop_front();
+		worker.pos = 0;
+		sent_.fetch_add(1, ::std::memory_order_relaxed);
+	}
+	Watch(worker, 0);
+}
+
+void Shard::Forwarder::Watch(Worker& worker, ::std::uint32_t events)
+{
+	if (worker.watched == events) {
+		return;
+	}
+	auto ev = ::epoll_event{};
+	ev.events = events;
+	ev.data.u64 = &worker - workers_.data() + 1;
+	::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, worker.fd, &ev);
+	worker.watched = events;
+}
+
+// The worker throws away the part of a frame a closed connection carried,
+// so the frame in flight goes again from its start.
+void Shard::Forwarder::Close(Worker& worker)
+{
+	if (worker.fd >= 0) {
+		::close(worker.fd);
+		worker.fd = -1;
+	}
+	worker.pos = 0;
+	worker.retry_at = ::std::chrono::steady_clock::now() + RECONNECT_DELAY;
+}
+
+Shard::Receiver::Receiver(::std::string path)
+	: path_{::std::move(path)}
+{
+	auto addr = UnixAddress(path_);
+	listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0) {
+		throw Error{ErrnoString("socket", errno)};
+	}
+	// left behind by a previous run; bind fails on it otherwise
+	::unlink(path_.c_str());
+	if (::bind(listen_fd_, reinterpret_cast<::sockaddr const*>(&addr), sizeof(addr)) < 0
+			|| ::listen(listen_fd_, 4) < 0) {
+		auto err = errno;
+		::close(listen_fd_);
+		throw Error{ErrnoString(("listen on " + path_).c_str(), err)};
+	}
+}
+
+Shard::Receiver::~Receiver()
+{
+	Drop();
+	::close(listen_fd_);
+	::unlink(path_.c_str());
+}
+
+::std::vector<::std::string> Shard::Receiver::Receive(::std::chrono::milliseconds timeout)
+{
+	auto fds = ::std::array<::pollfd, 2>{};
+	fds[0].fd = listen_fd_;
+	fds[0].events = POLLIN;
+	fds[1].fd = client_fd_;
+	fds[1].events = POLLIN;
+	auto n = ::poll(fds.data(), client_fd_ < 0 ? 1 : 2, static_cast<int>(timeout.count()));
+	if (n < 0 && errno != EINTR) {
+		throw Error{ErrnoString("poll", errno)};
+	}
+	if (n > 0 && client_fd_ >= 0 && fds[1].revents) {
+		Read();
+	}
+
+	auto frames = ::std::vector<::std::string>{};
+	auto pos = ::std::size_t{};
+	while (buffer_.size() - pos >= 4) {
+		auto const* p = reinterpret_cast<unsigned char const*>(buffer_.data() + pos);
+		auto size = ::std::size_t{p[0]} << 24 | ::std::size_t{p[1]} << 16
+			| ::std::size_t{p[2]} << 8 | ::std::size_t{p[3]};
+		if (size > MAX_FRAME) {
+			Drop();
+			throw Error{"oversized frame from frontend"};
+		}
+		if (buffer_.size() - pos - 4 < size) {
+			break;
+		}
+		frames.emplace_back(buffer_, pos + 4, size);
+		pos += 4 + size;
+	}
+	buffer_.erase(0, pos);
+	if (client_fd_ < 0) {
+		// the rest of a frame from a closed connection never arrives
+		buffer_.clear();
+	}
+
+	if (n > 0 && fds[0].revents) {
+		Accept();
+	}
+	return frames;
+}
+
+void Shard::Receiver::Accept()
+{
+	auto fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			Logger::Error("shard", "accept failed")("error", ::std::strerror(errno));
+		}
+		return;
+	}
+	if (client_fd_ >= 0) {
+		Logger::Warning("shard", "frontend replaced")("pending_bytes", buffer_.size());
+	}
+	Drop();
+	client_fd_ = fd;
+	Logger::Info("shard", "frontend connected")("socket", path_);
+}
+
+void Shard::Receiver::Drop()
+{
+	if (client_fd_ >= 0) {
+		::close(client_fd_);
+		client_fd_ = -1;
+	}
+	buffer_.clear();
+}
+
+void Shard::Receiver::Read()
+{
+	auto chunk = ::std::array<char, 65536>{};
+	while (true) {
+		auto n = ::read(client_fd_, chunk.data(), chunk.size());
+		if (n > 0) {
+			buffer_.append(chunk.data(), n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		Logger::Info("shard", "frontend disconnected")("socket", path_);
+		::close(client_fd_);
+		client_fd_ = -1;
+		return;
+	}
+}
+
+// vim: set ts=4 sw=4 noet :
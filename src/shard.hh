@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Splits the bot across processes. Telegram allows a single getUpdates
+// consumer, so one frontend polls and forwards every update over a unix
+// socket to the worker that owns its chat. Workers keep disjoint session
+// state and share the database.
+//
+// On the wire a frame is a 4-byte big-endian length and a JSON array of
+// updates.
+class Shard {
+public:
+	static constexpr ::std::size_t MAX_FRAME = 16 << 20;
+
+	struct Error : ::std::runtime_error {
+		using ::std::runtime_error::runtime_error;
+	};
+
+	// Consistent hashing of chat ids onto workers: adding or removing a
+	// worker moves only the chats on its own arcs of the ring.
+	class Ring {
+	public:
+		static constexpr int REPLICAS = 160;
+
+		explicit Ring(::std::vector<::std::string> const& nodes);
+
+		::std::size_t Pick(::std::int64_t key) const;
+		::std::size_t Size() const { return size_; }
+
+	private:
+		::std::vector<::std::pair<::std::uint64_t, ::std::size_t>> points_{}; // hash,node
+		::std::size_t size_{};
+	};
+
+	// The frontend end of the workers' sockets. Frames queue per worker and
+	// a thread of its own drains the queues over non-blocking sockets, so a
+	// worker that is slow, restarting or gone holds up neither the frontend
+	// nor the other workers. Its frames wait, up to max_queued bytes, and go
+	// out once it is reachable again.
+	class Forwarder {
+	public:
+		struct Stats {
+			::std::uint64_t sent{};    // frames
+			::std::uint64_t dropped{}; // frames that found the queue full
+			::std::uint64_t queued{};  // bytes waiting, all workers
+		};
+
+		Forwarder(::std::vector<::std::string> paths, ::std::size_t max_queued);
+		~Forwarder();
+
+		Forwarder(Forwarder const&) = delete;
+		Forwarder& operator=(Forwarder const&) = delete;
+
+		// Never blocks. Throws Error if the frame is too large.
+		void Send(::std::size_t worker, ::std::string_view payload);
+		Stats GetStats() const;
+
+	private:
+		static constexpr int MAX_EVENTS = 16;
+		static constexpr auto RECONNECT_DELAY = ::std::chrono::seconds{1};
+
+		struct Worker {
+			::std::string path{};
+			int fd{-1};
+			::std::uint32_t watched{};
+			::std::deque<::std::string> frames{};
+			::std::size_t pos{}; // written part of frames.front()
+			::std::size_t bytes{};
+			::std::chrono::steady_clock::time_point retry_at{};
+		};
+
+		::std::size_t max_queued_{};
+		int epoll_fd_{-1};
+		int wake_fd_{-1};
+		::std::thread thread_{};
+
+		::std::atomic<::std::uint64_t> sent_{};
+		::std::atomic<::std::uint64_t> dropped_{};
+		::std::atomic<::std::uint64_t> queued_{};
+
+		::std::mutex mutex_{};
+		bool stop_{false};
+		::std::vector<::std::pair<::std::size_t, ::std::string>> incoming_{};
+
+		// owned by the thread
+		::std::vector<Worker> workers_{};
+
+		void Loop();
+		bool TakeIncoming();
+		void Connect(Worker& worker);
+		void Flush(Worker& worker);
+		void Watch(Worker& worker, ::std::uint32_t events);
+		void Close(Worker& worker);
+	};
+
+	// The worker end. A frontend that reconnects replaces the previous
+	// connection.
+	class Receiver {
+	public:
+		explicit Receiver(::std::string path);
+		~Receiver();
+
+		Receiver(Receiver const&) = delete;
+		Receiver& operator=(Receiver const&) = delete;
+
+		// Waits up to timeout for data and returns the complete frames.
+		::std::vector<::std::string> Receive(::std::chrono::milliseconds timeout);
+
+	private:
+		::std::string path_{};
+		int listen_fd_{-1};
+		int client_fd_{-1};
+		::std::string buffer_{};
+
+		void Accept();
+		void Drop();
+		void Read();
+	};
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,123 @@
+#include "snapshot.hh"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Poco/Checksum.h>
+
+namespace {
+
+::std::uint32_t Crc32(::std::string_view data)
+{
+	auto crc = ::Poco::Checksum{::Poco::Checksum::TYPE_CRC32};
+	crc.update(data.data(), static_cast<unsigned>(data.size()));
+	return crc.checksum();
+}
+
+Snapshot::Error SystemError(::std::string const& what)
+{
+	return Snapshot::Error{"snapshot: " + what + ": " + ::std::strerror(errno)};
+}
+
+} // namespace
+
+void Snapshot::Save(::std::string const& path, Writer const& writer)
+{
+	auto const& payload = writer.Data();
+	auto data = ::std::string{MAGIC, sizeof(MAGIC)};
+	auto version = VERSION;
+	auto crc = Crc32(payload);
+	auto size = static_cast<::std::uint64_t>(payload.size());
+	data.append(reinterpret_cast<char const*>(&version), sizeof(version));
+	data.append(reinterpret_cast<char const*>(&crc), sizeof(crc));
+	data.append(reinterpret_cast<char const*>(&size), sizeof(size));
+	data += payload;
+
+	auto tmp_path = path + ".tmp";
+	auto fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		throw SystemError("open " + tmp_path);
+	}
+	for (::std::size_t done = 0; done < data.size();) {
+		auto n = ::write(fd, data.data() + done, data.size() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			auto error = SystemError("write " + tmp_path);
+			::close(fd);
+			::unlink(tmp_path.c_str());
+			throw error;
+		}
+		done += n;
+	}
+	if (::fdatasync(fd) < 0 || ::close(fd) < 0) {
+		auto error = SystemError("sync " + tmp_path);
+		::unlink(tmp_path.c_str());
+		throw error;
+	}
+	if (::rename(tmp_path.c_str(), path.c_str()) < 0) {
+		auto error = SystemError("rename " + tmp_path);
+		::unlink(tmp_path.c_str());
+		throw error;
+	}
+}
+
+bool Snapshot::Load(::std::string const& path, ::std::function<void(Reader&)> const& f)
+{
+	auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			return false;
+		}
+		throw SystemError("open " + path);
+	}
+	struct ::stat st{};
+	if (::fstat(fd, &st) < 0) {
+		auto error = SystemError("stat " + path);
+		::close(fd);
+		throw error;
+	}
+	auto file_size = static_cast<::std::size_t>(st.st_size);
+	if (file_size < HEADER_SIZE) {
+		::close(fd);
+		throw Error{"snapshot: " + path + " is truncated"};
+	}
+	auto map = ::mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		throw SystemError("mmap " + path);
+	}
+	auto unmap = [&]() { ::munmap(map, file_size); };
+	try {
+		auto base = static_cast<char const*>(map);
+		auto header = Reader{{base, HEADER_SIZE}};
+		auto magic = header.Get<::std::uint64_t>();
+		auto version = header.Get<::std::uint32_t>();
+		auto crc = header.Get<::std::uint32_t>();
+		auto size = header.Get<::std::uint64_t>();
+		if (::std::memcmp(&magic, MAGIC, sizeof(MAGIC))) {
+			throw Error{"snapshot: " + path + " is not a snapshot"};
+		}
+		if (version != VERSION) {
+			throw Error{"snapshot: " + path + " has version " + ::std::to_string(version)};
+		}
+		auto payload = ::std::string_view{base + HEADER_SIZE, file_size - HEADER_SIZE};
+		if (size != payload.size() || crc != Crc32(payload)) {
+			throw Error{"snapshot: " + path + " is corrupt"};
+		}
+		auto reader = Reader{payload};
+		f(reader);
+	} catch (...) {
+		unmap();
+		throw;
+	}
+	unmap();
+	return true;
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Versioned, checksummed binary image of in-memory state for warm
+// restarts. The file is replaced atomically on save and memory-mapped on
+// load; the payload format is up to the caller.
+class Snapshot {
+public:
+	static constexpr ::std::uint32_t VERSION = 2;
+
+	struct Error : ::std::runtime_error {
+		using ::std::runtime_error::runtime_error;
+	};
+
+	class Writer {
+	public:
+		template<typename T> void Put(T value);
+		void PutString(::std::string_view s);
+		::std::string const& Data() const { return data_; }
+
+	private:
+		::std::string data_{};
+	};
+
+	class Reader {
+	public:
+		explicit Reader(::std::string_view data) : data_{data} {}
+
+		template<typename T> T Get();
+		::std::string GetString();
+		bool Done() const { return data_.empty(); }
+
+	private:
+		::std::string_view data_{};
+
+		char const* Take(::std::size_t size);
+	};
+
+	static void Save(::std::string const& path, Writer const& writer);
+	// Hands the payload of a valid snapshot to f and returns true, or
+	// returns false when there is no snapshot. Throws Error if it is
+	// corrupt or of another version.
+	static bool Load(::std::string const& path, ::std::function<void(Reader&)> const& f);
+
+private:
+	static constexpr char MAGIC[8] = {'T', 'G', 'B', 'O', 'T', 'S', 'N', 'P'};
+	// magic (8), version (4), CRC-32 of the payload (4), payload size (8)
+	static constexpr ::std::size_t HEADER_SIZE = 24;
+};
+
+template<typename T>
+	inline void Snapshot::Writer::Put(T value)
+{
+	static_assert(::std::is_trivially_copyable_v<T>);
+	data_.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+inline void Snapshot::Writer::PutString(::std::string_view s)
+{
+	Put<::std::uint32_t>(s.size());
+	data_.append(s);
+}
+
+template<typename T>
+	inline T Snapshot::Reader::Get()
+{
+	static_assert(::std::is_trivially_copyable_v<T>);
+	T value{};
+	::std::memcpy(&value, Take(sizeof(value)), sizeof(value));
+	return value;
+}
+
+inline ::std::string Snapshot::Reader::GetString()
+{
+	auto size = Get<::std::uint32_t>();
+	return ::std::string{Take(size), size};
+}
+
+inline char const* Snapshot::Reader::Take(::std::size_t size)
+{
+	if (size > data_.size()) {
+		throw Error{"snapshot: truncated payload"};
+	}
+	auto p = data_.data();
+	data_.remove_prefix(size);
+	return p;
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Persistent state of the bot: registered users, invites and attendances.
+// Attendance dates are day numbers (see day_number.hh). Calls come from
+// the main thread, the attendance journal, the broadcaster and the
+// scheduler's pool at once.
+class Storage {
+public:
+	using UserId = ::std::int64_t;
+
+	static constexpr auto LEGACY_INVITE_TTL = ::std::chrono::hours{24 * 7};
+
+	struct Change {
+		UserId user_id{};
+		int day{};
+		bool remove{};
+	};
+
+	// Rolled-up attendance; months are numbered year * 12 + month - 1.
+	struct UserMonth {
+		int month{};
+		UserId user_id{};
+		int days{}; // days the user attended
+	};
+
+	struct MonthSummary {
+		int month{};
+		int busiest_day{}; // most users on a single day
+		int active_days{}; // days anyone attended
+	};
+
+	struct Stats {
+		::std::vector<UserMonth> users{};
+		::std::vector<MonthSummary> months{};
+	};
+
+	enum class Delivery : int {
+		PENDING, SENT, BLOCKED, FAILED
+	};
+
+	// A message fanned out to a fixed list of users; every recipient's
+	// outcome is checkpointed so an interrupted run resumes.
+	struct Broadcast {
+		::std::int64_t id{};
+		UserId created_by{};
+		::std::string text{};
+		::std::size_t total{}; // recipients, delivered or not
+		::std::vector<UserId> pending{};
+	};
+
+	// A daily reminder; minute counts from midnight in the time zone the
+	// bot is configured with.
+	struct Reminder {
+		UserId user_id{};
+		int minute{};
+	};
+
+	virtual ~Storage() = default;
+
+	virtual bool IsUserRegistered(UserId user_id) = 0;
+	virtual void RegisterUser(UserId user_id) = 0;
+	virtual ::std::vector<UserId> GetRegisteredUsers() = 0;
+
+	// Invites from before invites expired are given LEGACY_INVITE_TTL.
+	virtual void PushInvite(::std::string const& invite, UserId invited_by,
+			::std::chrono::seconds ttl) = 0;
+	// Redeems an invite that has not expired. Of concurrent redemptions of
+	// one invite exactly one succeeds.
+	virtual bool PopInvite(::std::string const& invite) = 0;
+	// Deletes up to limit expired invites; returns how many it deleted.
+	virtual ::std::size_t PurgeInvites(::std::size_t limit) = 0;
+
+	// (day, user) pairs with first_day <= day <= last_day
+	virtual ::std::vector<::std::pair<int, UserId>> ReadAttendances(int first_day, int last_day) = 0;
+	// (day, number of users) for the days in the range that have any
+	virtual ::std::vector<::std::pair<int, ::std::size_t>> CountAttendances(
+			int first_day, int last_day) = 0;
+	// Also keeps the rollups behind ReadStats() up to date.
+	virtual void ApplyAttendances(::std::vector<Change> const& batch) = 0;
+	virtual Stats ReadStats(int first_month, int last_month) = 0;
+
+	// Returns the new broadcast's id.
+	virtual ::std::int64_t CreateBroadcast(UserId created_by, ::std::string const& text,
+			::std::vector<UserId> const& recipients) = 0;
+	// Broadcasts with recipients still pending, oldest first.
+	virtual ::std::vector<Broadcast> ReadUnfinishedBroadcasts() = 0;
+	// A BLOCKED delivery also marks the user as blocked.
+	virtual void RecordDeliveries(::std::int64_t broadcast_id,
+			::std::vector<::std::pair<UserId, Delivery>> const& deliveries) = 0;
+	// Users who blocked the bot, left out of broadcasts until they are back.
+	virtual ::std::vector<UserId> GetBlockedUsers() = 0;
+	virtual bool IsUserBlocked(UserId user_id) = 0;
+	virtual void UnblockUser(UserId user_id) = 0;
+
+	virtual ::std::vector<Reminder> ReadReminders() = 0;
+	// Replaces the user's reminder, if any.
+	virtual void SetReminder(UserId user_id, int minute) = 0;
+	virtual void DeleteReminder(UserId user_id) = 0;
+
+	// Periodic housekeeping, run by the scheduler.
+	virtual void Maintain() {}
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -1,39 +1,187 @@
 #include "telegram_bot.hh"
 
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
+#include <iomanip>
+#include <numeric>
 #include <optional>
 #include <regex>
+#include <set>
 #include <sstream>
+#include <thread>
 
 #include <Poco/Base64Encoder.h>
-#include <Poco/Data/MySQL/MySQLException.h>
-#include <Poco/Data/RecordSet.h>
+#include <Poco/CountingStream.h>
 #include <Poco/Exception.h>
+#include <Poco/InflatingStream.h>
+#include <Poco/MemoryStream.h>
 #include <Poco/Random.h>
-#include <Poco/TextEncoding.h>
-#include <Poco/TextIterator.h>
 #include <Poco/Util/PropertyFileConfiguration.h>
 
 #include <libmemcached/memcached.h>
 
+#include "alloc_counter.hh"
+#include "day_number.hh"
+#include "log_storage.hh"
+#include "logger.hh"
+#include "mysql_storage.hh"
+#include "snapshot.hh"
+#include "tracer.hh"
+
 namespace p = ::Poco;
 namespace p_json = ::Poco::JSON;
 namespace p_net = ::Poco::Net;
 namespace p_dyn = ::Poco::Dynamic;
 namespace p_util = ::Poco::Util;
-namespace p_data = ::Poco::Data;
-namespace p_kw = ::Poco::Data::Keywords;
 
-TelegramBot::TelegramBot(Error& error) noexcept
+namespace {
+
+// FNV-1a over whatever is written to it, so nothing has to be kept.
+class HashStreamBuf : public ::std::streambuf {
+public:
+	::std::size_t Value() const { return hash_; }
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			Mix(traits_type::to_char_type(c));
+		}
+		return traits_type::not_eof(c);
+	}
+
+	::std::streamsize xsputn(char const* s, ::std::streamsize n) override
+	{
+		for (auto i = ::std::streamsize{}; i < n; ++i) {
+			Mix(s[i]);
+		}
+		return n;
+	}
+
+private:
+	::std::uint64_t hash_{14695981039346656037ull};
+
+	void Mix(char c)
+	{
+		hash_ = (hash_ ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+	}
+};
+
+} // namespace
+
+TelegramBot::TelegramBot(::std::string const& conf_path, Error& error) noexcept
 try {
 	auto conf = p_util::AbstractConfiguration::Ptr{
-		new p_util::PropertyFileConfiguration{"telegram-bot.conf"}};
+		new p_util::PropertyFileConfiguration{conf_path}};
+	Logger::SetLevel(Logger::ParseLevel(conf->getString("log.level", "info"), Logger::Level::INFO));
 	api_token_ = conf->getString("api.token");
-	db_host_ = conf->getString("db.host");
-	db_port_ = conf->getString("db.port");
-	db_database_ = conf->getString("db.database");
-	db_user_ = conf->getString("db.user");
-	db_password_ = conf->getString("db.password");
+	api_timeout_ = ::std::chrono::milliseconds{conf->getInt("api.timeout", 10000)};
+	poll_timeout_ = conf->getInt("api.poll_timeout", 2);
+	compression_ = conf->getBool("api.compression", true);
+	metrics_interval_ = ::std::chrono::seconds{conf->getInt("metrics.interval", 300)};
+	snapshot_path_ = conf->getString("snapshot.path", "telegram-bot.snapshot");
+	snapshot_interval_ = ::std::chrono::seconds{conf->getInt("snapshot.interval", 60)};
+	restored_ = ::std::async(::std::launch::async,
+		[path = snapshot_path_]() { return LoadSnapshot(path); });
+	Tracer::Configure(conf->getDouble("trace.sample_rate", 0), conf->getUInt("trace.capacity", 4096));
+	trace_path_ = conf->getString("trace.path", "telegram-bot.trace.json");
+	trace_interval_ = ::std::chrono::seconds{conf->getInt("trace.interval", 0)};
+	user_data_.Configure(
+		conf->getUInt64("session.memory_budget", 4 << 20),
+		::std::chrono::seconds{conf->getInt("session.ttl", 3600)},
+		&UserDataCost);
+	user_cache_.Configure(
+		conf->getUInt64("user_cache.memory_budget", 4 << 20),
+		::std::chrono::seconds{conf->getInt("user_cache.ttl", 86400)},
+		&UserCost);
+	render_cache_.Configure(
+		conf->getUInt64("render_cache.memory_budget", 1 << 20),
+		::std::chrono::seconds{conf->getInt("render_cache.ttl", 172800)});
+	invite_ttl_ = ::std::chrono::seconds{conf->getInt("invites.ttl", 604800)};
+	invite_misses_.Configure(
+		conf->getUInt64("invites.miss_cache.memory_budget", 1 << 20),
+		::std::chrono::seconds{conf->getInt("invites.miss_cache.ttl", 600)});
+	invite_failures_.Configure(
+		conf->getUInt64("invites.miss_cache.memory_budget", 1 << 20),
+		::std::chrono::seconds{conf->getInt("invites.miss_cache.ttl", 600)});
+	max_invite_failures_ = conf->getInt("invites.max_failures", 5);
+
+	auto role = conf->getString("shard.role", "standalone");
+	if (role == "frontend") {
+		role_ = Role::FRONTEND;
+		auto workers = ::std::vector<::std::string>{};
+		auto list = ::std::istringstream{conf->getString("shard.workers")};
+		for (::std::string path{}; ::std::getline(list, path, ',');) {
+			path.erase(0, path.find_first_not_of(' '));
+			path.erase(path.find_last_not_of(' ') + 1);
+			if (!path.empty()) {
+				workers.push_back(path);
+			}
+		}
+		shard_ring_ = ::std::make_unique<Shard::Ring>(workers);
+		shard_forwarder_ = ::std::make_unique<Shard::Forwarder>(::std::move(workers),
+			conf->getUInt64("shard.queue_bytes", 64 << 20));
+	} else if (role == "worker") {
+		role_ = Role::WORKER;
+		shard_receiver_ = ::std::make_unique<Shard::Receiver>(
+			conf->getString("shard.listen", "telegram-bot.sock"));
+		window_ttl_ = ::std::chrono::milliseconds{conf->getInt("shard.window_ttl", 1000)};
+	} else if (role != "standalone") {
+		throw p::InvalidArgumentException{"unknown shard.role", role};
+	}
+
+	// Storage is opened, and migrated if need be, while TLS is set up and
+	// the API connection warms; nothing needs it before the journal. Should
+	// anything before storage.get() throw, the future's destructor still
+	// waits for the open: up to the connect timeout and
+	// MIGRATION_LOCK_TIMEOUT, plus any migration already under way, which
+	// is left to finish rather than cut off halfway.
+	auto storage = ::std::future<::std::unique_ptr<Storage>>{};
+	if (role_ != Role::FRONTEND) {
+		auto backend = conf->getString("storage.backend", "mysql");
+		if (backend == "mysql") {
+			::std::stringstream conn_sstm {};
+			conn_sstm <<
+				"host=" << conf->getString("db.host") << ";" <<
+				"port=" << conf->getString("db.port") << ";" <<
+				"db=" << conf->getString("db.database") << ";" <<
+				"user=" << conf->getString("db.user") << ";" <<
+				"password=" << conf->getString("db.password") << ";" <<
+				"compress=true;" <<
+				"auto-reconnect=true";
+			auto pool = MySqlStorage::PoolOptions{};
+			pool.min_sessions = conf->getInt("db.pool.min", pool.min_sessions);
+			pool.max_sessions = conf->getInt("db.pool.max", pool.max_sessions);
+			pool.idle_time = ::std::chrono::seconds{
+				conf->getInt("db.pool.idle_time", pool.idle_time.count())};
+			pool.checkout_timeout = ::std::chrono::milliseconds{
+				conf->getInt("db.pool.checkout_timeout", pool.checkout_timeout.count())};
+			pool.ping_interval = ::std::chrono::seconds{
+				conf->getInt("db.pool.ping_interval", pool.ping_interval.count())};
+			storage = ::std::async(::std::launch::async,
+				[this, connection = conn_sstm.str(), pool]() -> ::std::unique_ptr<Storage> {
+					auto start = ::std::chrono::steady_clock::now();
+					auto mysql = ::std::make_unique<MySqlStorage>(connection, pool, metrics_);
+					Logger::Info("storage", "opened")("backend", "mysql")
+						("ms", ::std::chrono::duration_cast<::std::chrono::milliseconds>(
+							::std::chrono::steady_clock::now() - start).count());
+					return mysql;
+				});
+		} else if (backend == "embedded") {
+			storage = ::std::async(::std::launch::async,
+				[path = conf->getString("storage.path", "telegram-bot.db")]() -> ::std::unique_ptr<Storage> {
+					auto start = ::std::chrono::steady_clock::now();
+					auto log = ::std::make_unique<LogStorage>(path);
+					Logger::Info("storage", "opened")("backend", "embedded")
+						("ms", ::std::chrono::duration_cast<::std::chrono::milliseconds>(
+							::std::chrono::steady_clock::now() - start).count());
+					return log;
+				});
+		} else {
+			throw p::InvalidArgumentException{"unknown storage.backend", backend};
+		}
+	}
 
 	base_path_ = GenerateBasePath(api_token_);
 
@@ -47,357 +195,669 @@ try {
 	p_net::SSLManager::instance().initializeClient(0, cert_handler_, context_);
 
 	const auto uri = p::URI{API_URL};
-	api_session_ = ::std::make_unique<p_net::HTTPSClientSession>(uri.getHost(), uri.getPort(), context_);
-	api_session_->setKeepAlive(true);
-
-	p_data::MySQL::Connector::registerConnector();
-	::std::stringstream conn_sstm {};
-	conn_sstm <<
-		"host=" << db_host_ << ";" <<
-		"port=" << db_port_ << ";" <<
-		"db=" << db_database_ << ";" <<
-		"user=" << db_user_ << ";" <<
-		"password=" << db_password_ << ";" <<
-		"compress=true;" <<
-		"auto-reconnect=true";
-	db_session_ = ::std::make_unique<p_data::Session>("MySQL", conn_sstm.str());
-	*db_session_ << "CREATE TABLE IF NOT EXISTS RegisteredUsers ("
-		"UserId BIGINT PRIMARY KEY);", p_kw::now;
-	*db_session_ << "CREATE TABLE IF NOT EXISTS Attendances ("
-		"Date DATE, "
-		"UserId BIGINT, "
-		"PRIMARY KEY (Date, UserId))", p_kw::now;
-	*db_session_ << "CREATE TABLE IF NOT EXISTS Invites ("
-		"Invite VARCHAR(64) PRIMARY KEY, "
-		"InvitedBy BIGINT)", p_kw::now;
+	api_host_ = uri.getHost();
+	api_port_ = uri.getPort();
+	http_loop_ = ::std::make_unique<HttpLoop>(context_->sslContext());
+	if (conf->getBool("api.keep_warm", true)) {
+		auto warm = HttpLoop::Request{};
+		warm.host = api_host_;
+		warm.port = api_port_;
+		warm.tls = true;
+		warm.timeout = api_timeout_;
+		http_loop_->KeepWarm(::std::move(warm));
+	}
+
+	auto retry = RetryEngine::Options{};
+	retry.max_attempts = conf->getInt("retry.max_attempts", retry.max_attempts);
+	retry.base_delay = ::std::chrono::milliseconds{
+		conf->getInt("retry.base_delay", retry.base_delay.count())};
+	retry.max_delay = ::std::chrono::milliseconds{
+		conf->getInt("retry.max_delay", retry.max_delay.count())};
+	retry.max_retry_after = ::std::chrono::milliseconds{
+		conf->getInt("retry.max_retry_after", retry.max_retry_after.count())};
+	retry.breaker_threshold = conf->getInt("retry.breaker_threshold", retry.breaker_threshold);
+	retry.breaker_cooldown = ::std::chrono::milliseconds{
+		conf->getInt("retry.breaker_cooldown", retry.breaker_cooldown.count())};
+	retry_ = ::std::make_unique<RetryEngine>(retry, metrics_);
+
+	// the frontend only polls and forwards
+	if (role_ != Role::FRONTEND) {
+		if (conf->getBool("attendance_cache.enabled", false)) {
+			auto cache = AttendanceCache::Options{};
+			cache.servers = conf->getString("attendance_cache.servers", cache.servers);
+			cache.ttl = ::std::chrono::seconds{
+				conf->getInt("attendance_cache.ttl", cache.ttl.count())};
+			cache.timeout = ::std::chrono::milliseconds{
+				conf->getInt("attendance_cache.timeout", cache.timeout.count())};
+			cache.cas_attempts = conf->getInt("attendance_cache.cas_attempts", cache.cas_attempts);
+			attendance_cache_ = ::std::make_unique<AttendanceCache>(cache, metrics_);
+		}
+
+		storage_ = storage.get();
+		journal_ = ::std::make_unique<AttendanceJournal>(
+			conf->getString("journal.path", "attendance.journal"),
+			[this](auto const& batch) { UpdateDataBase(batch); },
+			metrics_,
+			::std::chrono::milliseconds{conf->getInt("journal.commit_interval", 100)},
+			conf->getUInt("journal.batch_size", 512));
+
+		auto admins = ::std::istringstream{conf->getString("broadcast.admins", "")};
+		for (::std::string id{}; ::std::getline(admins, id, ',');) {
+			if (id.find_first_not_of(' ') != ::std::string::npos) {
+				broadcast_admins_.insert(::std::stoll(id));
+			}
+		}
+		send_limiter_ = ::std::make_unique<RateLimiter>(conf->getDouble("broadcast.rate", 25));
+		// Sharded workers share the database and so the broadcasts in it;
+		// only one of them should send.
+		if (conf->getBool("broadcast.enabled", role_ == Role::STANDALONE)) {
+			auto broadcast = Broadcaster::Options{};
+			broadcast.max_in_flight = conf->getUInt("broadcast.max_in_flight", broadcast.max_in_flight);
+			broadcast.checkpoint_size =
+				conf->getUInt("broadcast.checkpoint_size", broadcast.checkpoint_size);
+			broadcast.max_attempts = conf->getInt("broadcast.max_attempts", broadcast.max_attempts);
+			broadcast.poll_interval = ::std::chrono::seconds{
+				conf->getInt("broadcast.poll_interval", broadcast.poll_interval.count())};
+			broadcaster_ = ::std::make_unique<Broadcaster>(
+				*storage_,
+				*send_limiter_,
+				[this](Broadcaster::UserId user_id, ::std::string const& text) {
+					auto req_jo = p_json::Object::Ptr{new p_json::Object};
+					req_jo->set("chat_id", user_id);
+					req_jo->set("text", text);
+					return Send("sendMessage", req_jo, api_timeout_);
+				},
+				[this](auto& res_ft) { return CheckBroadcast(res_ft); },
+				broadcast,
+				metrics_);
+		}
+
+		auto scheduler = Scheduler::Options{};
+		scheduler.tick = ::std::chrono::milliseconds{conf->getInt("scheduler.tick", scheduler.tick.count())};
+		scheduler.workers = conf->getUInt("scheduler.workers", scheduler.workers);
+		scheduler_ = ::std::make_unique<Scheduler>(scheduler, metrics_);
+		scheduler_->Every(::std::chrono::seconds{1}, [this]() {
+			try {
+				storage_->Maintain();
+			} catch (::std::exception const& e) {
+				Logger::Error("storage", "maintenance failed")("error", e.what());
+			}
+		});
+		auto purge_batch = conf->getUInt("invites.purge_batch", 1000);
+		scheduler_->Every(::std::chrono::seconds{conf->getInt("invites.purge_interval", 300)},
+			[this, purge_batch]() { PurgeInvites(purge_batch); });
+		// like broadcasts, reminders live in the shared database
+		send_reminders_ = conf->getBool("reminders.enabled", role_ == Role::STANDALONE);
+		if (send_reminders_) {
+			reminder_offset_ = ::std::chrono::minutes{conf->getInt("reminders.utc_offset", 0)};
+			scheduler_->After({}, [this]() { ReloadReminders(); });
+			scheduler_->Every(::std::chrono::seconds{conf->getInt("reminders.reload_interval", 60)},
+				[this]() { ReloadReminders(); });
+		}
+	}
 }
 catch (p::Exception const& e) {
 	error = Error{true};
-	::std::cerr << e.displayText() << ::std::endl;
+	Logger::Error("bot", "init failed")("error", e.displayText());
 }
 catch (::std::exception const& e) {
 	error = Error{true};
-	::std::cerr << e.what() << ::std::endl;
+	Logger::Error("bot", "init failed")("error", e.what());
 }
 catch (...) {
 	error = Error{true};
-	::std::cerr << "unknown non-stantard exception" << ::std::endl;
+	Logger::Error("bot", "init failed")("error", "unknown non-standard exception");
+}
+
+// Runs on the journal thread. The shared cache is refreshed from the
+// database only after the batch is in.
+void TelegramBot::UpdateDataBase(::std::vector<AttendanceJournal::Entry> const& batch)
+{
+	storage_->ApplyAttendances(batch);
+	if (!attendance_cache_) {
+		return;
+	}
+	auto months = ::std::set<int>{};
+	for (auto const& entry : batch) {
+		months.insert(AttendanceCache::MonthOf(entry.day));
+	}
+	for (auto month : months) {
+		attendance_cache_->Update(month, [&]() {
+			return storage_->CountAttendances(
+				AttendanceCache::FirstDay(month), AttendanceCache::LastDay(month));
+		});
+	}
+}
+
+// VIEW mode reads only a count per day; EDIT mode needs to know who
+// attends to show the user's own marks.
+void TelegramBot::ReadDataBase(Date const& first_date, Date const& last_date, Keyboard::Mode mode)
+{
+	auto span = Tracer::Span{"ReadDataBase"};
+	window_first_ = first_date.DayNumber();
+	window_last_ = last_date.DayNumber();
+	window_mode_ = mode;
+	window_read_ = ::std::chrono::steady_clock::now();
+	// stamped before reading, so a change that lands meanwhile shows up
+	// as a newer stamp on the next check
+	if (attendance_cache_) {
+		window_versions_ = attendance_cache_->ReadVersions(
+			AttendanceCache::MonthOf(window_first_), AttendanceCache::MonthOf(window_last_));
+	}
+	// Changes saved but not yet committed to the storage, taken first: the
+	// journal may commit some of them while the storage is read, and then
+	// they would be in neither read. Applying a committed one again is
+	// harmless.
+	auto pending = PendingChanges(window_first_, window_last_);
+	date_cache_.clear();
+	if (mode == Keyboard::Mode::EDIT) {
+		for (auto const& [day, user_id] : storage_->ReadAttendances(window_first_, window_last_)) {
+			date_cache_[Date::FromDayNumber(day)].users.insert(user_id);
+		}
+		for (auto& [date, da] : date_cache_) {
+			da.loaded = true;
+			da.count = da.users.size();
+		}
+		metrics_.Add("attendance.member_reads");
+	} else {
+		for (auto const& [day, count] : CountAttendances(window_first_, window_last_)) {
+			date_cache_[Date::FromDayNumber(day)].count = count;
+		}
+		metrics_.Add("attendance.count_reads");
+	}
+
+	// A count alone can't take the pending changes, so such days are read
+	// in full.
+	for (auto const& entry : pending) {
+		auto& da = WindowDay(Date::FromDayNumber(entry.day));
+		if (entry.remove) {
+			da.users.erase(entry.user_id);
+		} else {
+			da.users.insert(entry.user_id);
+		}
+		da.count = da.users.size();
+	}
 }
 
-bool TelegramBot::PopInvite(::std::string const& invite_token, ChatId& user_id) const
+// The window is shared by everyone, so it may hold another keyboard's days.
+bool TelegramBot::WindowCovers(Keyboard const& kb) const
 {
-	p_data::Statement select(*db_session_);
-	select << "SELECT * FROM Invites WHERE Invite=?",
-		p_kw::bind(invite_token),
-		p_kw::now;
-	p_data::RecordSet rs(select);
-	if (!rs.extractedRowCount()) {
+	auto covers = window_first_ == kb.FirstDate().DayNumber() &&
+		window_last_ == kb.LastDate().DayNumber() &&
+		(kb.GetMode() == Keyboard::Mode::VIEW || window_mode_ == Keyboard::Mode::EDIT);
+	if (!covers) {
 		return false;
 	}
-	*db_session_ << "DELETE FROM Invites WHERE Invite=?",
-		p_kw::bind(invite_token),
-		p_kw::now;
-	rs.row(0).get(1).convert(user_id);
-	return true;
+	// matching stamps prove it current; without them it ages out
+	if (window_versions_) {
+		auto versions = attendance_cache_->ReadVersions(
+			AttendanceCache::MonthOf(window_first_), AttendanceCache::MonthOf(window_last_));
+		if (versions) {
+			return *versions == *window_versions_;
+		}
+	}
+	return !window_ttl_.count() || ::std::chrono::steady_clock::now() - window_read_ < window_ttl_;
 }
 
-void TelegramBot::PushInvite(::std::string const& invite_token, ChatId user_id) const
+// Returns a day of the window with its attendees loaded.
+TelegramBot::DayAttendance& TelegramBot::WindowDay(Date const& date)
 {
-	*db_session_ << "INSERT INTO Invites VALUES(?, ?)",
-		p_kw::bind(invite_token),
-		p_kw::bind(user_id),
-		p_kw::now;
+	auto [idate, inserted] = date_cache_.try_emplace(date);
+	auto& da = idate->second;
+	if (inserted) {
+		da.loaded = true; // nobody attends
+	} else if (!da.loaded) {
+		da.users = ReadMembers(date.DayNumber());
+		da.loaded = true;
+		da.count = da.users.size();
+	}
+	return da;
 }
 
-void TelegramBot::RegisterUser(ChatId user_id) const
+::std::unordered_set<TelegramBot::ChatId> TelegramBot::ReadMembers(int day)
 {
-	*db_session_ << "INSERT INTO RegisteredUsers VALUES(?) ON DUPLICATE KEY UPDATE UserId=UserId",
-		p_kw::bind(user_id),
-		p_kw::now;
+	// pending first, as in ReadDataBase
+	auto pending = PendingChanges(day, day);
+	auto users = ::std::unordered_set<ChatId>{};
+	for (auto const& attendance : storage_->ReadAttendances(day, day)) {
+		users.insert(attendance.second);
+	}
+	for (auto const& entry : pending) {
+		if (entry.remove) {
+			users.erase(entry.user_id);
+		} else {
+			users.insert(entry.user_id);
+		}
+	}
+	metrics_.Add("attendance.day_reads");
+	return users;
 }
 
-void TelegramBot::UpdateDataBase()
+// Whole months come from the shared cache when there is one; a month
+// it misses is counted by the database and left there for the others.
+::std::vector<::std::pair<int, ::std::size_t>> TelegramBot::CountAttendances(int first_day, int last_day)
 {
-	for (auto& [date, users] : date_cache_) {
-		auto db_date = date.To<p_data::Date>();
-		for (auto iuser = users.begin(); iuser != users.end();) {
-			auto& [user_id, remove] = *iuser;
-			if (remove) {
-				*db_session_ << "DELETE FROM Attendances WHERE Date=? AND UserId=?",
-					p_kw::bind(db_date),
-					p_kw::bind(user_id),
-					p_kw::now;
-				iuser = users.erase(iuser);
-			} else {
-				*db_session_ << "INSERT INTO Attendances VALUES(?, ?) ON DUPLICATE KEY UPDATE Date=Date",
-					p_kw::bind(db_date),
-					p_kw::bind(user_id),
-					p_kw::now;
-				++iuser;
+	if (!attendance_cache_) {
+		return storage_->CountAttendances(first_day, last_day);
+	}
+	auto first_month = AttendanceCache::MonthOf(first_day);
+	auto months = attendance_cache_->ReadCounts(first_month, AttendanceCache::MonthOf(last_day));
+	auto counts = ::std::vector<::std::pair<int, ::std::size_t>>{};
+	for (::std::size_t i = 0; i < months.size(); ++i) {
+		auto month = first_month + static_cast<int>(i);
+		if (!months[i]) {
+			months[i] = storage_->CountAttendances(
+				AttendanceCache::FirstDay(month), AttendanceCache::LastDay(month));
+			attendance_cache_->AddCounts(month, *months[i]);
+		}
+		for (auto const& [day, count] : *months[i]) {
+			if (first_day <= day && day <= last_day) {
+				counts.emplace_back(day, count);
 			}
 		}
 	}
+	return counts;
 }
 
-void TelegramBot::ReadDataBase(Date const& first_date, Date const& last_date)
+::std::vector<AttendanceJournal::Entry> TelegramBot::PendingChanges(int first_day, int last_day) const
 {
-	auto db_first = first_date.To<p_data::Date>();
-	auto db_last = last_date.To<p_data::Date>();
-	p_data::Statement select(*db_session_);
-	select << "SELECT * FROM Attendances WHERE ?<=Date AND Date<=?",
-		p_kw::bind(db_first),
-		p_kw::bind(db_last),
-		p_kw::now;
-	p_data::RecordSet rs(select);
-	date_cache_.clear();
-	for (auto& row : rs) {
-		auto db_date = row.get(0).extract<p_data::Date>();
-		auto date = Date::From(db_date);
-		ChatId user_id {};
-		row.get(1).convert(user_id);
-		date_cache_[date].insert({user_id, false});
-	}
+	auto entries = ::std::vector<AttendanceJournal::Entry>{};
+	journal_->ForEachPending([&](AttendanceJournal::Entry const& entry) {
+		if (first_day <= entry.day && entry.day <= last_day) {
+			entries.push_back(entry);
+		}
+	});
+	return entries;
 }
 
 void TelegramBot::StoreSelection(ChatId user_id)
 {
-	auto& ud = user_data_[user_id];
-	for (auto const& [date, flag] : ud.selection) {
-		date_cache_[date][user_id] = flag;
+	auto ud = user_data_.Find(user_id);
+	if (!ud) {
+		return;
 	}
-	ud.selection.clear();
+	// Apply to the in-memory window right away and journal only real
+	// changes; the database catches up in the background. Days outside
+	// the window are journaled as they are.
+	auto entries = ::std::vector<AttendanceJournal::Entry>{};
+	ud->selection.ForEach([&](int day, bool remove) {
+		if (InWindow(day)) {
+			auto& da = WindowDay(Date::FromDayNumber(day));
+			auto changed = remove ? da.users.erase(user_id) != 0 : da.users.insert(user_id).second;
+			da.count = da.users.size();
+			if (!changed) {
+				return;
+			}
+		}
+		entries.push_back({user_id, day, remove});
+	});
+	user_data_.Erase(user_id);
+	journal_->Append(entries);
 }
 
 void TelegramBot::LoadSelection(ChatId user_id, Date const& first, Date const& last)
 {
-	auto& ud = user_data_[user_id];
+	auto& ud = user_data_.Get(user_id);
 	auto it = date_cache_.lower_bound(first);
 	auto iend = date_cache_.upper_bound(last);
 	for (; it != iend; ++it) {
-		auto const& [date, users] = *it;
-		auto iuser = users.find(user_id);
-		if (iuser != users.end()) {
-			ud.selection.insert({date, iuser->second});
+		auto const& date = it->first;
+		if (WindowDay(date).users.count(user_id)) {
+			auto day = date.DayNumber();
+			if (ud.selection.Get(day) == Selection::Mark::NONE) {
+				ud.selection.Set(day, Selection::Mark::ADD);
+			}
 		}
 	}
+	user_data_.Recharge(user_id);
 }
 
 void TelegramBot::DiscardSelection(ChatId user_id)
 {
-	auto& ud = user_data_[user_id];
-	ud.selection.clear();
+	user_data_.Erase(user_id);
 }
 
-auto TelegramBot::RecacheUser(ChatId user_id) -> decltype(user_cache_)::iterator
+TelegramBot::User const& TelegramBot::RecacheUser(ChatId user_id)
 {
 	User user{};
 	try {
 		auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
 		req_jo->set("chat_id", user_id);
 		auto res_dv = SendMessage("getChat", req_jo);
-		auto res_jo = res_dv.extract<p_json::Object::Ptr>();
-		if (auto dv = res_jo->get("first_name"); !dv.isEmpty()) {
-			user.first_name = dv.extract<::std::string>();
-		}
-		if (auto dv = res_jo->get("last_name"); !dv.isEmpty()) {
-			user.last_name = dv.extract<::std::string>();
+		user = ParseChat(user_id, res_dv);
+	} catch (::std::runtime_error const & e) {
+		Logger::Error("bot", "recache user failed")("user_id", user_id)("error", e.what());
+	}
+	user.user_id = user_id;
+	return user_cache_.Put(user_id, ::std::move(user));
+}
+
+// Issues the getChat lookups for all uncached users at once, so they
+// share the round trip time instead of paying it one after another.
+void TelegramBot::PrefetchUsers(::std::vector<ChatId> const& user_ids)
+{
+	auto pending = ::std::vector<::std::pair<ChatId, ::std::future<HttpLoop::Response>>>{};
+	for (auto user_id : user_ids) {
+		if (user_cache_.Find(user_id)) {
+			continue;
 		}
-		if (auto dv = res_jo->get("username"); !dv.isEmpty()) {
-			user.username = dv.extract<::std::string>();
+		auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
+		req_jo->set("chat_id", user_id);
+		pending.emplace_back(user_id, Send("getChat", req_jo, api_timeout_));
+	}
+	for (auto& [user_id, res_ft] : pending) {
+		auto user = User{};
+		try {
+			user = ParseChat(user_id, Unwrap(Receive(res_ft)));
+		} catch (::std::runtime_error const & e) {
+			Logger::Error("bot", "prefetch user failed")("user_id", user_id)("error", e.what());
 		}
-	} catch (::std::runtime_error const & e) {
-		::std::cerr << "error: recache user: " << e.what() << ::std::endl;
+		user.user_id = user_id;
+		user_cache_.Put(user_id, ::std::move(user));
 	}
+}
+
+TelegramBot::User TelegramBot::ParseChat(ChatId user_id, p_dyn::Var const& chat_dv)
+{
+	User user{};
 	user.user_id = user_id;
-	return user_cache_.insert_or_assign(user_id, ::std::move(user)).first;
+	auto chat_jo = chat_dv.extract<p_json::Object::Ptr>();
+	if (auto dv = chat_jo->get("first_name"); !dv.isEmpty()) {
+		user.first_name = dv.extract<::std::string>();
+	}
+	if (auto dv = chat_jo->get("last_name"); !dv.isEmpty()) {
+		user.last_name = dv.extract<::std::string>();
+	}
+	if (auto dv = chat_jo->get("username"); !dv.isEmpty()) {
+		user.username = dv.extract<::std::string>();
+	}
+	return user;
 }
 
-TelegramBot::User const& TelegramBot::GetUserCaching(ChatId user_id)
+TelegramBot::User TelegramBot::GetUserCaching(ChatId user_id)
 {
-	auto iuser = user_cache_.find(user_id);
-	if (iuser == user_cache_.end()) {
-		iuser = RecacheUser(user_id);
+	if (auto user = user_cache_.Find(user_id)) {
+		return *user;
 	}
-	return iuser->second;
+	return RecacheUser(user_id);
 }
 
-void TelegramBot::ProcessCallbackQuery(p_dyn::Var const& cq)
+::std::size_t TelegramBot::UserCost(User const& user)
 {
-	auto cq_jo = cq.extract<p_json::Object::Ptr>();
-	auto cq_id = cq_jo->getValue<CallbackQueryId>("id");
-	auto from_jo = cq_jo->getObject("from");
-	auto user_id = from_jo->getValue<ChatId>("id");
-	auto first_name = from_jo->getValue<::std::string>("first_name");
-	auto msg_jo = cq_jo->getObject("message");
-	auto msg_id = msg_jo->getValue<MessageId>("message_id");
+	auto cost = ::std::size_t{};
+	for (auto const* s : {&user.first_name, &user.last_name, &user.username}) {
+		if (s->capacity() > ::std::string{}.capacity()) {
+			cost += s->capacity() + 1;
+		}
+	}
+	return cost;
+}
 
-	//auto username = from->getValue<::std::string>("username");
-	//auto last_name = from->getValue<::std::string>("last_name");
+::std::size_t TelegramBot::UserDataCost(UserData const& ud)
+{
+	return ud.selection.chunks.capacity() * sizeof(Selection::Chunk);
+}
 
-	auto& ud = user_data_[user_id];
+void TelegramBot::AnswerCallbackQuery(CallbackQueryId const& cq_id, ::std::string const& text,
+		bool alert)
+{
+	auto req_jo = p_json::Object::Ptr{new p_json::Object};
+	req_jo->set("callback_query_id", cq_id);
+	req_jo->set("cache_time", 0);
+	if (!text.empty()) {
+		req_jo->set("text", text);
+	}
+	if (alert) {
+		req_jo->set("show_alert", true);
+	}
+	SendMessage("answerCallbackQuery", req_jo);
+}
 
-	CallbackData data {};
-	auto data_str = cq_jo->getValue<::std::string>("data");
-	if (!data.Parse(data_str)) {
-		auto req_jo = p_json::Object::Ptr{new p_json::Object};
-		req_jo->set("callback_query_id", cq_id);
-		req_jo->set("cache_time", 0);
-		req_jo->set("text", "Некорректные или устаревшие данные.");
-		SendMessage("answerCallbackQuery", req_jo);
-		return;
+::std::string TelegramBot::DescribeDay(Date const& date)
+{
+	auto day = date.DayNumber();
+	auto users = InWindow(day) ? WindowDay(date).users : ReadMembers(day);
+	if (users.empty()) {
+		return "Присутствий нет.";
+	}
+	auto text = ::std::string("В этот день будут:\n\n");
+	for (auto user_id : users) {
+		text.append(DisplayName(GetUserCaching(user_id)));
+		text.append("\n");
 	}
+	return text;
+}
 
-	if (data.kb.GetMode() == Keyboard::Mode::VIEW && data.key.type == Key::Type::DAY) {
-		auto req_jo = p_json::Object::Ptr{new p_json::Object};
-		req_jo->set("callback_query_id", cq_id);
-		req_jo->set("cache_time", 0);
-		req_jo->set("show_alert", true);
+::std::string TelegramBot::DisplayName(User const& user)
+{
+	auto user_str = ::std::string{};
+	if (user.first_name.size()) {
+		user_str.append(user.first_name);
+	}
+	if (user.last_name.size()) {
+		if (user_str.size()) {
+			user_str.append(" ");
+		}
+		user_str.append(user.last_name);
+	}
+	if (!user_str.size()) {
+		user_str.append("id");
+		user_str.append(::std::to_string(user.user_id));
+	}
+	return user_str;
+}
 
-		::std::size_t n_users = 0;
-		if (auto idate = date_cache_.find(data.key.data.date); idate != date_cache_.end()) {
-			for (auto const& [user_id, remove] : idate->second) {
-				if (!remove) {
-					++n_users;
-				}
+// Takes the callback queries of one message from one batch, in order. A
+// burst of taps arrives here together: every query gets its answer, but
+// the keys are applied one after another to a single keyboard state, the
+// attendance window is read only when a key needs it or at the end, and
+// only the final keyboard is rendered.
+void TelegramBot::ProcessCallbackQueries(::std::pmr::vector<p_dyn::Var> const& cqs)
+{
+	auto kb = ::std::optional<Keyboard>{};
+	auto user_id = ChatId{};
+	auto msg_id = MessageId{};
+	auto stale = false;
+	auto render = false;
+	auto closed = false;
+	auto reload = [&]() {
+		ReadDataBase(kb->FirstDate(), kb->LastDate(), kb->GetMode());
+		if (kb->GetMode() == Keyboard::Mode::EDIT) {
+			LoadSelection(user_id, kb->FirstDate(), kb->LastDate());
+		}
+		stale = false;
+	};
+
+	for (auto const& cq : cqs) {
+		auto cq_jo = cq.extract<p_json::Object::Ptr>();
+		auto cq_id = cq_jo->getValue<CallbackQueryId>("id");
+		auto from_jo = cq_jo->getObject("from");
+		user_id = from_jo->getValue<ChatId>("id");
+		auto msg_jo = cq_jo->getObject("message");
+		msg_id = msg_jo->getValue<MessageId>("message_id");
+
+		//auto username = from->getValue<::std::string>("username");
+		//auto last_name = from->getValue<::std::string>("last_name");
+
+		CallbackData data {};
+		auto data_str = cq_jo->getValue<::std::string>("data");
+		auto parsed = false;
+		{
+			auto span = Tracer::Span{"CallbackData::Parse"};
+			parsed = data.Parse(data_str);
+		}
+		if (!parsed) {
+			Logger::Warning("bot", "invalid callback data")("value", data_str);
+			AnswerCallbackQuery(cq_id, "Некорректные или устаревшие данные.");
+			continue;
+		}
+		if (!kb) {
+			kb = data.kb;
+			stale = !WindowCovers(*kb);
+			// The EDIT session expired or was evicted while the keyboard
+			// stayed open; restart it from the stored attendances.
+			if (kb->GetMode() == Keyboard::Mode::EDIT && !user_data_.Find(user_id) &&
+					data.key.type != Key::Type::CANCEL && data.key.type != Key::Type::SAVE) {
+				reload();
 			}
 		}
-		if (!n_users) {
-			req_jo->set("text", "Присутствий нет.");
-		} else {
-			auto text = ::std::string("В этот день будут:\n\n");
-			auto idate = date_cache_.find(data.key.data.date);
-			for (auto const& [user_id, flag] : idate->second) {
-				if (flag) {
-					continue;
-				}
-				auto user = GetUserCaching(user_id);
-				auto user_str = ::std::string{};
-				if (user.first_name.size()) {
-					user_str.append(user.first_name);
-				}
-				if (user.last_name.size()) {
-					if (user_str.size()) {
-						user_str.append(" ");
-					}
-					user_str.append(user.last_name);
-				}
-				if (!user_str.size()) {
-					user_str.append("id");
-					user_str.append(::std::to_string(user_id));
-				}
-				text.append(user_str);
-				text.append("\n");
+
+		if (kb->GetMode() == Keyboard::Mode::VIEW && data.key.type == Key::Type::DAY) {
+			AnswerCallbackQuery(cq_id, DescribeDay(data.key.data.date), true);
+			continue;
+		}
+
+		AnswerCallbackQuery(cq_id);
+		if (closed) {
+			continue;
+		}
+
+		if (data.key.type == Key::Type::CLOSE) {
+			auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
+			auto mk_jo = p_json::Object::Ptr{new Poco::JSON::Object};
+			req_jo->set("chat_id", user_id);
+			req_jo->set("message_id", msg_id);
+			req_jo->set("text", "Каледнарь присутствий обновлен.");
+			//jreq->set("text", "Каледнарь присутствий оставлен без изменений.");
+			//jreq->set("text", "В каледнарь присутствий добавлены дни:\n\n Отменены дни:\n\n");
+			req_jo->set("reply_markup", mk_jo); // sic! empty markup
+			SendMessage("editMessageText", req_jo);
+			render_cache_.Erase({user_id, msg_id});
+			closed = true;
+			continue;
+		}
+
+		render = true;
+		switch (data.key.type) {
+		case Key::Type::PREV_M:
+			kb->MoveMonth(-1);
+			stale = true;
+			break;
+		case Key::Type::PREV_W:
+			kb->MoveWeek(-1);
+			stale = true;
+			break;
+		case Key::Type::NEXT_W:
+			kb->MoveWeek(+1);
+			stale = true;
+			break;
+		case Key::Type::NEXT_M:
+			kb->MoveMonth(+1);
+			stale = true;
+			break;
+		case Key::Type::TODAY:
+			kb->SetCenter(Date::From(Today()));
+			stale = true;
+			break;
+		case Key::Type::EDIT:
+			kb->SetMode(Keyboard::Mode::EDIT);
+			reload();
+			break;
+		case Key::Type::CANCEL:
+			kb->SetMode(Keyboard::Mode::VIEW);
+			DiscardSelection(user_id);
+			break;
+		case Key::Type::SAVE:
+			kb->SetMode(Keyboard::Mode::VIEW);
+			StoreSelection(user_id);
+			break;
+		case Key::Type::DAY:
+			// Only a day shown on the keyboard the tap came from can be
+			// toggled; callback data is the client's to make up.
+			if (data.key.data.date < data.kb.FirstDate() || data.kb.LastDate() < data.key.data.date) {
+				metrics_.Add("callbacks.rejected");
+				Logger::Warning("bot", "day off the keyboard")("user", user_id)("value", data_str);
+				break;
+			}
+			if (stale) {
+				reload();
+			}
+			if (!user_data_.Get(user_id).selection.Toggle(data.key.data.date.DayNumber())) {
+				metrics_.Add("callbacks.rejected");
+				Logger::Warning("bot", "selection too wide")("user", user_id)("value", data_str);
 			}
-			req_jo->set("text", text);
+			user_data_.Recharge(user_id);
+			break;
+		case Key::Type::MONTH:
+		case Key::Type::EMPTY:
+		case Key::Type::CLOSE:
+			break;
 		}
-		SendMessage("answerCallbackQuery", req_jo);
-		return;
 	}
 
-	{
-		auto req_jo = p_json::Object::Ptr{new p_json::Object};
-		req_jo->set("callback_query_id", cq_id);
-		req_jo->set("cache_time", 0);
-		SendMessage("answerCallbackQuery", req_jo);
+	if (!render || closed) {
+		return;
 	}
+	if (stale) {
+		reload();
+	}
+	EditKeyboard(user_id, msg_id, GenerateKeyboard(*kb, user_id));
+}
 
-	if (data.key.type == Key::Type::CLOSE) {
-		auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
-		auto mk_jo = p_json::Object::Ptr{new Poco::JSON::Object};
-		req_jo->set("chat_id", user_id);
-		req_jo->set("message_id", msg_id);
-		req_jo->set("text", "Каледнарь присутствий обновлен.");
-		//jreq->set("text", "Каледнарь присутствий оставлен без изменений.");
-		//jreq->set("text", "В каледнарь присутствий добавлены дни:\n\n Отменены дни:\n\n");
-		req_jo->set("reply_markup", mk_jo); // sic! empty markup
-		SendMessage("editMessageText", req_jo);
+// Many presses (MONTH, EMPTY, the weekday labels) render exactly what the
+// message already shows; those edits are skipped.
+void TelegramBot::EditKeyboard(ChatId chat_id, MessageId msg_id, p_dyn::Var const& kb_dv)
+{
+	auto span = Tracer::Span{"EditKeyboard"};
+	auto key = MessageKey{chat_id, msg_id};
+	auto hash = KeyboardHash(kb_dv);
+	if (auto shown = render_cache_.Find(key); shown && *shown == hash) {
+		metrics_.Add("render.skipped");
 		return;
 	}
-
-	switch (data.key.type) {
-	case Key::Type::PREV_M:
-		data.kb.MoveMonth(-1);
-		ReadDataBase(data.kb.FirstDate(), data.kb.LastDate());
-		if (data.kb.GetMode() == Keyboard::Mode::EDIT) {
-			LoadSelection(user_id, data.kb.FirstDate(), data.kb.LastDate());
-		}
-		break;
-	case Key::Type::PREV_W:
-		data.kb.MoveWeek(-1);
-		ReadDataBase(data.kb.FirstDate(), data.kb.LastDate());
-		if (data.kb.GetMode() == Keyboard::Mode::EDIT) {
-			LoadSelection(user_id, data.kb.FirstDate(), data.kb.LastDate());
-		}
-		break;
-	case Key::Type::NEXT_W:
-		data.kb.MoveWeek(+1);
-		ReadDataBase(data.kb.FirstDate(), data.kb.LastDate());
-		if (data.kb.GetMode() == Keyboard::Mode::EDIT) {
-			LoadSelection(user_id, data.kb.FirstDate(), data.kb.LastDate());
-		}
-		break;
-	case Key::Type::NEXT_M:
-		data.kb.MoveMonth(+1);
-		ReadDataBase(data.kb.FirstDate(), data.kb.LastDate());
-		if (data.kb.GetMode() == Keyboard::Mode::EDIT) {
-			LoadSelection(user_id, data.kb.FirstDate(), data.kb.LastDate());
-		}
-		break;
-	case Key::Type::TODAY:
-		data.kb.SetCenter(Date::From(Today()));
-		ReadDataBase(data.kb.FirstDate(), data.kb.LastDate());
-		if (data.kb.GetMode() == Keyboard::Mode::EDIT) {
-			LoadSelection(user_id, data.kb.FirstDate(), data.kb.LastDate());
-		}
-		break;
-	case Key::Type::EDIT:
-		data.kb.SetMode(Keyboard::Mode::EDIT);
-		LoadSelection(user_id, data.kb.FirstDate(), data.kb.LastDate());
-		break;
-	case Key::Type::CANCEL:
-		data.kb.SetMode(Keyboard::Mode::VIEW);
-		DiscardSelection(user_id);
-		break;
-	case Key::Type::SAVE:
-		data.kb.SetMode(Keyboard::Mode::VIEW);
-		StoreSelection(user_id);
-		UpdateDataBase();
-		break;
-	case Key::Type::DAY:
-		if (data.kb.GetMode() == Keyboard::Mode::EDIT) {
-			auto const& date = data.key.data.date;
-			auto idate = ud.selection.find(date);
-			if (idate != ud.selection.end()) {
-				idate->second = !idate->second;
-			} else {
-				ud.selection.insert({date, false});
-			}
+	auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
+	req_jo->set("chat_id", chat_id);
+	req_jo->set("message_id", msg_id);
+	auto mk_jo = p_json::Object::Ptr{new Poco::JSON::Object};
+	mk_jo->set("inline_keyboard", kb_dv);
+	req_jo->set("reply_markup", mk_jo);
+	try {
+		SendMessage("editMessageReplyMarkup", req_jo);
+		metrics_.Add("render.edited");
+	} catch (ApiError const& e) {
+		// the message predates the cache entry or the entry was evicted
+		if (::std::string_view{e.what()}.find("message is not modified") == ::std::string_view::npos) {
+			throw;
 		}
-		break;
-	case Key::Type::MONTH:
-	case Key::Type::EMPTY:
-	case Key::Type::CLOSE:
-		break;
+		metrics_.Add("render.not_modified");
 	}
+	render_cache_.Put(key, hash);
+}
 
-	{
-		auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
-		req_jo->set("chat_id", user_id);
-		req_jo->set("message_id", msg_id);
-		auto kb_dv = GenerateKeyboard(data.kb, user_id);
-		auto mk_jo = p_json::Object::Ptr{new Poco::JSON::Object};
-		mk_jo->set("inline_keyboard", kb_dv);
-		req_jo->set("reply_markup", mk_jo);
-		SendMessage("editMessageReplyMarkup", req_jo);
+::std::size_t TelegramBot::KeyboardHash(p_dyn::Var const& kb_dv)
+{
+	auto buf = HashStreamBuf{};
+	auto stm = ::std::ostream{&buf};
+	p_json::Stringifier::condense(kb_dv, stm);
+	return buf.Value();
+}
+
+// The chat an update belongs to, or 0 for updates outside any chat.
+TelegramBot::ChatId TelegramBot::UpdateChatId(p_json::Object::Ptr const& update)
+{
+	auto msg_jo = update->getObject("message");
+	if (auto cq_jo = update->getObject("callback_query")) {
+		if (auto cq_msg_jo = cq_jo->getObject("message")) {
+			msg_jo = cq_msg_jo;
+		} else if (auto from_jo = cq_jo->getObject("from")) {
+			return from_jo->getValue<ChatId>("id");
+		}
+	}
+	if (msg_jo) {
+		if (auto chat_jo = msg_jo->getObject("chat")) {
+			return chat_jo->getValue<ChatId>("id");
+		}
 	}
+	return 0;
 }
 
 void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 {
-#if 1
-	p_json::Stringifier::stringify(msg_dv, ::std::cout);
-	::std::cout << ::std::endl;
-#endif
+	if (Logger::Enabled(Logger::Level::DEBUG)) {
+		::std::ostringstream sstm{};
+		p_json::Stringifier::condense(msg_dv, sstm);
+		Logger::Debug("bot", "message")("json", sstm.str());
+	}
 
 	auto msg_jo = msg_dv.extract<p_json::Object::Ptr>();
 
@@ -407,7 +867,7 @@ void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 	auto chat_jo = msg_jo->getObject("chat");
 	auto chat_id = chat_jo->getValue<ChatId>("id");
 
-	auto registered_user = IsUserRegistered(user_id);
+	auto registered_user = storage_->IsUserRegistered(user_id);
 
 	//auto first_name = from->getValue<::std::string>("first_name");
 	//auto last_name = from->getValue<::std::string>("last_name");
@@ -428,7 +888,7 @@ void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 	}
 	auto text = text_dv.extract<::std::string>();
 
-	::std::regex const re{"/([A-Za-z0-9_-]+)(?: (.*))?"};
+	static ::std::regex const re{"/([A-Za-z0-9_-]+)(?: ([\\s\\S]*))?"};
 	::std::smatch match{};
 	if (!::std::regex_match(text, match, re)) {
 		if (registered_user) {
@@ -444,6 +904,10 @@ void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 	auto command = match[1].str();
 
 	if (command == "start") {
+		// a user who blocked the bot comes back through /start
+		if (registered_user && storage_->IsUserBlocked(user_id)) {
+			storage_->UnblockUser(user_id);
+		}
 		if (!match[2].length()) {
 			if (registered_user) {
 				auto req_jo = p_json::Object::Ptr{new p_json::Object};
@@ -453,9 +917,7 @@ void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 			}
 			return;
 		} else {
-			auto payload = match[2].str();
-			ChatId invited_by{};
-			if (!PopInvite(payload, invited_by)) {
+			if (!RedeemInvite(user_id, match[2].str())) {
 				if (registered_user) {
 					auto req_jo = p_json::Object::Ptr{new p_json::Object};
 					req_jo->set("chat_id", user_id);
@@ -464,7 +926,7 @@ void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 				}
 				return;
 			}
-			RegisterUser(user_id);
+			storage_->RegisterUser(user_id);
 			auto req_jo = p_json::Object::Ptr{new p_json::Object};
 			req_jo->set("chat_id", user_id);
 			req_jo->set("text", "Регистрация прошла успешно.");
@@ -481,7 +943,7 @@ void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 
 	if (command == "calendar") {
 		Keyboard kb {Date::From(Today())};
-		ReadDataBase(kb.FirstDate(), kb.LastDate());
+		ReadDataBase(kb.FirstDate(), kb.LastDate(), kb.GetMode());
 		auto kb_dv = GenerateKeyboard(kb, user_id);
 		auto mk_jo = p_json::Object::Ptr{new Poco::JSON::Object};
 		mk_jo->set("inline_keyboard", kb_dv);
@@ -489,21 +951,31 @@ void TelegramBot::ProcessMessage(p_dyn::Var const& msg_dv)
 		req_jo->set("chat_id", user_id); // sic user_id
 		req_jo->set("reply_markup", mk_jo);
 		req_jo->set("text", "Календарь присутствий");
-		SendMessage("sendMessage", req_jo);
+		auto msg_jo = SendMessage("sendMessage", req_jo).extract<p_json::Object::Ptr>();
+		render_cache_.Put({user_id, msg_jo->getValue<MessageId>("message_id")}, KeyboardHash(kb_dv));
 	} else if (command == "invite") {
 		auto invite_token = GenerateInviteToken();
-		PushInvite(invite_token, user_id);
+		storage_->PushInvite(invite_token, user_id, invite_ttl_);
 		auto invite_link = ::std::string{"https://t.me/HomeGozhevRuBot?start="};
 		invite_link.append(invite_token);
 		auto text = ::std::string{
 			"Передайте эту ссылку пользователю, которого хотите добавить:\n"};
 		text.append(invite_link);
+		auto hours = ::std::chrono::duration_cast<::std::chrono::hours>(invite_ttl_).count();
+		text.append("\nСсылка действует ").append(hours >= 48
+			? ::std::to_string(hours / 24) + " дн." : ::std::to_string(hours) + " ч.");
 		auto req_jo = p_json::Object::Ptr{new p_json::Object};
 		req_jo->set("chat_id", chat_id);
 		req_jo->set("text", text);
 		SendMessage("sendMessage", req_jo);
 	} else if (command == "users") {
 		HandleCommandUsers(chat_id);
+	} else if (command == "stats") {
+		HandleCommandStats(chat_id, match[2].str());
+	} else if (command == "broadcast") {
+		HandleCommandBroadcast(chat_id, match[2].str());
+	} else if (command == "remind") {
+		HandleCommandRemind(chat_id, match[2].str());
 	} else if (command == "sensor") {
 		HandleCommandSensor(chat_id);
 	} else if (command == "camera") {
@@ -531,7 +1003,7 @@ void TelegramBot::HandleCommandCamera(ChatId user_id) {
 	retval = ::memcached_server_push(memc, servers);
 
 	if (retval != MEMCACHED_SUCCESS) {
-		::std::cerr << "error: memcached: " << ::memcached_strerror(memc, retval) << ::std::endl;
+		Logger::Error("camera", "memcached failed")("error", ::memcached_strerror(memc, retval));
 		return;
 	}
 
@@ -539,7 +1011,7 @@ void TelegramBot::HandleCommandCamera(ChatId user_id) {
 		token.c_str(), token.size(), ::std::time_t{}, ::std::uint32_t{});
 
 	if (retval != MEMCACHED_SUCCESS) {
-		::std::cerr << "error: memcached: " << ::memcached_strerror(memc, retval) << ::std::endl;
+		Logger::Error("camera", "memcached failed")("error", ::memcached_strerror(memc, retval));
 	}
 
 	auto link = ::std::string{"https://home.gozhev.ru/psi/" + token + "/"};
@@ -554,20 +1026,24 @@ void TelegramBot::HandleCommandSensor(ChatId user_id) {
 	auto text = ::std::string{};
 	try {
 		static const p::URI uri("http://info.bvo.home.gozhev.ru");
-		auto path = uri.getPathAndQuery();
-		if (path.empty()) {
-			path = "/";
-		}
-		p_net::HTTPClientSession sess(uri.getHost(), uri.getPort());
-		p_net::HTTPRequest req(p_net::HTTPRequest::HTTP_GET, path, p_net::HTTPMessage::HTTP_1_1);
-		p_net::HTTPResponse res{};
-		sess.sendRequest(req);
-		auto& res_stm = sess.receiveResponse(res);
-		auto res_dv = p_json::Parser{}.parse(res_stm);
+		auto req = HttpLoop::Request{};
+		req.host = uri.getHost();
+		req.port = uri.getPort();
+		req.target = uri.getPathAndQuery();
+		if (req.target.empty()) {
+			req.target = "/";
+		}
+		req.timeout = api_timeout_;
+		req.idempotent = true;
+		auto res = http_loop_->Execute(::std::move(req));
+		auto res_dv = p_json::Parser{}.parse(res.body);
 		res_jo = res_dv.extract<p_json::Object::Ptr>();
 	}
 	catch (p::Exception const& e) {
-		::std::cerr << "error: handle sensor: " << e.displayText() << ::std::endl;
+		Logger::Error("sensor", "read failed")("error", e.displayText());
+	}
+	catch (HttpLoop::Error const& e) {
+		Logger::Error("sensor", "read failed")("error", e.what());
 	}
 	if (res_jo.isNull()) {
 		text = "Невозможно получить данные";
@@ -626,588 +1102,1252 @@ void TelegramBot::HandleCommandUsers(ChatId user_id) {
 	SendMessage("sendMessage", req_jo);
 }
 
-::std::vector<TelegramBot::User> TelegramBot::GetRegisteredUsers()
+namespace {
+
+// Pads or cuts a UTF-8 string to exactly width code points.
+::std::string FitUtf8(::std::string const& s, int width)
 {
-	auto select = p_data::Statement{*db_session_};
-	select << "SELECT UserId FROM RegisteredUsers",
-		p_kw::now;
-	auto rs = p_data::RecordSet{select};
-	auto users = ::std::vector<User>{};
-	for (auto & row : rs) {
-		ChatId user_id{};
-		row.get(0).convert(user_id);
-		users.push_back(GetUserCaching(user_id));
+	auto out = ::std::string{};
+	auto n = 0;
+	for (auto c : s) {
+		if ((c & 0xc0) != 0x80 && n++ == width) {
+			break;
+		}
+		out.push_back(c);
 	}
-	return users;
+	for (; n < width; ++n) {
+		out.push_back(' ');
+	}
+	return out;
 }
 
-bool TelegramBot::IsUserRegistered(ChatId user_id) const
+::std::string EscapeHtml(::std::string const& s)
 {
-	auto select = p_data::Statement{*db_session_};
-	select << "SELECT * FROM RegisteredUsers WHERE UserId=?",
-		p_kw::bind(user_id),
-		p_kw::now;
-	auto rs = p_data::RecordSet{select};
-	if (!rs.extractedRowCount()) {
-		return false;
+	auto out = ::std::string{};
+	for (auto c : s) {
+		switch (c) {
+		case '<': out.append("&lt;"); break;
+		case '>': out.append("&gt;"); break;
+		case '&': out.append("&amp;"); break;
+		default: out.push_back(c);
+		}
 	}
-	return true;
+	return out;
 }
 
-::std::string TelegramBot::GetListOfCommads() const
-{
-	::std::ostringstream sstm{};
-	sstm << "Доступные команды:\n"
-		<< "\n" << "/sensor - получить показания датчика"
-		<< "\n" << "/calendar - открыть календарь посещений"
-		<< "\n" << "/invite - пригласить нового пользователя"
-		<< "\n" << "/users - показать зарегистрированных пользователей"
-		<< "\n" << "/start - показать доступные команды"
-		<< "\n" << "/camera - открыть видео в браузере"
-		;
-	return sstm.str();
-}
+} // namespace
 
-::std::string TelegramBot::GenerateToken()
+// Months are counted as year * 12 + month - 1, the same way the rollups
+// store them. The whole report comes from one ReadStats() call.
+void TelegramBot::HandleCommandStats(ChatId user_id, ::std::string const& args)
 {
-	auto prng = p::Random{};
-	auto sstm = ::std::stringstream{};
-	auto estm = p::Base64Encoder{sstm,
-		p::Base64EncodingOptions::BASE64_URL_ENCODING |
-		p::Base64EncodingOptions::BASE64_NO_PADDING};
-	static constexpr int TOKEN_LENGTH = 32;
-	static constexpr int N_BYTES = TOKEN_LENGTH / 4 * 3;
-	for (int i = 0; i < N_BYTES; ++i) {
-		estm << prng.nextChar();
+	static constexpr int MAX_MONTHS = 12;
+	static constexpr int DEFAULT_MONTHS = 6;
+	static constexpr int NAME_WIDTH = 10;
+
+	auto today = Today();
+	auto last_month = (today.tm_year + 1900) * 12 + today.tm_mon;
+	auto first_month = last_month - DEFAULT_MONTHS + 1;
+	static ::std::regex const re{" *(\\d{4})[-.](\\d{1,2})(?: +(\\d{4})[-.](\\d{1,2}))? *"};
+	::std::smatch match{};
+	if (!args.empty()) {
+		if (!::std::regex_match(args, match, re)
+				|| ::std::stoi(match[2]) < 1 || ::std::stoi(match[2]) > 12
+				|| (match[3].matched && (::std::stoi(match[4]) < 1 || ::std::stoi(match[4]) > 12))) {
+			auto req_jo = p_json::Object::Ptr{new p_json::Object};
+			req_jo->set("chat_id", user_id);
+			req_jo->set("text", "Укажите месяцы в виде ГГГГ.ММ, например /stats 2024.01 2024.06");
+			SendMessage("sendMessage", req_jo);
+			return;
+		}
+		first_month = ::std::stoi(match[1]) * 12 + ::std::stoi(match[2]) - 1;
+		if (match[3].matched) {
+			last_month = ::std::stoi(match[3]) * 12 + ::std::stoi(match[4]) - 1;
+		}
+		if (last_month < first_month) {
+			::std::swap(first_month, last_month);
+		}
+		last_month = ::std::min(last_month, first_month + MAX_MONTHS - 1);
 	}
-	estm.close();
-	return sstm.str();
-}
+	auto n_months = last_month - first_month + 1;
 
-::std::string TelegramBot::GenerateInviteToken()
-{
-	return GenerateToken();
-}
+	auto stats = storage_->ReadStats(first_month, last_month);
 
-void TelegramBot::ProcessUpdate(p_json::Object::Ptr update)
-{
-	if (auto upid = update->getValue<::std::size_t>("update_id"); upid > last_update_id_) {
-		last_update_id_ = upid;
-	}
-	if (auto msg = update->get("message"); !msg.isEmpty()) {
-		ProcessMessage(msg);
+	auto rows = ::std::map<ChatId, ::std::vector<int>>{};
+	for (auto const& um : stats.users) {
+		auto& row = rows[um.user_id];
+		row.resize(n_months);
+		row[um.month - first_month] = um.days;
 	}
-	// TODO block unregistered users here
-	else if (auto cq = update->get("callback_query"); !cq.isEmpty()) {
-		ProcessCallbackQuery(cq);
+	auto order = ::std::vector<::std::pair<int, ChatId>>{};
+	auto user_ids = ::std::vector<ChatId>{};
+	for (auto const& [id, row] : rows) {
+		order.emplace_back(-::std::accumulate(row.begin(), row.end(), 0), id);
+		user_ids.push_back(id);
 	}
-	// TODO handle unknown update
-}
+	::std::sort(order.begin(), order.end());
+	PrefetchUsers(user_ids);
 
-void TelegramBot::HandleUpdates(Error& error) noexcept
-try {
-	auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
-	req_jo->set("offset", last_update_id_ + 1);
-	req_jo->set("timeout", 2);
-	auto res_dv = SendMessage("getUpdates", req_jo);
-	auto res_ja = res_dv.extract<p_json::Array::Ptr>();
-	for (::std::size_t i = 0; i < res_ja->size(); ++i) {
-		ProcessUpdate(res_ja->getObject(i));
-	}
-	OnUpdateSucceed(error);
+	::std::ostringstream sstm{};
+	auto month_name = [](int month) {
+		char buf[16]{};
+		::std::snprintf(buf, sizeof(buf), "%04d.%02d", month / 12, month % 12 + 1);
+		return ::std::string{buf};
+	};
+	sstm << "Статистика присутствий " << month_name(first_month);
+	if (n_months > 1) {
+		sstm << " – " << month_name(last_month);
+	}
+	sstm << "\n<pre>\n" << FitUtf8({}, NAME_WIDTH);
+	for (auto month = first_month; month <= last_month; ++month) {
+		sstm << ' ' << ::std::setw(2) << ::std::setfill('0') << month % 12 + 1;
+	}
+	sstm << ::std::setfill(' ') << "   Σ\n";
+	auto put_row = [&](::std::string const& name, ::std::vector<int> const& row, bool trend) {
+		sstm << EscapeHtml(FitUtf8(name, NAME_WIDTH));
+		for (auto days : row) {
+			sstm << ' ' << ::std::setw(2) << days;
+		}
+		sstm << ' ' << ::std::setw(3) << ::std::accumulate(row.begin(), row.end(), 0);
+		if (trend && n_months > 1) {
+			auto last = row[n_months - 1], prev = row[n_months - 2];
+			sstm << (last > prev ? " ↑" : last < prev ? " ↓" : " →");
+		}
+		sstm << '\n';
+	};
+	for (auto const& [neg_total, id] : order) {
+		auto user = GetUserCaching(id);
+		auto name = user.first_name;
+		if (!user.last_name.empty()) {
+			name.append(" ").append(user.last_name.substr(0, 1)).append(".");
+		}
+		if (name.empty()) {
+			name = "id" + ::std::to_string(id);
+		}
+		put_row(name, rows[id], true);
+	}
+	auto active = ::std::vector<int>(n_months);
+	auto busiest = ::std::vector<int>(n_months);
+	for (auto const& ms : stats.months) {
+		active[ms.month - first_month] = ms.active_days;
+		busiest[ms.month - first_month] = ms.busiest_day;
+	}
+	put_row("Дней", active, true);
+	sstm << FitUtf8("Пик дня", NAME_WIDTH);
+	for (auto users : busiest) {
+		sstm << ' ' << ::std::setw(2) << users;
+	}
+	sstm << "\n</pre>";
+
+	auto req_jo = p_json::Object::Ptr{new p_json::Object};
+	req_jo->set("chat_id", user_id);
+	req_jo->set("parse_mode", "HTML");
+	req_jo->set("text", rows.empty() && stats.months.empty()
+		? ::std::string{"Присутствий за этот период нет."} : sstm.str());
+	SendMessage("sendMessage", req_jo);
 }
-catch (p::Exception const& e) {
-	OnUpdateFailed(error);
-	::std::cerr << "poco exception: " << e.displayText() << ::std::endl;
+
+// /broadcast all|today|tomorrow text. The text is expanded once, when the
+// broadcast is created: {today} and {tomorrow} become who attends those
+// days, {today_count} and {tomorrow_count} how many. Users who blocked the
+// bot are left out.
+void TelegramBot::HandleCommandBroadcast(ChatId user_id, ::std::string const& args)
+{
+	static constexpr ::std::size_t MAX_TEXT = 4096; // code points, as Telegram counts
+
+	auto reply = [&](::std::string const& text) {
+		auto req_jo = p_json::Object::Ptr{new p_json::Object};
+		req_jo->set("chat_id", user_id);
+		req_jo->set("text", text);
+		SendMessage("sendMessage", req_jo);
+	};
+	if (!broadcast_admins_.count(user_id)) {
+		reply("Недостаточно прав.");
+		return;
+	}
+	if (!broadcaster_) {
+		reply("Рассылка отключена.");
+		return;
+	}
+	static ::std::regex const re{"(all|today|tomorrow) +([\\s\\S]+)"};
+	::std::smatch match{};
+	if (!::std::regex_match(args, match, re)) {
+		reply("Укажите получателей и текст, например /broadcast tomorrow Завтра будут: {tomorrow}");
+		return;
+	}
+	auto audience = match[1].str();
+	auto text = match[2].str();
+
+	auto today = Date::From(Today()).DayNumber();
+	auto members = ::std::array<::std::unordered_set<ChatId>, 2>{};
+	auto names = ::std::array<::std::string, 2>{};
+	static constexpr char const* NAMES[] = {"{today}", "{tomorrow}"};
+	static constexpr char const* COUNTS[] = {"{today_count}", "{tomorrow_count}"};
+	for (auto i = 0; i < 2; ++i) {
+		auto wanted = audience == (i ? "tomorrow" : "today")
+			|| text.find(NAMES[i]) != ::std::string::npos
+			|| text.find(COUNTS[i]) != ::std::string::npos;
+		if (!wanted) {
+			continue;
+		}
+		members[i] = ReadMembers(today + i);
+		if (text.find(NAMES[i]) == ::std::string::npos) {
+			continue;
+		}
+		PrefetchUsers({members[i].begin(), members[i].end()});
+		for (auto member : members[i]) {
+			names[i].append(names[i].empty() ? "" : ", ").append(DisplayName(GetUserCaching(member)));
+		}
+		if (names[i].empty()) {
+			names[i] = "никого";
+		}
+	}
+	auto replace_all = [&](::std::string const& from, ::std::string const& to) {
+		for (auto pos = text.find(from); pos != ::std::string::npos; pos = text.find(from, pos + to.size())) {
+			text.replace(pos, from.size(), to);
+		}
+	};
+	for (auto i = 0; i < 2; ++i) {
+		replace_all(COUNTS[i], ::std::to_string(members[i].size()));
+		replace_all(NAMES[i], names[i]);
+	}
+	auto length = ::std::count_if(text.begin(), text.end(), [](char c) { return (c & 0xc0) != 0x80; });
+	if (static_cast<::std::size_t>(length) > MAX_TEXT) {
+		reply("Текст длиннее " + ::std::to_string(MAX_TEXT) + " символов.");
+		return;
+	}
+
+	auto recipients = audience == "all" ? storage_->GetRegisteredUsers()
+		: ::std::vector<ChatId>(members[audience == "tomorrow"].begin(),
+			members[audience == "tomorrow"].end());
+	auto blocked = storage_->GetBlockedUsers();
+	::std::sort(blocked.begin(), blocked.end());
+	recipients.erase(::std::remove_if(recipients.begin(), recipients.end(), [&](ChatId id) {
+		return ::std::binary_search(blocked.begin(), blocked.end(), id);
+	}), recipients.end());
+	if (recipients.empty()) {
+		reply("Получателей нет.");
+		return;
+	}
+	auto id = storage_->CreateBroadcast(user_id, text, recipients);
+	broadcaster_->Wake();
+	metrics_.Add("broadcast.created");
+	Logger::Info("broadcast", "created")("id", id)("created_by", user_id)("recipients", recipients.size());
+	reply("Рассылка №" + ::std::to_string(id) + " поставлена в очередь, получателей: "
+		+ ::std::to_string(recipients.size()) + ".");
 }
-catch (::std::exception const& e) {
-	OnUpdateFailed(error);
-	::std::cerr << "std exception: " << e.what() << ::std::endl;
+
+// Runs on the broadcaster's thread.
+Broadcaster::Result TelegramBot::CheckBroadcast(::std::future<HttpLoop::Response>& res_ft)
+{
+	auto result = Broadcaster::Result{};
+	try {
+		Unwrap(Receive(res_ft));
+		result.delivery = Storage::Delivery::SENT;
+	} catch (ApiError const& e) {
+		if (e.error_code == 429) {
+			result.delivery = Storage::Delivery::PENDING;
+			result.retry_after = ::std::max(e.retry_after, ::std::chrono::seconds{1});
+		} else if (e.error_code == 403) {
+			// blocked by the user or deactivated
+			result.delivery = Storage::Delivery::BLOCKED;
+		} else if (e.error_code >= 500) {
+			result.delivery = Storage::Delivery::PENDING;
+		} else {
+			Logger::Warning("broadcast", "send failed")("error", e.what());
+			result.delivery = Storage::Delivery::FAILED;
+		}
+	} catch (::std::exception const& e) {
+		Logger::Warning("broadcast", "send failed")("error", e.what());
+		result.delivery = Storage::Delivery::PENDING;
+	}
+	return result;
 }
-catch (...) {
-	error = Error{true};
-	::std::cerr << "unknown non-stantard exception" << ::std::endl;
+
+// Tells whoever created a broadcast that it has been sent.
+void TelegramBot::ReportBroadcasts()
+{
+	for (auto const& report : broadcaster_->TakeReports()) {
+		::std::ostringstream sstm{};
+		sstm << "Рассылка №" << report.id << " завершена за "
+			<< ::std::chrono::duration_cast<::std::chrono::seconds>(report.elapsed).count() << " с."
+			<< "\nДоставлено: " << report.sent
+			<< "\nЗаблокировали бота: " << report.blocked
+			<< "\nОшибки: " << report.failed;
+		try {
+			auto req_jo = p_json::Object::Ptr{new p_json::Object};
+			req_jo->set("chat_id", report.created_by);
+			req_jo->set("text", sstm.str());
+			SendMessage("sendMessage", req_jo);
+		} catch (::std::exception const& e) {
+			Logger::Error("broadcast", "report failed")("id", report.id)("error", e.what());
+		}
+	}
 }
 
-void TelegramBot::OnUpdateSucceed(Error& error) noexcept {
-	(void) error;
-	error_seq_count_ = 0;
+// /remind HH:MM sets the user's daily reminder, /remind off removes it and
+// /remind alone tells the current one. Another process may be the one
+// sending reminders; it picks the change up at its next reload.
+void TelegramBot::HandleCommandRemind(ChatId user_id, ::std::string const& args)
+{
+	auto reply = [&](::std::string const& text) {
+		auto req_jo = p_json::Object::Ptr{new p_json::Object};
+		req_jo->set("chat_id", user_id);
+		req_jo->set("text", text);
+		SendMessage("sendMessage", req_jo);
+	};
+	auto format = [](int minute) {
+		char buf[8]{};
+		::std::snprintf(buf, sizeof(buf), "%02d:%02d", minute / 60, minute % 60);
+		return ::std::string{buf};
+	};
+	static ::std::regex const re{" *(?:(off)|(\\d{1,2}):(\\d{2}))? *"};
+	::std::smatch match{};
+	if (!::std::regex_match(args, match, re)
+			|| (match[2].matched && (::std::stoi(match[2]) > 23 || ::std::stoi(match[3]) > 59))) {
+		reply("Укажите время в виде ЧЧ:ММ, например /remind 20:00, или /remind off");
+		return;
+	}
+	if (match[1].matched) {
+		storage_->DeleteReminder(user_id);
+		if (send_reminders_) {
+			DisarmReminder(user_id);
+		}
+		reply("Напоминание отключено.");
+		return;
+	}
+	if (!match[2].matched) {
+		for (auto const& reminder : storage_->ReadReminders()) {
+			if (reminder.user_id == user_id) {
+				reply("Напоминание приходит каждый день в " + format(reminder.minute) + ".");
+				return;
+			}
+		}
+		reply("Напоминание не настроено.");
+		return;
+	}
+	auto minute = ::std::stoi(match[2]) * 60 + ::std::stoi(match[3]);
+	storage_->SetReminder(user_id, minute);
+	if (send_reminders_) {
+		ArmReminder(user_id, minute);
+	}
+	reply("Напоминание будет приходить каждый день в " + format(minute) + ".");
 }
 
-void TelegramBot::OnUpdateFailed(Error& error) noexcept {
-	static constexpr int ERROR_SEQ_COUNT_MAX = 5;
-	if (++error_seq_count_ > ERROR_SEQ_COUNT_MAX) {
-		error = Error{true};
+// Runs on the scheduler's pool. Other processes change reminders in the
+// shared database too, so the armed set is brought in line with it.
+void TelegramBot::ReloadReminders()
+{
+	auto stored = ::std::unordered_map<ChatId, int>{};
+	for (auto const& reminder : storage_->ReadReminders()) {
+		stored.emplace(reminder.user_id, reminder.minute);
 	}
+	auto armed = ::std::unordered_map<ChatId, int>{};
+	{
+		auto lock = ::std::lock_guard{reminders_mutex_};
+		for (auto const& [user_id, reminder] : reminders_) {
+			armed.emplace(user_id, reminder.minute);
+		}
+	}
+	for (auto const& [user_id, minute] : armed) {
+		if (!stored.count(user_id)) {
+			DisarmReminder(user_id);
+		}
+	}
+	for (auto const& [user_id, minute] : stored) {
+		if (auto iarmed = armed.find(user_id); iarmed == armed.end() || iarmed->second != minute) {
+			ArmReminder(user_id, minute);
+		}
+	}
+	metrics_.Set("reminders.armed", stored.size());
 }
 
-p_dyn::Var TelegramBot::SendMessage(::std::string_view method, p_dyn::Var const& req)
+void TelegramBot::ArmReminder(ChatId user_id, int minute)
+{
+	auto lock = ::std::lock_guard{reminders_mutex_};
+	auto& reminder = reminders_[user_id];
+	if (reminder.job) {
+		scheduler_->Cancel(reminder.job);
+	}
+	reminder.minute = minute;
+	reminder.seq = ++reminder_seq_;
+	reminder.job = scheduler_->After(UntilMinute(minute),
+		[this, user_id, seq = reminder.seq]() { SendReminder(user_id, seq); });
+}
+
+void TelegramBot::DisarmReminder(ChatId user_id)
 {
-	Send(method, req);
-	auto resp_dv = Receive();
+	auto lock = ::std::lock_guard{reminders_mutex_};
+	if (auto ireminder = reminders_.find(user_id); ireminder != reminders_.end()) {
+		scheduler_->Cancel(ireminder->second.job);
+		reminders_.erase(ireminder);
+	}
+}
 
-#if 0
-	::std::cout << "REQUEST:" << ::std::endl;
-	::std::cout << method << " ";
-	p_json::Stringifier::stringify(req, ::std::cout);
-	::std::cout << ::std::endl;
+// Runs on the scheduler's pool, so it goes around SendMessage and its
+// retry engine, which belong to the update loop.
+void TelegramBot::SendReminder(ChatId user_id, ::std::uint64_t seq)
+{
+	auto rearm = [&](::std::chrono::seconds delay) {
+		auto lock = ::std::lock_guard{reminders_mutex_};
+		if (auto ireminder = reminders_.find(user_id);
+				ireminder != reminders_.end() && ireminder->second.seq == seq) {
+			ireminder->second.job = scheduler_->After(delay,
+				[this, user_id, seq]() { SendReminder(user_id, seq); });
+		}
+	};
+	auto minute = 0;
+	{
+		auto lock = ::std::lock_guard{reminders_mutex_};
+		auto ireminder = reminders_.find(user_id);
+		if (ireminder == reminders_.end() || ireminder->second.seq != seq) {
+			return;
+		}
+		minute = ireminder->second.minute;
+	}
 
-	::std::cout << "RESPONSE:" << ::std::endl;
-	p_json::Stringifier::stringify(resp_dv, ::std::cout, 1, 2);
-	::std::cout << ::std::endl;
-#endif
+	// A short wait for a slot is taken here; a limiter held by a 429 is
+	// waited out in the scheduler rather than on one of its threads.
+	auto held = send_limiter_->Next() - RateLimiter::Clock::now();
+	if (held > ::std::chrono::seconds{1}) {
+		metrics_.Add("reminders.held");
+		rearm(::std::chrono::ceil<::std::chrono::seconds>(held));
+		return;
+	}
 
-	auto resp_jo = resp_dv.extract<p_json::Object::Ptr>();
-	if (auto ok = resp_jo->getValue<bool>("ok"); !ok) {
-		::std::stringstream sstm{};
-		sstm << "bad response: ";
-		p_json::Stringifier::condense(resp_dv, sstm);
-		throw ::std::runtime_error{sstm.str()};
+	auto tomorrow = LocalDay() + 1;
+	auto members = ReadReminderMembers(tomorrow);
+	auto date = Date::FromDayNumber(tomorrow);
+	char date_str[8]{};
+	::std::snprintf(date_str, sizeof(date_str), "%02d.%02d", date.day, date.month);
+	::std::ostringstream sstm{};
+	sstm << "Завтра, " << date_str << ", отмечено: " << members->size() << ".\n"
+		<< (members->count(user_id) ? "Вы в их числе." : "Вы не отмечены: /calendar");
+	auto req_jo = p_json::Object::Ptr{new p_json::Object};
+	req_jo->set("chat_id", user_id);
+	req_jo->set("text", sstm.str());
+	send_limiter_->Acquire();
+	try {
+		auto res_ft = Send("sendMessage", req_jo, api_timeout_);
+		Unwrap(Receive(res_ft));
+		metrics_.Add("reminders.sent");
+	} catch (ApiError const& e) {
+		if (e.error_code == 429) {
+			metrics_.Add("reminders.throttled");
+			auto delay = ::std::max(e.retry_after, ::std::chrono::seconds{1});
+			send_limiter_->Hold(RateLimiter::Clock::now() + delay);
+			rearm(delay);
+			return;
+		}
+		if (e.error_code == 403) {
+			// blocked by the user; /remind sets it up again
+			Logger::Info("reminders", "dropped")("user_id", user_id)("error", e.what());
+			storage_->DeleteReminder(user_id);
+			DisarmReminder(user_id);
+			return;
+		}
+		metrics_.Add("reminders.failed");
+		Logger::Warning("reminders", "send failed")("user_id", user_id)("error", e.what());
+	} catch (::std::exception const& e) {
+		metrics_.Add("reminders.failed");
+		Logger::Warning("reminders", "send failed")("user_id", user_id)("error", e.what());
 	}
-	return resp_jo->get("result");
+	// a wall clock running ahead of the scheduler's must not send it twice
+	auto delay = UntilMinute(minute);
+	rearm(delay < ::std::chrono::hours{1} ? delay + ::std::chrono::hours{24} : delay);
 }
 
-void TelegramBot::Send(::std::string_view method, p_dyn::Var const& json)
+// Reminders due in the same minute read the day once between them; the
+// lock keeps a second pool thread from reading it alongside the first.
+::std::shared_ptr<::std::unordered_set<TelegramBot::ChatId> const> TelegramBot::ReadReminderMembers(int day)
 {
-	::std::stringstream json_stm{};
-	p_json::Stringifier::condense(json, json_stm);
-	p_net::HTTPRequest req(
-			p_net::HTTPRequest::HTTP_POST,
-			GenerateMethodPath(base_path_, method),
-			Poco::Net::HTTPMessage::HTTP_1_1);
-	req.setContentType("application/json; charset=utf-8");
-	req.setContentLength(json_stm.tellp());
-	auto& req_stm = api_session_->sendRequest(req);
-	req_stm << json_stm.rdbuf();
+	auto minute = ::std::chrono::floor<::std::chrono::minutes>(
+		::std::chrono::system_clock::now().time_since_epoch()).count();
+	auto lock = ::std::lock_guard{reminder_members_mutex_};
+	if (!reminder_members_.users || reminder_members_.day != day
+			|| reminder_members_.minute != minute) {
+		reminder_members_.day = day;
+		reminder_members_.minute = minute;
+		reminder_members_.users =
+			::std::make_shared<::std::unordered_set<ChatId> const>(ReadMembers(day));
+	}
+	return reminder_members_.users;
 }
 
-p_dyn::Var TelegramBot::Receive()
+// The day number of today in the reminders' time zone.
+int TelegramBot::LocalDay() const
 {
-	p_net::HTTPResponse resp{};
-	auto& resp_stm = api_session_->receiveResponse(resp);
-	auto resp_dv = p_json::Parser{}.parse(resp_stm);
-	return resp_dv;
+	auto now = ::std::chrono::system_clock::now().time_since_epoch() + reminder_offset_;
+	return static_cast<int>(::std::chrono::floor<::std::chrono::hours>(now).count() / 24);
 }
 
-p_dyn::Var TelegramBot::GenerateKeyboard(Keyboard const& kb, ChatId user_id)
+// Time left until the next minute-of-the-day in the reminders' time zone.
+::std::chrono::seconds TelegramBot::UntilMinute(int minute) const
 {
-	using Array = p_json::Array;
-	using Object = p_json::Object;
-
-	auto& ud = user_data_[user_id];
-	auto ks = CallbackData::Serialize(kb);
-	auto grid = kb.GenerateGrid();
-	auto today = Date::From(Today());
-	auto kb_ja = Array::Ptr{new Array};
+	static constexpr auto DAY = ::std::chrono::seconds{86400};
+	auto now = ::std::chrono::duration_cast<::std::chrono::seconds>(
+		::std::chrono::system_clock::now().time_since_epoch() + reminder_offset_);
+	auto into_day = (now % DAY + DAY) % DAY;
+	auto delay = ::std::chrono::minutes{minute} - into_day;
+	return delay.count() > 0 ? delay : delay + DAY;
+}
 
-	{
-		auto row_ja = Array::Ptr{new Array};
-		kb_ja->add(row_ja);
-		{
-			auto bn_jo = Object::Ptr{new Object};
-			row_ja->add(bn_jo);
-			auto const& [first_date, first_is_gap] = grid.front();
-			auto const& [last_date, last_is_gap] = grid.back();
-			auto text = ::std::string{};
-			if (first_is_gap) {
-				text.append(MONTH_NAMES[last_date.month - 1]);
-				text.append(" ");
-				text.append(::std::to_string(last_date.year));
-			} else if (last_is_gap || first_date.month == last_date.month) {
-				text.append(MONTH_NAMES[first_date.month - 1]);
-				text.append(" ");
-				text.append(::std::to_string(first_date.year));
-			} else {
-				text.append(MONTH_NAMES[first_date.month - 1]);
-				text.append(" ");
-				text.append(::std::to_string(first_date.year));
-				text.append(" — ");
-				text.append(MONTH_NAMES[last_date.month - 1]);
-				text.append(" ");
-				text.append(::std::to_string(last_date.year));
-			}
-			bn_jo->set("text", text);
-			bn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::MONTH}));
-		}
-	}
-
-	for (int row = 0; row < DAYS_PER_WEEK; ++row) {
-		auto row_ja = Array::Ptr{new Array};
-		kb_ja->add(row_ja);
-		for (int col = 0; col < (1 + kb.n_cols); ++col) {
-			auto bn_jo = Object::Ptr{new Object};
-			row_ja->add(bn_jo);
-			if (col == 0) {
-				bn_jo->set("text", DAY_NAMES[row]);
-				bn_jo->set("callback_data",
-						CallbackData::Serialize(ks, {Key::Type::EMPTY}));
-			} else {
-				auto const& [date, is_gap] = grid[row + ((col - 1) * DAYS_PER_WEEK)];
-				if (is_gap) {
-					bn_jo->set("text", " ");
-					bn_jo->set("callback_data",
-							CallbackData::Serialize(ks, {Key::Type::EMPTY}));
-				} else {
-					auto day = ::std::to_string(date.day);
-					if (day.size() == 1) {
-						day = ::std::string{" "} + day;
-					}
-					if (date == today) {
-						day = UnderlineUtf8String(day);
-					}
-					::std::size_t n_users = 0;
-					if (auto idate = date_cache_.find(date); idate != date_cache_.end()) {
-						for (auto const& [uid, remove] : idate->second) {
-							if (kb.mode == Keyboard::Mode::EDIT && user_id == uid) {
-								continue;
-							}
-							if (remove) {
-								continue;
-							}
-							++n_users;
-						}
-					}
-					auto text = ::std::string{};
-					if (kb.mode == Keyboard::Mode::EDIT) {
-						auto idate = ud.selection.find(date);
-						if (idate != ud.selection.end() && !idate->second) {
-							text.append("✅ ");
-						} else if (n_users) {
-							text.append(EMOJI_NUMBERS[n_users]);
-							text.append(" ");
-						} else {
-							text.append("  ·   ");
-						}
-					} else {
-						if (n_users) {
-							text.append(EMOJI_NUMBERS[n_users]);
-							text.append(" ");
-						} else {
-							text.append("      ");
-						}
-					}
-					text.append(day);
-					bn_jo->set("text", text);
-					bn_jo->set("callback_data",
-							CallbackData::Serialize(ks, {Key::Type::DAY, date}));
-				}
-			}
-		}
+::std::vector<TelegramBot::User> TelegramBot::GetRegisteredUsers()
+{
+	auto user_ids = storage_->GetRegisteredUsers();
+	PrefetchUsers(user_ids);
+	auto users = ::std::vector<User>{};
+	for (auto user_id : user_ids) {
+		users.push_back(GetUserCaching(user_id));
 	}
+	return users;
+}
 
-	{
-		auto row_ja = Array::Ptr{new Array};
-		kb_ja->add(row_ja);
-		{
-			auto bn_jo = Object::Ptr{new Object};
-			row_ja->add(bn_jo);
-			bn_jo->set("text", "<<");
-			bn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::PREV_M}));
-		} {
-			auto bn_jo = Object::Ptr{new Object};
-			row_ja->add(bn_jo);
-			bn_jo->set("text", "<");
-			bn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::PREV_W}));
-		} {
-			auto bn_jo = Object::Ptr{new Object};
-			row_ja->add(bn_jo);
-			bn_jo->set("text", "•");
-			bn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::TODAY}));
-		} {
-			auto bn_jo = Object::Ptr{new Object};
-			row_ja->add(bn_jo);
-			bn_jo->set("text", ">");
-			bn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::NEXT_W}));
-		} {
-			auto bn_jo = Object::Ptr{new Object};
-			row_ja->add(bn_jo);
-			bn_jo->set("text", ">>");
-			bn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::NEXT_M}));
-		}
-	} {
-		auto row_ja = Array::Ptr{new Array};
-		kb_ja->add(row_ja);
-		auto lbn_jo = Object::Ptr{new Object};
-		row_ja->add(lbn_jo);
-		auto rbn_jo = Object::Ptr{new Object};
-		row_ja->add(rbn_jo);
-		if (kb.mode == Keyboard::Mode::VIEW) {
-			lbn_jo->set("text", "добавить");
-			lbn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::EDIT}));
-			rbn_jo->set("text", "закрыть");
-			rbn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::CLOSE}));
-		} else if (kb.mode == Keyboard::Mode::EDIT) {
-			lbn_jo->set("text", "отмена");
-			lbn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::CANCEL}));
-			rbn_jo->set("text", "сохранить");
-			rbn_jo->set("callback_data",
-					CallbackData::Serialize(ks, {Key::Type::SAVE}));
-		}
-	}
-	return kb_ja;
-}
-
-::std::string TelegramBot::UnderlineUtf8String(::std::string const& s)
+::std::string TelegramBot::GetListOfCommads() const
+{
+	::std::ostringstream sstm{};
+	sstm << "Доступные команды:\n"
+		<< "\n" << "/sensor - получить показания датчика"
+		<< "\n" << "/calendar - открыть календарь посещений"
+		<< "\n" << "/invite - пригласить нового пользователя"
+		<< "\n" << "/users - показать зарегистрированных пользователей"
+		<< "\n" << "/stats [ГГГГ.ММ [ГГГГ.ММ]] - статистика присутствий"
+		<< "\n" << "/remind [ЧЧ:ММ|off] - ежедневное напоминание о завтрашнем дне"
+		<< "\n" << "/broadcast all|today|tomorrow текст - рассылка (для администраторов)"
+		<< "\n" << "/start - показать доступные команды"
+		<< "\n" << "/camera - открыть видео в браузере"
+		;
+	return sstm.str();
+}
+
+::std::string TelegramBot::GenerateToken()
 {
-	auto underlined = ::std::string{};
-	static constexpr int UTF8_MAX_BYTES = 4;
-	::std::array<uint8_t, UTF8_MAX_BYTES> buf{};
-	p::UTF8Encoding enc{};
-	auto ich = p::TextIterator{s, enc};
-	auto iend = p::TextIterator{s};
-	for (; ich != iend; ++ich) {
-		int n_bytes = enc.convert(*ich, buf.data(), UTF8_MAX_BYTES);
-		underlined.append(reinterpret_cast<char*>(buf.data()), n_bytes);
-		underlined.append("̲");
+	auto prng = p::Random{};
+	auto sstm = ::std::stringstream{};
+	auto estm = p::Base64Encoder{sstm,
+		p::Base64EncodingOptions::BASE64_URL_ENCODING |
+		p::Base64EncodingOptions::BASE64_NO_PADDING};
+	static constexpr int TOKEN_LENGTH = 32;
+	static constexpr int N_BYTES = TOKEN_LENGTH / 4 * 3;
+	for (int i = 0; i < N_BYTES; ++i) {
+		estm << prng.nextChar();
 	}
-	return underlined;
+	estm.close();
+	return sstm.str();
 }
 
-TelegramBot::Keyboard::Keyboard(Date const& date)
+::std::string TelegramBot::GenerateInviteToken()
 {
-	SetCenter(date);
+	return GenerateToken();
 }
 
-void TelegramBot::Keyboard::SetCenter(Date const& d)
+// What GenerateToken() makes: 32 characters of unpadded base64url.
+bool TelegramBot::IsInviteToken(::std::string_view s)
 {
-	first_date = {d, false};
-	ToStartOfWeek();
-	MoveWeek(-(n_cols - 1) / 2);
+	return s.size() == 32 && ::std::all_of(s.begin(), s.end(), [](char c) {
+		return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9')
+			|| c == '-' || c == '_';
+	});
 }
 
-void TelegramBot::Keyboard::MoveWeek(int shift)
+// Only well-formed invites not known to be missing reach storage, and
+// only until the user has missed max_invite_failures_ times in a row.
+bool TelegramBot::RedeemInvite(ChatId user_id, ::std::string const& invite)
 {
-	bool back = false;
-	if (shift < 0) {
-		back = true;
-		shift = -shift;
+	if (!IsInviteToken(invite)) {
+		metrics_.Add("invites.malformed");
+		return false;
 	}
-	for (; shift; --shift) {
-		Advance(back);
+	auto failures = 0;
+	if (auto const* f = invite_failures_.Find(user_id)) {
+		failures = *f;
 	}
+	if (failures >= max_invite_failures_) {
+		metrics_.Add("invites.throttled");
+		return false;
+	}
+	if (invite_misses_.Find(invite)) {
+		invite_failures_.Put(user_id, failures + 1);
+		metrics_.Add("invites.miss_cache_hits");
+		return false;
+	}
+	if (!storage_->PopInvite(invite)) {
+		invite_failures_.Put(user_id, failures + 1);
+		invite_misses_.Put(invite, true);
+		metrics_.Add("invites.misses");
+		return false;
+	}
+	invite_failures_.Erase(user_id);
+	metrics_.Add("invites.redeemed");
+	return true;
 }
 
-void TelegramBot::Keyboard::MoveMonth(int shift)
+// Runs on the scheduler's pool, one batch after another until none is full.
+void TelegramBot::PurgeInvites(::std::size_t batch)
 {
-	auto tm = first_date.first.To<::std::tm>();
-	tm.tm_mon += shift + (first_date.second ? 1 : 0);
-	tm.tm_mday = 1;
-	::std::mktime(&tm);
-	first_date.first = Date::From(tm);
-	ToStartOfWeek();
+	auto purged = ::std::size_t{};
+	for (;;) {
+		auto n = storage_->PurgeInvites(batch);
+		purged += n;
+		if (n < batch) {
+			break;
+		}
+	}
+	if (purged) {
+		metrics_.Add("invites.purged", purged);
+		Logger::Info("invites", "purged")("count", purged);
+	}
 }
 
-void TelegramBot::Keyboard::ToStartOfWeek()
+// Either a single update or the callback queries of one message.
+void TelegramBot::ProcessUpdates(::std::vector<p_json::Object::Ptr> const& updates)
 {
-	auto tm = first_date.first.To<::std::tm>();
-	::std::mktime(&tm);
-	tm.tm_mday -= (tm.tm_wday + DAYS_PER_WEEK - 1) % DAYS_PER_WEEK;
-	auto old_mon = tm.tm_mon;
-	::std::mktime(&tm);
-	first_date.second = (old_mon != tm.tm_mon);
-	first_date.first = Date::From(tm);
+	if (auto msg = updates.front()->get("message"); !msg.isEmpty()) {
+		ProcessMessage(msg);
+	}
+	// TODO block unregistered users here
+	else if (!updates.front()->get("callback_query").isEmpty()) {
+		auto cqs = ::std::pmr::vector<p_dyn::Var>{&arena_};
+		cqs.reserve(updates.size());
+		for (auto const& update : updates) {
+			cqs.push_back(update->get("callback_query"));
+		}
+		ProcessCallbackQueries(cqs);
+	}
+	// TODO handle unknown update
 }
 
-void TelegramBot::Keyboard::Advance(bool back)
+// The poll goes out only once the batch before it is handled, since its
+// offset tells Telegram to forget everything before: a crash mid-batch
+// gets the batch again rather than losing it.
+p_json::Array::Ptr TelegramBot::ReceivePolled()
 {
-	auto tm = first_date.first.To<::std::tm>();
-	auto cur = tm;
-	if (back) {
-		tm.tm_mday -= DAYS_PER_WEEK;
+	auto const timeout = api_timeout_ + ::std::chrono::seconds{poll_timeout_};
+	auto res_dv = p_dyn::Var{};
+	if (restored_.valid()) {
+		// the offset is the one part of the snapshot the first poll needs
+		auto restored = restored_.get();
+		if (restored) {
+			last_update_id_ = restored->update_id;
+		}
+		auto req_jo = PollRequest();
+		auto res_ft = ::std::future<HttpLoop::Response>{};
+		try {
+			retry_->Admit("getUpdates");
+			try {
+				res_ft = Send("getUpdates", req_jo, timeout);
+			} catch (...) {
+				retry_->OnFailure("getUpdates");
+				throw;
+			}
+		} catch (...) {
+			// restored_ is spent: a poll that can't go out, say during an
+			// outage, must not take the snapshot down with it
+			WarmUp(::std::move(restored));
+			throw;
+		}
+		WarmUp(::std::move(restored));
+		res_dv = Call("getUpdates", req_jo, timeout, ::std::move(res_ft));
 	} else {
-		tm.tm_mday += DAYS_PER_WEEK;
+		res_dv = Call("getUpdates", PollRequest(), timeout, {});
 	}
-	::std::mktime(&tm);
-	if (first_date.second) {
-		first_date.second = false;
-		if (back) {
-			tm = cur;
+	return res_dv.extract<p_json::Array::Ptr>();
+}
+
+// Whatever the frontend sent since the last call, as one batch; waits up
+// to the poll timeout for the first of it.
+p_json::Array::Ptr TelegramBot::ReceiveForwarded()
+{
+	if (restored_.valid()) {
+		WarmUp(restored_.get());
+	}
+	auto updates = p_json::Array::Ptr{new p_json::Array};
+	for (auto const& frame : shard_receiver_->Receive(::std::chrono::seconds{poll_timeout_})) {
+		// the frames are off the socket already; a bad one must not take
+		// those after it along
+		auto batch_ja = p_json::Array::Ptr{};
+		try {
+			batch_ja = p_json::Parser{}.parse(frame).extract<p_json::Array::Ptr>();
+		} catch (p::Exception const& e) {
+			metrics_.Add("shard.bad_frames");
+			Logger::Error("shard", "bad frame")("bytes", frame.size())("error", e.displayText());
+			continue;
 		}
-	} else if (tm.tm_mon != cur.tm_mon) {
-		first_date.second = true;
-		if (!back) {
-			tm = cur;
+		for (::std::size_t i = 0; i < batch_ja->size(); ++i) {
+			updates->add(batch_ja->get(i));
 		}
+		metrics_.Add("shard.frames");
 	}
-	first_date.first = Date::From(tm);
+	metrics_.Add("shard.received", updates->size());
+	return updates;
 }
 
-TelegramBot::Date TelegramBot::Keyboard::LastDate() const
+// Every update of a chat goes to the same worker, in the order polled.
+// Handing the batches to the forwarder never blocks; a worker that can't
+// be reached gets its share once it is back, unless its queue fills up
+// first. The offset moves past them either way, so what is still queued
+// when the frontend dies is lost.
+void TelegramBot::ForwardUpdates(p_json::Array::Ptr const& updates)
 {
-	auto tm = first_date.first.To<::std::tm>();
-	tm.tm_mday += (DAYS_PER_WEEK * n_cols) - 1;
-	::std::mktime(&tm);
-	return Date::From(tm);
+	auto batches = ::std::vector<p_json::Array::Ptr>(shard_ring_->Size());
+	for (::std::size_t i = 0; i < updates->size(); ++i) {
+		auto update = updates->getObject(i);
+		auto& batch = batches[shard_ring_->Pick(UpdateChatId(update))];
+		if (!batch) {
+			batch = new p_json::Array;
+		}
+		batch->add(update);
+	}
+	for (::std::size_t worker = 0; worker < batches.size(); ++worker) {
+		if (!batches[worker]) {
+			continue;
+		}
+		auto sstm = ::std::ostringstream{};
+		batches[worker]->stringify(sstm);
+		shard_forwarder_->Send(worker, sstm.str());
+		metrics_.Add("shard.forwarded", batches[worker]->size());
+	}
 }
 
-::std::vector<::std::pair<TelegramBot::Date, bool>> TelegramBot::Keyboard::GenerateGrid() const
+void TelegramBot::DispatchUpdates(p_json::Array::Ptr const& res_ja)
 {
-	::std::vector<::std::pair<Date, bool>> grid(DAYS_PER_WEEK * n_cols);
-	if (!grid.size()) {
-		return grid;
-	}
-	int skip = 0;
-	auto tm = first_date.first.To<::std::tm>();
-	::std::mktime(&tm);
-	tm.tm_mday += DAYS_PER_WEEK -
-		(tm.tm_wday + DAYS_PER_WEEK - 1) % DAYS_PER_WEEK;
-	::std::mktime(&tm);
-	tm.tm_mday -= DAYS_PER_WEEK;
-	int mon = tm.tm_mon;
-	::std::mktime(&tm);
-	if (mon != tm.tm_mon && first_date.second) {
-		tm.tm_mon += 1;
-		tm.tm_mday = 1;
-		::std::mktime(&tm);
-		skip = (tm.tm_wday + DAYS_PER_WEEK - 2) % DAYS_PER_WEEK + 1;
-	}
-	for (int i = 0;;) {
-		grid[i] = {Date::From(tm), skip};
-		if (++i >= static_cast<int>(grid.size())) {
-			break;
-		}
-		if (skip) {
-			--skip;
-		} else {
-			tm.tm_mday += 1;
-			mon = tm.tm_mon;
-			::std::mktime(&tm);
-			if (mon != tm.tm_mon) {
-				skip = 7;
+	// Callback queries on the same message are handled as one group at
+	// the position of the first; everything else keeps its order.
+	auto work = ::std::vector<::std::vector<p_json::Object::Ptr>>{};
+	auto groups = ::std::unordered_map<MessageKey, ::std::size_t, MessageKeyHash>{};
+	for (::std::size_t i = 0; i < res_ja->size(); ++i) {
+		auto update = res_ja->getObject(i);
+		if (auto cq_jo = update->getObject("callback_query"); cq_jo && cq_jo->has("message")) {
+			auto key = MessageKey{
+				cq_jo->getObject("from")->getValue<ChatId>("id"),
+				cq_jo->getObject("message")->getValue<MessageId>("message_id")};
+			auto [igroup, inserted] = groups.emplace(key, work.size());
+			if (!inserted) {
+				work[igroup->second].push_back(update);
+				metrics_.Add("callbacks.coalesced");
+				continue;
 			}
 		}
+		work.push_back({update});
+	}
+	// one bad update must not take the rest of the batch down with it
+	for (auto const& updates : work) {
+		auto allocs = AllocCounter::Get();
+		auto update = Tracer::Update{};
+		try {
+			ProcessUpdates(updates);
+		} catch (p::Exception const& e) {
+			metrics_.Add("updates.failed");
+			Logger::Error("bot", "update failed")("error", e.displayText());
+		} catch (::std::exception const& e) {
+			metrics_.Add("updates.failed");
+			Logger::Error("bot", "update failed")("error", e.what());
+		}
+		arena_.release();
+		allocs = AllocCounter::Get() - allocs;
+		metrics_.Add("updates.processed");
+		metrics_.Add("updates.allocs", allocs.allocs);
+		metrics_.Add("updates.alloc_bytes", allocs.bytes);
 	}
-	return grid;
 }
 
-template<> p_data::Date TelegramBot::Date::To() const
+void TelegramBot::HandleUpdates(Error& error) noexcept
+try {
+	auto updates = role_ == Role::WORKER ? ReceiveForwarded() : ReceivePolled();
+	OnUpdateSucceed(error);
+	if (role_ == Role::FRONTEND) {
+		ForwardUpdates(updates);
+	} else {
+		DispatchUpdates(updates);
+	}
+	if (role_ != Role::WORKER) {
+		for (::std::size_t i = 0; i < updates->size(); ++i) {
+			auto upid = updates->getObject(i)->getValue<::std::size_t>("update_id");
+			last_update_id_ = ::std::max(last_update_id_, upid);
+		}
+	}
+}
+catch (p::Exception const& e) {
+	OnUpdateFailed(error);
+	Logger::Error("bot", "poll failed")("error", e.displayText());
+}
+catch (::std::exception const& e) {
+	OnUpdateFailed(error);
+	Logger::Error("bot", "poll failed")("error", e.what());
+}
+catch (...) {
+	error = Error{true};
+	Logger::Error("bot", "poll failed")("error", "unknown non-standard exception");
+}
+
+void TelegramBot::Maintain() noexcept
 {
-	return {year, month, day};
+	user_data_.Expire();
+	user_cache_.Expire();
+	render_cache_.Expire();
+	invite_misses_.Expire();
+	invite_failures_.Expire();
+	if (::std::chrono::steady_clock::now() - snapshot_saved_ >= snapshot_interval_) {
+		SaveSnapshot();
+	}
+	if (Tracer::TakeDumpRequest() || (Tracer::Enabled() && trace_interval_.count()
+			&& ::std::chrono::steady_clock::now() - trace_dumped_ >= trace_interval_)) {
+		Tracer::Dump(trace_path_);
+		trace_dumped_ = ::std::chrono::steady_clock::now();
+	}
+	if (broadcaster_) {
+		ReportBroadcasts();
+	}
+
+	auto now = ::std::chrono::steady_clock::now();
+	if (now - metrics_reported_ < metrics_interval_) {
+		return;
+	}
+	metrics_reported_ = now;
+	metrics_.Set("sessions.live", user_data_.Size());
+	metrics_.Set("sessions.bytes", user_data_.Cost());
+	metrics_.Set("sessions.evicted", user_data_.GetStats().evictions);
+	metrics_.Set("sessions.expired", user_data_.GetStats().expirations);
+	metrics_.Set("user_cache.size", user_cache_.Size());
+	metrics_.Set("user_cache.bytes", user_cache_.Cost());
+	metrics_.Set("user_cache.evicted", user_cache_.GetStats().evictions);
+	metrics_.Set("user_cache.expired", user_cache_.GetStats().expirations);
+	metrics_.Set("render_cache.size", render_cache_.Size());
+	metrics_.Set("render_cache.evicted", render_cache_.GetStats().evictions);
+	if (scheduler_) {
+		metrics_.Set("scheduler.pending", scheduler_->Pending());
+	}
+	if (journal_) {
+		metrics_.Set("journal.pending", journal_->PendingCount());
+		metrics_.Set("journal.lag_ms", journal_->Lag().count());
+	}
+	auto http = http_loop_->GetStats();
+	metrics_.Set("http.handshakes", http.handshakes);
+	metrics_.Set("http.resumed", http.resumed);
+	metrics_.Set("http.standby_used", http.standby_used);
+	if (http.handshakes) {
+		metrics_.Set("http.handshake_avg_us", http.handshake_time.count() / http.handshakes);
+	}
+	if (shard_forwarder_) {
+		auto shard = shard_forwarder_->GetStats();
+		metrics_.Set("shard.frames_sent", shard.sent);
+		metrics_.Set("shard.frames_dropped", shard.dropped);
+		metrics_.Set("shard.queued_bytes", shard.queued);
+	}
+	if (auto processed = metrics_.Get("updates.processed")) {
+		metrics_.Set("updates.allocs_avg", metrics_.Get("updates.allocs") / processed);
+	}
+	if (auto decoded = metrics_.Get("api.bytes_decoded")) {
+		metrics_.Set("api.compression_pct", metrics_.Get("api.bytes_received") * 100 / decoded);
+	}
+	Logger::Info("metrics", "report").Fields(metrics_.Format());
+}
+
+// Snapshot payload: update offset, cached profiles and EDIT selections in
+// least recently used order, then the attendance window.
+void TelegramBot::SaveSnapshot() noexcept
+try {
+	// not warmed yet; saving now would lose what is still to be restored
+	if (!warmed_) {
+		return;
+	}
+	auto w = Snapshot::Writer{};
+	w.Put<::std::uint64_t>(last_update_id_);
+	w.Put<::std::uint32_t>(user_cache_.Size());
+	user_cache_.ForEach([&](ChatId user_id, User const& user) {
+		w.Put(user_id);
+		w.PutString(user.first_name);
+		w.PutString(user.last_name);
+		w.PutString(user.username);
+	});
+	w.Put<::std::uint32_t>(user_data_.Size());
+	user_data_.ForEach([&](ChatId user_id, UserData const& ud) {
+		w.Put(user_id);
+		w.Put<::std::int32_t>(ud.selection.anchor);
+		w.Put<::std::uint32_t>(ud.selection.chunks.size());
+		for (auto const& chunk : ud.selection.chunks) {
+			w.Put(chunk.add);
+			w.Put(chunk.remove);
+		}
+	});
+	w.Put<::std::int32_t>(window_first_);
+	w.Put<::std::int32_t>(window_last_);
+	w.Put<::std::uint32_t>(date_cache_.size());
+	for (auto const& [date, da] : date_cache_) {
+		w.Put<::std::int32_t>(date.DayNumber());
+		w.Put<::std::uint64_t>(da.count);
+		w.Put<::std::uint8_t>(da.loaded);
+		w.Put<::std::uint32_t>(da.users.size());
+		for (auto user_id : da.users) {
+			w.Put(user_id);
+		}
+	}
+	Snapshot::Save(snapshot_path_, w);
+	snapshot_saved_ = ::std::chrono::steady_clock::now();
+	metrics_.Add("snapshot.saved");
+	metrics_.Set("snapshot.bytes", w.Data().size());
+}
+catch (::std::exception const& e) {
+	Logger::Error("snapshot", "save failed")("error", e.what());
 }
 
-TelegramBot::Date TelegramBot::Date::From(p_data::Date const& pd)
+// A missing or unreadable snapshot only means a cold start. Runs on its
+// own thread at startup and touches nothing but the file.
+::std::optional<TelegramBot::Restored> TelegramBot::LoadSnapshot(::std::string const& path) noexcept
+try {
+	auto start = ::std::chrono::steady_clock::now();
+	auto restored = Restored{};
+	auto found = Snapshot::Load(path, [&](Snapshot::Reader& r) {
+		restored.update_id = r.Get<::std::uint64_t>();
+		restored.users.resize(r.Get<::std::uint32_t>());
+		for (auto& user : restored.users) {
+			user.user_id = r.Get<ChatId>();
+			user.first_name = r.GetString();
+			user.last_name = r.GetString();
+			user.username = r.GetString();
+		}
+		restored.sessions.resize(r.Get<::std::uint32_t>());
+		for (auto& [user_id, ud] : restored.sessions) {
+			user_id = r.Get<ChatId>();
+			ud.selection.anchor = r.Get<::std::int32_t>();
+			ud.selection.chunks.resize(r.Get<::std::uint32_t>());
+			for (auto& chunk : ud.selection.chunks) {
+				chunk.add = r.Get<::std::uint64_t>();
+				chunk.remove = r.Get<::std::uint64_t>();
+			}
+		}
+		restored.window_first = r.Get<::std::int32_t>();
+		restored.window_last = r.Get<::std::int32_t>();
+		for (auto n_dates = r.Get<::std::uint32_t>(); n_dates; --n_dates) {
+			auto& da = restored.dates[Date::FromDayNumber(r.Get<::std::int32_t>())];
+			da.count = r.Get<::std::uint64_t>();
+			da.loaded = r.Get<::std::uint8_t>();
+			for (auto n_users = r.Get<::std::uint32_t>(); n_users; --n_users) {
+				da.users.insert(r.Get<ChatId>());
+			}
+		}
+		if (!r.Done()) {
+			throw Snapshot::Error{"snapshot: trailing data"};
+		}
+	});
+	if (!found) {
+		return ::std::nullopt;
+	}
+	Logger::Info("snapshot", "loaded")("users", restored.users.size())
+		("sessions", restored.sessions.size())("dates", restored.dates.size())
+		("us", ::std::chrono::duration_cast<::std::chrono::microseconds>(
+			::std::chrono::steady_clock::now() - start).count());
+	return restored;
+}
+catch (::std::exception const& e) {
+	Logger::Warning("snapshot", "starting cold")("error", e.what());
+	return ::std::nullopt;
+}
+
+// Fills the caches from the snapshot once the first poll is on its way,
+// so the poll waits on the server rather than on this.
+void TelegramBot::WarmUp(::std::optional<Restored> restored) noexcept
 {
-	return {pd.year(), pd.month(), pd.day()};
+	auto start = ::std::chrono::steady_clock::now();
+	if (restored) {
+		last_update_id_ = restored->update_id;
+		for (auto& user : restored->users) {
+			user_cache_.Put(user.user_id, ::std::move(user));
+		}
+		for (auto& [user_id, ud] : restored->sessions) {
+			user_data_.Put(user_id, ::std::move(ud));
+		}
+		window_first_ = restored->window_first;
+		window_last_ = restored->window_last;
+		date_cache_ = ::std::move(restored->dates);
+	}
+	warmed_ = true;
+	auto now = ::std::chrono::steady_clock::now();
+	snapshot_saved_ = now;
+	auto to_poll = ::std::chrono::duration_cast<::std::chrono::milliseconds>(start - started_);
+	metrics_.Set("startup.first_poll_ms", to_poll.count());
+	Logger::Info("bot", "started")("to_first_poll_ms", to_poll.count())
+		("warmed", restored.has_value())
+		("warm_up_us", ::std::chrono::duration_cast<::std::chrono::microseconds>(now - start).count());
+}
+
+void TelegramBot::OnUpdateSucceed(Error& error) noexcept {
+	(void) error;
+	error_seq_count_ = 0;
+}
+
+// The poll itself failed. Back off and try again rather than exiting, so
+// an API outage ends as soon as the API is back.
+void TelegramBot::OnUpdateFailed(Error& error) noexcept {
+	(void) error;
+	metrics_.Add("poll.failures");
+	::std::this_thread::sleep_for(retry_->Backoff(++error_seq_count_));
 }
 
-template<> ::std::string TelegramBot::Date::To() const
+// Retries what is safe to retry: anything the server turned away with
+// 429 or a chat migration, and idempotent methods after a 5xx or a
+// transport failure. A 429 uses up no attempt, but the update loop waits
+// out no more than max_retry_after of them per call; flood control that
+// lasts longer fails the call.
+p_dyn::Var TelegramBot::SendMessage(::std::string_view method, p_dyn::Var const& req)
 {
-	::std::stringstream result {};
-	result <<
-		::std::to_string(year) << "." <<
-		::std::to_string(month) << "." <<
-		::std::to_string(day);
-	return result.str();
+	return Call(method, req, api_timeout_, {});
 }
 
-TelegramBot::Date TelegramBot::Date::From(::std::string_view s)
+p_dyn::Var TelegramBot::Call(::std::string_view method, p_dyn::Var const& req,
+		::std::chrono::milliseconds timeout, ::std::future<HttpLoop::Response> res_ft)
 {
-	::std::regex const re{"([0-9]+).([0-9]+).([0-9]+)"};
-	::std::match_results<::std::string_view::const_iterator> match{};
-	if (!::std::regex_match(s.cbegin(), s.cend(), match, re)) {
-		::std::cerr << "invalid date string: " << s << ::std::endl;
-		return {};
+	// Whatever this request tells the user, or the poll confirms, must
+	// survive a crash; everything journaled since the last request is
+	// synced in one go.
+	if (journal_) {
+		journal_->Sync();
+	}
+	auto const& options = retry_->GetOptions();
+	auto req_dv = req;
+	auto throttled = RetryEngine::Clock::duration{};
+	for (int attempt = 1;; ++attempt) {
+		if (!res_ft.valid()) {
+			retry_->Admit(method);
+		}
+		auto delay = RetryEngine::Clock::duration{};
+		try {
+			if (!res_ft.valid()) {
+				res_ft = Send(method, req_dv, timeout);
+			}
+			auto resp_dv = Receive(res_ft);
+
+			if (Logger::Enabled(Logger::Level::DEBUG)) {
+				::std::ostringstream req_stm{}, resp_stm{};
+				p_json::Stringifier::condense(req_dv, req_stm);
+				p_json::Stringifier::condense(resp_dv, resp_stm);
+				Logger::Debug("api", "call")("method", method)("attempt", attempt)
+					("request", req_stm.str())("response", resp_stm.str());
+			}
+
+			auto result = Unwrap(resp_dv);
+			retry_->OnSuccess(method);
+			return result;
+		} catch (ApiError const& e) {
+			if (e.error_code < 500) {
+				retry_->OnSuccess(method);
+			} else {
+				retry_->OnFailure(method);
+			}
+			if (e.error_code == 429) {
+				auto retry_after = ::std::max(e.retry_after, ::std::chrono::seconds{1});
+				// counted for the bot as a whole, so the background sends
+				// hold as well
+				if (send_limiter_) {
+					send_limiter_->Hold(RateLimiter::Clock::now() + retry_after);
+				}
+				delay = retry_->RetryAfter(retry_after);
+				if (throttled + delay > options.max_retry_after) {
+					throw;
+				}
+				throttled += delay;
+				--attempt;
+				metrics_.Add("api.throttled");
+			} else if (attempt >= options.max_attempts) {
+				throw;
+			} else if (e.migrate_to_chat_id) {
+				auto req_jo = p_json::Object::Ptr{
+					new p_json::Object{*req_dv.extract<p_json::Object::Ptr>()}};
+				req_jo->set("chat_id", e.migrate_to_chat_id);
+				req_dv = req_jo;
+				metrics_.Add("api.migrations");
+			} else if (e.error_code >= 500 && IsIdempotent(method)) {
+				delay = retry_->Backoff(attempt);
+			} else {
+				throw;
+			}
+		} catch (HttpLoop::Error const&) {
+			retry_->OnFailure(method);
+			if (attempt >= options.max_attempts || !IsIdempotent(method)) {
+				throw;
+			}
+			delay = retry_->Backoff(attempt);
+		} catch (...) {
+			// An answer that can't be read is no usable answer either. It is
+			// reported all the same, or a probe would stay out for good.
+			retry_->OnFailure(method);
+			throw;
+		}
+		metrics_.Add("api.retries");
+		::std::this_thread::sleep_for(delay);
 	}
-	Date d{};
-	d.year = ::std::stoi(match[1]);
-	d.month = ::std::stoi(match[2]);
-	d.day = ::std::stoi(match[3]);
-	return d;
 }
 
-template<> ::std::tm TelegramBot::Date::To() const
+bool TelegramBot::IsIdempotent(::std::string_view method)
 {
-	::std::tm tm {};
-	tm.tm_mday = day;
-	tm.tm_mon = month - 1;
-	tm.tm_year = year - 1900;
-	return tm;
+	return ::std::find(::std::begin(IDEMPOTENT_METHODS), ::std::end(IDEMPOTENT_METHODS), method) !=
+		::std::end(IDEMPOTENT_METHODS);
 }
 
-TelegramBot::Date TelegramBot::Date::From(::std::tm const& tm)
+p_dyn::Var TelegramBot::Unwrap(p_dyn::Var const& resp_dv)
 {
-	Date d{};
-	d.day = tm.tm_mday;
-	d.month = tm.tm_mon + 1;
-	d.year = tm.tm_year + 1900;
-	return d;
+	auto resp_jo = resp_dv.extract<p_json::Object::Ptr>();
+	if (auto ok = resp_jo->getValue<bool>("ok"); !ok) {
+		::std::stringstream sstm{};
+		sstm << "bad response: ";
+		p_json::Stringifier::condense(resp_dv, sstm);
+		auto error = ApiError{sstm.str()};
+		if (resp_jo->has("error_code")) {
+			error.error_code = resp_jo->getValue<int>("error_code");
+		}
+		if (auto params_jo = resp_jo->getObject("parameters")) {
+			if (params_jo->has("retry_after")) {
+				error.retry_after = ::std::chrono::seconds{params_jo->getValue<int>("retry_after")};
+			}
+			if (params_jo->has("migrate_to_chat_id")) {
+				error.migrate_to_chat_id = params_jo->getValue<ChatId>("migrate_to_chat_id");
+			}
+		}
+		throw error;
+	}
+	return resp_jo->get("result");
 }
 
-::std::string TelegramBot::CallbackData::Serialize(Keyboard const& kb)
+p_json::Object::Ptr TelegramBot::PollRequest() const
 {
-	::std::stringstream result {};
-	result <<
-		::std::to_string(kb.first_date.first.year) << "." <<
-		::std::to_string(kb.first_date.first.month) << "." <<
-		::std::to_string(kb.first_date.first.day) << "," <<
-		::std::to_string(static_cast<int>(kb.first_date.second)) << "," <<
-		::std::to_string(static_cast<int>(kb.mode)) << "," <<
-		::std::to_string(static_cast<int>(kb.n_cols));
-	return result.str();
-}
-
-::std::string TelegramBot::CallbackData::Serialize(::std::string_view kb, Key const& key)
+	auto req_jo = p_json::Object::Ptr{new Poco::JSON::Object};
+	req_jo->set("offset", last_update_id_ + 1);
+	req_jo->set("timeout", poll_timeout_);
+	return req_jo;
+}
+
+::std::future<HttpLoop::Response> TelegramBot::Send(::std::string_view method,
+		p_dyn::Var const& json, ::std::chrono::milliseconds timeout)
 {
-	::std::stringstream result {};
-	result << kb << "," <<
-		::std::to_string(static_cast<int>(key.type)) << ",";
-	if (key.type == Key::Type::DAY) {
-		result <<
-			::std::to_string(key.data.date.year) << "." <<
-			::std::to_string(key.data.date.month) << "." <<
-			::std::to_string(key.data.date.day);
+	auto span = Tracer::Span{"Send"};
+	::std::stringstream json_stm{};
+	p_json::Stringifier::condense(json, json_stm);
+	auto req = HttpLoop::Request{};
+	req.method = "POST";
+	req.host = api_host_;
+	req.port = api_port_;
+	req.tls = true;
+	req.target = GenerateMethodPath(base_path_, method);
+	req.headers.emplace_back("Content-Type", "application/json; charset=utf-8");
+	if (compression_) {
+		req.headers.emplace_back("Accept-Encoding", "gzip, deflate");
 	}
-	return result.str();
+	req.body = json_stm.str();
+	req.timeout = timeout;
+	req.idempotent = IsIdempotent(method);
+	return http_loop_->Submit(::std::move(req));
 }
 
-bool TelegramBot::CallbackData::Parse(::std::string_view s)
+p_dyn::Var TelegramBot::Receive(::std::future<HttpLoop::Response>& res_ft)
 {
-	::std::regex const re{
-		"([0-9]+).([0-9]+).([0-9]+)," // date
-			"([0-9]+)," // gap
-			"([\\-+]?[0-9]+)," // mode
-			"([0-9]+)," // n_cols
-			"([0-9]+)," // key.type,
-			"(.*)" // key.data,
-	};
-	::std::match_results<::std::string_view::const_iterator> match{};
+	auto span = Tracer::Span{"Receive"};
+	auto resp = HttpLoop::Response{};
+	{
+		auto span = Tracer::Span{"Receive.wait"};
+		resp = res_ft.get();
+	}
+	metrics_.Add("api.bytes_received", resp.body.size());
+	try {
+		auto const* encoding = resp.Header("Content-Encoding");
+		if (!encoding || resp.HeaderIs("Content-Encoding", "identity")) {
+			metrics_.Add("api.bytes_decoded", resp.body.size());
+			return p_json::Parser{}.parse(resp.body);
+		}
+		auto type = p::InflatingStreamBuf::STREAM_GZIP;
+		if (resp.HeaderIs("Content-Encoding", "deflate")) {
+			type = p::InflatingStreamBuf::STREAM_ZLIB;
+		} else if (!resp.HeaderIs("Content-Encoding", "gzip")) {
+			throw ApiError{"unsupported content encoding " + *encoding};
+		}
+		// inflated straight from the body into the parser, never held whole
+		p::MemoryInputStream body_stm{resp.body.data(), static_cast<::std::streamsize>(resp.body.size())};
+		p::InflatingInputStream inflate_stm{body_stm, type};
+		p::CountingInputStream count_stm{inflate_stm};
+		auto result = p_json::Parser{}.parse(count_stm);
+		metrics_.Add("api.bytes_decoded", count_stm.chars());
+		metrics_.Add("api.compressed");
+		return result;
+	} catch (p::Exception const&) {
+		// proxies in front of the API answer errors with HTML
+		if (resp.status != 200) {
+			auto error = ApiError{"HTTP " + ::std::to_string(resp.status) + " " + resp.reason};
+			error.error_code = resp.status;
+			throw error;
+		}
+		throw;
+	}
+}
+
+p_dyn::Var TelegramBot::GenerateKeyboard(Keyboard const& kb, ChatId user_id)
+{
+	auto span = Tracer::Span{"GenerateKeyboard"};
+	auto const* ud = user_data_.Find(user_id);
+	auto grid = kb.GenerateGrid(&arena_);
+	auto days = ::std::pmr::vector<Calendar::DayView>(grid.size(), &arena_);
+	for (::std::size_t i = 0; i < grid.size(); ++i) {
+		auto const& [date, is_gap] = grid[i];
+		if (is_gap) {
+			continue;
+		}
+		// in EDIT mode the user's own mark shows instead of a count
+		if (auto idate = date_cache_.find(date); idate != date_cache_.end()) {
+			days[i].count = idate->second.count;
+			if (kb.mode == Keyboard::Mode::EDIT) {
+				days[i].count -= idate->second.users.count(user_id);
+			}
+		}
+		if (kb.mode == Keyboard::Mode::EDIT) {
+			days[i].selected = ud &&
+				ud->selection.Get(date.DayNumber()) == Selection::Mark::ADD;
+		}
+	}
+	return Calendar::RenderKeyboard(kb, grid, days, Date::From(Today()));
+}
 
-	if (!::std::regex_match(s.cbegin(), s.cend(), match, re)) {
-		::std::cerr << "invalid callback data: " << s << ::std::endl;
+bool TelegramBot::Selection::Set(int day, Mark mark)
+{
+	auto* chunk = Reserve(day);
+	if (!chunk) {
 		return false;
 	}
+	auto bit = ::std::uint64_t{1} << ((day - anchor) % CHUNK_DAYS);
+	chunk->add &= ~bit;
+	chunk->remove &= ~bit;
+	if (mark == Mark::ADD) {
+		chunk->add |= bit;
+	} else if (mark == Mark::REMOVE) {
+		chunk->remove |= bit;
+	}
+	return true;
+}
 
-	kb.first_date.first.year = ::std::stoi(match[1]);
-	kb.first_date.first.month = ::std::stoi(match[2]);
-	kb.first_date.first.day = ::std::stoi(match[3]);
-	kb.first_date.second = static_cast<bool>(::std::stoi(match[4]));
-	kb.mode = static_cast<Keyboard::Mode>(::std::stoi(match[5]));
-	kb.n_cols = ::std::stoi(match[6]);
+bool TelegramBot::Selection::Toggle(int day)
+{
+	return Set(day, Get(day) == Mark::ADD ? Mark::REMOVE : Mark::ADD);
+}
 
-	key.type = static_cast<Key::Type>(::std::stoi(match[7]));
-	auto& key_data = match[8];
-	if (key.type == Key::Type::DAY) {
-		::std::regex const re { "([0-9]+).([0-9]+).([0-9]+)" };
-		::std::match_results<::std::string_view::const_iterator> match{};
-		if (!::std::regex_match(key_data.first, key_data.second, match, re)) {
-			::std::cerr << "invalid callback key data: " << s << ::std::endl;
-			return false;
+// Null if covering the day would take more than MAX_CHUNKS.
+TelegramBot::Selection::Chunk* TelegramBot::Selection::Reserve(int day)
+{
+	auto floor_div = [](int a, int b) { return a / b - (a % b < 0 ? 1 : 0); };
+	auto first = floor_div(day, CHUNK_DAYS) * CHUNK_DAYS;
+	if (chunks.empty()) {
+		anchor = first;
+		chunks.resize(1);
+	} else if (first < anchor) {
+		auto n = static_cast<::std::size_t>((anchor - first) / CHUNK_DAYS);
+		if (n + chunks.size() > MAX_CHUNKS) {
+			return nullptr;
+		}
+		chunks.insert(chunks.begin(), n, Chunk{});
+		anchor = first;
+	} else if (auto n = static_cast<::std::size_t>((first - anchor) / CHUNK_DAYS); n >= chunks.size()) {
+		if (n >= MAX_CHUNKS) {
+			return nullptr;
 		}
-		key.data.date.year = ::std::stoi(match[1]);
-		key.data.date.month = ::std::stoi(match[2]);
-		key.data.date.day = ::std::stoi(match[3]);
+		chunks.resize(n + 1);
 	}
-
-	return true;
+	return &chunks[(day - anchor) / CHUNK_DAYS];
 }
 
 // vim: set ts=4 sw=4 noet :
@@ -1,29 +1,30 @@
 #pragma once
 
 #include <array>
+#include <chrono>
 #include <ctime>
+#include <future>
 #include <iostream>
 #include <iterator>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <string_view>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
-#include <Poco/Data/MySQL/Connector.h>
-#include <Poco/Data/Session.h>
 #include <Poco/Dynamic/Var.h>
 #include <Poco/Exception.h>
+#include <Poco/JSON/Array.h>
 #include <Poco/JSON/JSON.h>
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
 #include <Poco/JSON/Stringifier.h>
 #include <Poco/Net/AcceptCertificateHandler.h>
 #include <Poco/Net/Context.h>
-#include <Poco/Net/HTTPMessage.h>
-#include <Poco/Net/HTTPRequest.h>
-#include <Poco/Net/HTTPResponse.h>
-#include <Poco/Net/HTTPSClientSession.h>
 #include <Poco/Net/HTTPSStreamFactory.h>
 #include <Poco/Net/InvalidCertificateHandler.h>
 #include <Poco/Net/SSLManager.h>
@@ -31,12 +32,25 @@
 #include <Poco/URI.h>
 #include <Poco/URIStreamOpener.h>
 
+#include "attendance_cache.hh"
+#include "attendance_journal.hh"
+#include "broadcaster.hh"
+#include "calendar.hh"
+#include "http_loop.hh"
+#include "lru_cache.hh"
+#include "metrics.hh"
+#include "rate_limiter.hh"
+#include "retry_engine.hh"
+#include "scheduler.hh"
+#include "shard.hh"
+#include "storage.hh"
+
 class TelegramBot {
 public:
 	using Error = bool;
 	static Error NoError() noexcept { return Error{false}; }
 
-	explicit TelegramBot(Error& error) noexcept;
+	TelegramBot(::std::string const& conf_path, Error& error) noexcept;
 	template<typename T, ::std::enable_if_t<noexcept(::std::declval<T>()()), bool> = true>
 		void Run(T stop, Error& error) noexcept;
 
@@ -45,148 +59,279 @@ public:
 
 private:
 	static constexpr char const* API_URL = "https://api.telegram.org";
-	static constexpr char const* EMOJI_NUMBERS[] = {
-		"0️⃣", "1️⃣", "2️⃣", "3️⃣", "4️⃣", "5️⃣", "6️⃣", "7️⃣", "8️⃣", "9️⃣", "🔟"};
-	static constexpr char const* DAY_NAMES[] = {"ПН", "ВТ", "СР", "ЧТ", "ПТ", "СБ", "ВС"};
-	static constexpr char const* MONTH_NAMES[] = {
-			"Январь", "Февраль", "Март", "Апрель", "Май", "Июнь",
-			"Июль", "Август", "Сентябрь", "Октябрь", "Ноябрь", "Декабрь"};
-	static constexpr int DAYS_PER_WEEK = 7;
+	// safe to repeat after a timeout or a 5xx, when the first try may
+	// or may not have taken effect
+	static constexpr ::std::string_view IDEMPOTENT_METHODS[] = {
+			"getUpdates", "getMe", "getChat", "answerCallbackQuery",
+			"editMessageText", "editMessageReplyMarkup", "deleteMessage"};
 
 	using ChatId = ::std::int64_t; // 52 bits at most
 	using MessageId = ChatId;
 	using CallbackQueryId = ::std::string;
 	using DateId = ::std::string;
+	using MessageKey = ::std::pair<ChatId, MessageId>;
+	using Date = Calendar::Date;
+	using Keyboard = Calendar::Keyboard;
+	using Key = Calendar::Key;
+	using CallbackData = Calendar::CallbackData;
+
+	// What this process does with updates: poll and handle them alone,
+	// poll and forward them to workers, or handle what a frontend forwards.
+	enum class Role {
+		STANDALONE, FRONTEND, WORKER
+	};
 
-	struct Date {
-		int year{};
-		int month{};
-		int day{};
+	struct MessageKeyHash {
+		::std::size_t operator()(MessageKey const& key) const noexcept {
+			return ::std::hash<ChatId>{}(key.first) * 31 + ::std::hash<MessageId>{}(key.second);
+		}
+	};
 
-		struct Hash {
-			::std::size_t operator()(Date const& x) const;
-		};
-		bool operator<(Date const& rhs) const;
-		bool operator==(Date const& rhs) const;
+	// An unsuccessful Bot API response.
+	struct ApiError : ::std::runtime_error {
+		int error_code{};
+		::std::chrono::seconds retry_after{};
+		ChatId migrate_to_chat_id{};
 
-		static Date From(::std::string_view s);
-		static Date From(::std::tm const& tm);
-		static Date From(::Poco::Data::Date const& pd);
-		template<typename T> T To() const;
+		using ::std::runtime_error::runtime_error;
 	};
 
-	struct Keyboard {
-		::std::pair<Date, bool> first_date{}; // date,is_gap
-		enum class Mode {
-			VIEW, EDIT
-		} mode{Mode::VIEW};
-		int n_cols{4};
+	struct User {
+		ChatId user_id {};
+		::std::string first_name{};
+		::std::string last_name{};
+		::std::string username{};
+	};
 
-		Keyboard() = default;
-		explicit Keyboard(Date const& date);
+	// Days toggled in EDIT mode, kept as a pair of add/remove bitsets over
+	// day numbers. The bitsets start at a chunk-aligned anchor and grow a
+	// chunk at a time in either direction as the user pages.
+	struct Selection {
+		static constexpr int CHUNK_DAYS = 64;
+		// about eleven years; the days come from callback data
+		static constexpr ::std::size_t MAX_CHUNKS = 64;
 
-		void SetCenter(Date const& date);
-		void MoveMonth(int shift);
-		void MoveWeek(int shift);
-		void ToStartOfWeek();
+		enum class Mark {
+			NONE, ADD, REMOVE
+		};
 
-		Date const& FirstDate() const { return first_date.first; };
-		Date LastDate() const;
+		struct Chunk {
+			::std::uint64_t add{};
+			::std::uint64_t remove{};
+		};
 
-		Mode GetMode() const { return mode; }
-		void SetMode(Mode m) { mode = m; }
+		int anchor{};
+		::std::vector<Chunk> chunks{};
 
-		::std::vector<::std::pair<Date, bool>> GenerateGrid() const;
+		Mark Get(int day) const;
+		// false if the day is too far from the others to be kept
+		bool Set(int day, Mark mark);
+		bool Toggle(int day);
+		template<typename F> void ForEach(F f) const; // f(day, remove)
 
 	private:
-		void Advance(bool back = false);
+		Chunk* Reserve(int day);
 	};
 
-	struct Key {
-		enum class Type : int {
-			EMPTY, CLOSE, EDIT, CANCEL, SAVE,
-			NEXT_W, PREV_W, NEXT_M, PREV_M, TODAY, MONTH, DAY
-		} type{Type::EMPTY};
-		union Data {
-			Date date{};
-			int index;
-		} data{};
+	struct UserData {
+		Selection selection{};
 	};
 
-	struct CallbackData {
-		Keyboard kb{};
-		Key key{};
+	// A daily reminder armed in the scheduler. Rearming or replacing it
+	// takes a new sequence number, so a run that lost the race with a
+	// reload or a /remind can tell it is stale.
+	struct ReminderJob {
+		int minute{};
+		::std::uint64_t seq{};
+		Scheduler::Id job{};
+	};
 
-		static ::std::string Serialize(Keyboard const& kb);
-		static ::std::string Serialize(::std::string_view kb, Key const& key);
-		bool Parse(::std::string_view s);
+	// Who attends tomorrow as of one minute, shared by every reminder due
+	// in it.
+	struct ReminderMembers {
+		int day{};
+		::std::int64_t minute{-1};
+		::std::shared_ptr<::std::unordered_set<ChatId> const> users{};
 	};
 
-	struct User {
-		ChatId user_id {};
-		::std::string first_name{};
-		::std::string last_name{};
-		::std::string username{};
+	// Attendance of one day of the window. VIEW pages need only the count;
+	// who attends is fetched when a day's list is opened or in EDIT mode.
+	struct DayAttendance {
+		::std::size_t count{};
+		bool loaded{}; // users is complete
+		::std::unordered_set<ChatId> users{};
 	};
 
-	struct UserData {
-		::std::unordered_map<Date, bool, Date::Hash> selection{}; // date,delete
+	// Snapshot contents, read off the update loop at startup.
+	struct Restored {
+		::std::uint64_t update_id{};
+		::std::vector<User> users{};
+		::std::vector<::std::pair<ChatId, UserData>> sessions{};
+		int window_first{};
+		int window_last{};
+		::std::map<Date, DayAttendance> dates{};
 	};
 
 	::std::string api_token_{};
-	::std::string db_host_{};
-	::std::string db_port_{};
-	::std::string db_user_{};
-	::std::string db_password_{};
-	::std::string db_database_{};
 
 	::std::string base_path_{};
+	::std::string api_host_{};
+	::std::uint16_t api_port_{};
+	::std::chrono::milliseconds api_timeout_{};
+	int poll_timeout_{};
+	bool compression_{};
+	// the last update handled; the next poll confirms it and those before
 	::std::size_t last_update_id_{};
-
-	::std::map<Date, ::std::unordered_map<ChatId, bool>> date_cache_{};
-
-	::std::unordered_map<ChatId, UserData> user_data_{};
-	::std::unordered_map<ChatId, User> user_cache_{};
+	Role role_{Role::STANDALONE};
+
+	::std::unique_ptr<Shard::Ring> shard_ring_{};
+	::std::unique_ptr<Shard::Forwarder> shard_forwarder_{};
+	::std::unique_ptr<Shard::Receiver> shard_receiver_{};
+
+	// The days last read by ReadDataBase; days without anyone attending
+	// have no entry.
+	int window_first_{1};
+	int window_last_{0};
+	Keyboard::Mode window_mode_{Keyboard::Mode::VIEW};
+	// Other workers write the same database, so a sharded window is
+	// reread once older than this; zero keeps it until it moves.
+	::std::chrono::milliseconds window_ttl_{};
+	::std::chrono::steady_clock::time_point window_read_{};
+	// stamps of the window's months in the shared cache when it was read
+	::std::optional<AttendanceCache::Versions> window_versions_{};
+	::std::map<Date, DayAttendance> date_cache_{};
+
+	// Only users in EDIT mode have an entry; everyone else is idle.
+	LruCache<ChatId, UserData> user_data_{};
+	LruCache<ChatId, User> user_cache_{};
+	// hash of the inline keyboard each message currently shows
+	LruCache<MessageKey, ::std::size_t, MessageKeyHash> render_cache_{};
+
+	::std::chrono::seconds invite_ttl_{};
+	// Invites that were not found and, per user, how many such misses
+	// in a row; both turn away /start floods before they reach storage.
+	LruCache<::std::string, bool> invite_misses_{};
+	LruCache<ChatId, int> invite_failures_{};
+	int max_invite_failures_{};
+
+	Metrics metrics_{};
+	::std::chrono::seconds metrics_interval_{};
+	::std::chrono::steady_clock::time_point metrics_reported_{};
+
+	// Scratch memory for the update being processed, released after it.
+	::std::array<::std::byte, 4096> arena_buffer_{};
+	::std::pmr::monotonic_buffer_resource arena_{arena_buffer_.data(), arena_buffer_.size()};
+
+	::std::string snapshot_path_{};
+	::std::chrono::seconds snapshot_interval_{};
+	::std::chrono::steady_clock::time_point snapshot_saved_{};
+	// valid until the first poll is in flight and the caches are warmed
+	::std::future<::std::optional<Restored>> restored_{};
+	bool warmed_{};
+	::std::chrono::steady_clock::time_point started_{::std::chrono::steady_clock::now()};
+
+	::std::string trace_path_{};
+	::std::chrono::seconds trace_interval_{};
+	::std::chrono::steady_clock::time_point trace_dumped_{};
 
 	::Poco::Net::Context::Ptr context_{};
 	::Poco::Net::SSLManager::InvalidCertificateHandlerPtr cert_handler_{};
-	::std::unique_ptr<::Poco::Net::HTTPSClientSession> api_session_{};
-	::std::unique_ptr<::Poco::Data::Session> db_session_{};
+	::std::unique_ptr<HttpLoop> http_loop_{};
+	::std::unique_ptr<RetryEngine> retry_{};
+	::std::unique_ptr<Storage> storage_{};
+	::std::unique_ptr<AttendanceCache> attendance_cache_{};
+	::std::unique_ptr<AttendanceJournal> journal_{};
+	::std::unordered_set<ChatId> broadcast_admins_{};
+	bool send_reminders_{};
+	::std::chrono::minutes reminder_offset_{}; // local time zone of reminders
+	::std::mutex reminders_mutex_{};
+	::std::unordered_map<ChatId, ReminderJob> reminders_{};
+	::std::uint64_t reminder_seq_{};
+	::std::mutex reminder_members_mutex_{};
+	ReminderMembers reminder_members_{};
+	// paces broadcasts and reminders together
+	::std::unique_ptr<RateLimiter> send_limiter_{};
+	// declared last so they stop before what they use
+	::std::unique_ptr<Broadcaster> broadcaster_{};
+	::std::unique_ptr<Scheduler> scheduler_{};
 
 	::std::size_t error_seq_count_{};
 
 	void HandleCommandCamera(ChatId user_id);
 	void HandleCommandSensor(ChatId user_id);
 	void HandleCommandUsers(ChatId user_id);
+	void HandleCommandStats(ChatId user_id, ::std::string const& args);
+	void HandleCommandBroadcast(ChatId user_id, ::std::string const& args);
+	void ReportBroadcasts();
+	bool RedeemInvite(ChatId user_id, ::std::string const& invite);
+	void PurgeInvites(::std::size_t batch);
+	void HandleCommandRemind(ChatId user_id, ::std::string const& args);
+	void ReloadReminders();
+	void ArmReminder(ChatId user_id, int minute);
+	void DisarmReminder(ChatId user_id);
+	void SendReminder(ChatId user_id, ::std::uint64_t seq);
+	::std::shared_ptr<::std::unordered_set<ChatId> const> ReadReminderMembers(int day);
+	int LocalDay() const;
+	::std::chrono::seconds UntilMinute(int minute) const;
+	Broadcaster::Result CheckBroadcast(::std::future<HttpLoop::Response>& res_ft);
 	::std::vector<User> GetRegisteredUsers();
 	void OnUpdateSucceed(Error& error) noexcept;
 	void OnUpdateFailed(Error& error) noexcept;
-	bool IsUserRegistered(ChatId user_id) const;
-	void RegisterUser(ChatId user_id) const;
-	bool PopInvite(::std::string const& invite, ChatId& user_id) const;
-	void PushInvite(::std::string const& invite, ChatId user_id) const;
-	void UpdateDataBase();
-	void ReadDataBase(Date const& first_date, Date const& last_date);
-	User const& GetUserCaching(ChatId user_id);
-	auto RecacheUser(ChatId user_id) -> decltype(user_cache_)::iterator;
+	void UpdateDataBase(::std::vector<AttendanceJournal::Entry> const& batch);
+	void ReadDataBase(Date const& first_date, Date const& last_date, Keyboard::Mode mode);
+	DayAttendance& WindowDay(Date const& date);
+	::std::unordered_set<ChatId> ReadMembers(int day);
+	::std::vector<::std::pair<int, ::std::size_t>> CountAttendances(int first_day, int last_day);
+	::std::vector<AttendanceJournal::Entry> PendingChanges(int first_day, int last_day) const;
+	bool InWindow(int day) const { return window_first_ <= day && day <= window_last_; }
+	bool WindowCovers(Keyboard const& kb) const;
+	User GetUserCaching(ChatId user_id);
+	User const& RecacheUser(ChatId user_id);
+	void PrefetchUsers(::std::vector<ChatId> const& user_ids);
 	void DiscardSelection(ChatId user_id);
 	void LoadSelection(ChatId user_id, Date const& from, Date const& to);
 	void StoreSelection(ChatId user_id);
 	::Poco::Dynamic::Var GenerateKeyboard(Keyboard const& kb, ChatId user_id);
+	void EditKeyboard(ChatId chat_id, MessageId msg_id, ::Poco::Dynamic::Var const& kb_dv);
 	bool ParseCallbackData(::std::string_view data_str, CallbackData& data);
-	void ProcessCallbackQuery(::Poco::Dynamic::Var const& callback_query_dv);
+	void AnswerCallbackQuery(CallbackQueryId const& cq_id, ::std::string const& text = {},
+			bool alert = false);
+	::std::string DescribeDay(Date const& date);
+	void ProcessCallbackQueries(::std::pmr::vector<::Poco::Dynamic::Var> const& cqs);
 	void ProcessMessage(::Poco::Dynamic::Var const& message_dv);
-	void ProcessUpdate(::Poco::JSON::Object::Ptr update);
-	void Send(::std::string_view method, ::Poco::Dynamic::Var const& json);
-	::Poco::Dynamic::Var Receive();
+	void ProcessUpdates(::std::vector<::Poco::JSON::Object::Ptr> const& updates);
+	::std::future<HttpLoop::Response> Send(::std::string_view method, ::Poco::Dynamic::Var const& json,
+			::std::chrono::milliseconds timeout);
+	::Poco::Dynamic::Var Receive(::std::future<HttpLoop::Response>& res_ft);
 	::Poco::Dynamic::Var SendMessage(::std::string_view method, ::Poco::Dynamic::Var const& req);
+	// SendMessage with a timeout of its own and, optionally, the first
+	// attempt already admitted and in flight.
+	::Poco::Dynamic::Var Call(::std::string_view method, ::Poco::Dynamic::Var const& req,
+			::std::chrono::milliseconds timeout, ::std::future<HttpLoop::Response> res_ft);
+	::Poco::JSON::Object::Ptr PollRequest() const;
 	::std::string GetListOfCommads() const;
 
+	::Poco::JSON::Array::Ptr ReceivePolled();
+	::Poco::JSON::Array::Ptr ReceiveForwarded();
+	void ForwardUpdates(::Poco::JSON::Array::Ptr const& updates);
+	void DispatchUpdates(::Poco::JSON::Array::Ptr const& updates);
 	void HandleUpdates(Error& error) noexcept;
+	void Maintain() noexcept;
+	void SaveSnapshot() noexcept;
+	static ::std::optional<Restored> LoadSnapshot(::std::string const& path) noexcept;
+	void WarmUp(::std::optional<Restored> restored) noexcept;
 
 	static ::std::string GenerateToken();
 	static ::std::string GenerateInviteToken();
-	static ::std::string UnderlineUtf8String(::std::string const& s);
+	static bool IsInviteToken(::std::string_view s);
+	static User ParseChat(ChatId user_id, ::Poco::Dynamic::Var const& chat_dv);
+	static ::std::size_t UserCost(User const& user);
+	static ::std::string DisplayName(User const& user);
+	static ::std::size_t UserDataCost(UserData const& ud);
+	static ::Poco::Dynamic::Var Unwrap(::Poco::Dynamic::Var const& resp_dv);
+	static bool IsIdempotent(::std::string_view method);
+	static ::std::size_t KeyboardHash(::Poco::Dynamic::Var const& kb_dv);
+	static ChatId UpdateChatId(::Poco::JSON::Object::Ptr const& update);
 
 	static ::std::tm Today() {
 		::std::time_t now = ::std::time(nullptr);
@@ -203,10 +348,6 @@ private:
 	}
 };
 
-template<> ::std::string TelegramBot::Date::To() const;
-template<> ::std::tm TelegramBot::Date::To() const;
-template<> ::Poco::Data::Date TelegramBot::Date::To() const;
-
 template<typename T, ::std::enable_if_t<noexcept(::std::declval<T>()()), bool>>
 	inline void TelegramBot::Run(T stop, Error& error) noexcept
 {
@@ -217,27 +358,41 @@ template<typename T, ::std::enable_if_t<noexcept(::std::declval<T>()()), bool>>
 			error = err;
 			break;
 		}
+		Maintain();
 	}
+	SaveSnapshot();
 	return;
 }
 
-inline bool TelegramBot::Date::operator==(Date const& rhs) const
+inline TelegramBot::Selection::Mark TelegramBot::Selection::Get(int day) const
 {
-	return (year == rhs.year) && (month == rhs.month) && (day == rhs.day);
-}
-
-inline bool TelegramBot::Date::operator<(Date const& rhs) const
-{
-	return (year < rhs.year) ||
-		(year == rhs.year && ((month < rhs.month) ||
-			(month == rhs.month && day < rhs.day)));
+	auto offset = day - anchor;
+	if (offset < 0 || offset >= static_cast<int>(chunks.size()) * CHUNK_DAYS) {
+		return Mark::NONE;
+	}
+	auto const& chunk = chunks[offset / CHUNK_DAYS];
+	auto bit = ::std::uint64_t{1} << (offset % CHUNK_DAYS);
+	if (chunk.add & bit) {
+		return Mark::ADD;
+	}
+	if (chunk.remove & bit) {
+		return Mark::REMOVE;
+	}
+	return Mark::NONE;
 }
 
-inline ::std::size_t TelegramBot::Date::Hash::operator()(Date const& x) const
+template<typename F>
+	inline void TelegramBot::Selection::ForEach(F f) const
 {
-	return ::std::hash<int>()(x.year) ^
-		(::std::hash<int>()(x.month) << 1) ^
-		(::std::hash<int>()(x.day) >> 1);
+	for (::std::size_t i = 0; i < chunks.size(); ++i) {
+		auto base = anchor + static_cast<int>(i) * CHUNK_DAYS;
+		for (auto bits = chunks[i].add; bits; bits &= bits - 1) {
+			f(base + __builtin_ctzll(bits), false);
+		}
+		for (auto bits = chunks[i].remove; bits; bits &= bits - 1) {
+			f(base + __builtin_ctzll(bits), true);
+		}
+	}
 }
 
 // vim: set ts=4 sw=4 noet :
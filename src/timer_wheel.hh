@@ -0,0 +1,174 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS slots, each slot of a
+// level spanning a whole turn of the level below. A timer goes into the
+// coarsest level it fits and moves down a level each time the wheel
+// below completes a turn, reaching level 0 during its last turn. Adding
+// and cancelling are O(1); advancing costs a slot per tick plus the
+// timers it moves. Timers are nodes in a pool linked into their slots,
+// so pending timers cost no allocation once the pool has grown.
+//
+// Time is counted in ticks; what a tick is belongs to the caller. Not
+// thread-safe.
+template<typename T>
+class TimerWheel {
+public:
+	// index and generation of the node, never 0
+	using Id = ::std::uint64_t;
+
+	static constexpr int BITS = 6;
+	static constexpr int SLOTS = 1 << BITS;
+	static constexpr int LEVELS = 4;
+	// the longest delay a timer is placed for directly; longer ones wait
+	// at the top level and are placed again
+	static constexpr ::std::uint64_t SPAN = ::std::uint64_t{1} << (BITS * LEVELS);
+
+	TimerWheel()
+	{
+		heads_.fill(NIL);
+	}
+
+	::std::uint64_t Now() const { return now_; }
+	::std::size_t Size() const { return size_; }
+
+	// Fires value after ticks, at least 1.
+	Id Add(::std::uint64_t ticks, T value)
+	{
+		auto index = NIL;
+		if (!free_.empty()) {
+			index = free_.back();
+			free_.pop_back();
+		} else {
+			index = static_cast<::std::uint32_t>(nodes_.size());
+			nodes_.emplace_back();
+		}
+		auto& node = nodes_[index];
+		node.expiry = now_ + (ticks ? ticks : 1);
+		node.value = ::std::move(value);
+		Link(index);
+		++size_;
+		return (::std::uint64_t{node.generation} << 32) | index;
+	}
+
+	// False if the timer has fired or was cancelled already.
+	bool Cancel(Id id)
+	{
+		auto index = static_cast<::std::uint32_t>(id);
+		if (index >= nodes_.size() || nodes_[index].generation != id >> 32
+				|| nodes_[index].slot == NIL) {
+			return false;
+		}
+		Unlink(index);
+		Free(index);
+		return true;
+	}
+
+	// Moves time on and appends the values of the timers that came due,
+	// in the order they expired.
+	void Advance(::std::uint64_t ticks, ::std::vector<T>& due)
+	{
+		for (; ticks && size_; --ticks) {
+			++now_;
+			for (int level = 1; level < LEVELS; ++level) {
+				if (now_ & ((::std::uint64_t{1} << (BITS * level)) - 1)) {
+					break;
+				}
+				Cascade(level * SLOTS + ((now_ >> (BITS * level)) & (SLOTS - 1)));
+			}
+			auto& head = heads_[now_ & (SLOTS - 1)];
+			while (head != NIL) {
+				auto index = head;
+				Unlink(index);
+				due.push_back(::std::move(nodes_[index].value));
+				Free(index);
+			}
+		}
+		now_ += ticks;
+	}
+
+private:
+	static constexpr auto NIL = ::std::numeric_limits<::std::uint32_t>::max();
+
+	struct Node {
+		::std::uint64_t expiry{};
+		::std::uint32_t prev{NIL};
+		::std::uint32_t next{NIL};
+		::std::uint32_t slot{NIL}; // NIL while free
+		::std::uint32_t generation{1};
+		T value{};
+	};
+
+	::std::vector<Node> nodes_{};
+	::std::vector<::std::uint32_t> free_{};
+	::std::array<::std::uint32_t, LEVELS * SLOTS> heads_{};
+	::std::uint64_t now_{};
+	::std::size_t size_{};
+
+	void Link(::std::uint32_t index)
+	{
+		auto& node = nodes_[index];
+		auto delta = node.expiry > now_ ? node.expiry - now_ : 0;
+		auto slot = ::std::uint32_t{};
+		if (delta >= SPAN) {
+			// comes round again within SPAN ticks, before it is due
+			slot = (LEVELS - 1) * SLOTS + ((now_ >> (BITS * (LEVELS - 1))) & (SLOTS - 1));
+		} else {
+			auto level = 0;
+			while (delta >= (::std::uint64_t{1} << (BITS * (level + 1)))) {
+				++level;
+			}
+			slot = level * SLOTS + ((node.expiry >> (BITS * level)) & (SLOTS - 1));
+		}
+		node.slot = slot;
+		node.prev = NIL;
+		node.next = heads_[slot];
+		if (node.next != NIL) {
+			nodes_[node.next].prev = index;
+		}
+		heads_[slot] = index;
+	}
+
+	void Unlink(::std::uint32_t index)
+	{
+		auto& node = nodes_[index];
+		if (node.prev != NIL) {
+			nodes_[node.prev].next = node.next;
+		} else {
+			heads_[node.slot] = node.next;
+		}
+		if (node.next != NIL) {
+			nodes_[node.next].prev = node.prev;
+		}
+	}
+
+	void Free(::std::uint32_t index)
+	{
+		auto& node = nodes_[index];
+		node.slot = NIL;
+		node.value = T{};
+		++node.generation;
+		free_.push_back(index);
+		--size_;
+	}
+
+	// Places the slot's timers again, now that they are closer.
+	void Cascade(::std::uint32_t slot)
+	{
+		auto index = heads_[slot];
+		heads_[slot] = NIL;
+		while (index != NIL) {
+			auto next = nodes_[index].next;
+			Link(index);
+			index = next;
+		}
+	}
+};
+
+// vim: set ts=4 sw=4 noet :
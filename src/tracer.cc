@@ -0,0 +1,172 @@
+#include "tracer.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "logger.hh"
+
+namespace {
+
+struct Event {
+	char const* name{};
+	::std::int64_t ts{}; // us since the tracer epoch
+	::std::int64_t dur{};
+};
+
+// Written by its thread, read by Dump(); the lock is uncontended except
+// while a dump copies it out.
+struct Buffer {
+	::std::mutex mutex{};
+	::std::vector<Event> events{};
+	::std::size_t next{};
+	int tid{};
+};
+
+Tracer::Clock::time_point const g_epoch = Tracer::Clock::now();
+::std::atomic<double> g_sample_rate{0};
+::std::size_t g_capacity{4096};
+::std::atomic<bool> g_dump_requested{false};
+
+::std::mutex g_buffers_mutex{};
+::std::vector<::std::shared_ptr<Buffer>> g_buffers{};
+
+thread_local bool t_sampled{};
+thread_local ::std::shared_ptr<Buffer> t_buffer{};
+
+Buffer& ThreadBuffer()
+{
+	if (!t_buffer) {
+		t_buffer = ::std::make_shared<Buffer>();
+		t_buffer->events.reserve(g_capacity);
+		auto lock = ::std::lock_guard{g_buffers_mutex};
+		t_buffer->tid = static_cast<int>(g_buffers.size()) + 1;
+		g_buffers.push_back(t_buffer);
+	}
+	return *t_buffer;
+}
+
+::std::int64_t Micros(Tracer::Clock::duration d)
+{
+	return ::std::chrono::duration_cast<::std::chrono::microseconds>(d).count();
+}
+
+bool Sample()
+{
+	auto rate = g_sample_rate.load(::std::memory_order_relaxed);
+	if (rate <= 0) {
+		return false;
+	}
+	thread_local auto prng = ::std::minstd_rand{::std::random_device{}()};
+	return ::std::uniform_real_distribution<double>{}(prng) < rate;
+}
+
+} // namespace
+
+Tracer::Span::Span(char const* name) noexcept
+{
+	if (t_sampled) {
+		name_ = name;
+		start_ = Clock::now();
+	}
+}
+
+Tracer::Span::~Span()
+{
+	if (!name_) {
+		return;
+	}
+	auto end = Clock::now();
+	auto& buf = ThreadBuffer();
+	auto event = Event{name_, Micros(start_ - g_epoch), Micros(end - start_)};
+	auto lock = ::std::lock_guard{buf.mutex};
+	if (buf.events.size() < g_capacity) {
+		buf.events.push_back(event);
+	} else {
+		buf.events[buf.next] = event;
+	}
+	buf.next = (buf.next + 1) % g_capacity;
+}
+
+Tracer::Update::Update() noexcept
+	: sampled_{t_sampled = Sample()}
+	, span_{"update"}
+{
+}
+
+Tracer::Update::~Update()
+{
+	// span_ still records: it made its decision when it was constructed
+	if (sampled_) {
+		t_sampled = false;
+	}
+}
+
+void Tracer::Configure(double sample_rate, ::std::size_t capacity)
+{
+	g_sample_rate = sample_rate;
+	g_capacity = capacity ? capacity : 1;
+}
+
+bool Tracer::Enabled()
+{
+	return g_sample_rate.load(::std::memory_order_relaxed) > 0;
+}
+
+bool Tracer::Dump(::std::string const& path)
+{
+	auto buffers = decltype(g_buffers){};
+	{
+		auto lock = ::std::lock_guard{g_buffers_mutex};
+		buffers = g_buffers;
+	}
+	auto tmp_path = path + ".tmp";
+	auto n_events = ::std::size_t{};
+	{
+		auto out = ::std::ofstream{tmp_path, ::std::ios::trunc};
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		auto first = true;
+		for (auto const& buf : buffers) {
+			auto events = ::std::vector<Event>{};
+			{
+				auto lock = ::std::lock_guard{buf->mutex};
+				events = buf->events;
+			}
+			for (auto const& ev : events) {
+				out << (first ? "\n" : ",\n") << "{\"name\":\"" << ev.name
+					<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buf->tid
+					<< ",\"ts\":" << ev.ts << ",\"dur\":" << ev.dur << "}";
+				first = false;
+			}
+			n_events += events.size();
+		}
+		out << "\n]}\n";
+		if (!out.flush()) {
+			Logger::Error("tracer", "write failed")("path", tmp_path);
+			return false;
+		}
+	}
+	if (::std::rename(tmp_path.c_str(), path.c_str()) < 0) {
+		Logger::Error("tracer", "rename failed")("path", path);
+		return false;
+	}
+	Logger::Info("tracer", "dumped")("path", path)("events", n_events);
+	return true;
+}
+
+void Tracer::RequestDump()
+{
+	g_dump_requested.store(true, ::std::memory_order_relaxed);
+}
+
+bool Tracer::TakeDumpRequest()
+{
+	return g_dump_requested.exchange(false, ::std::memory_order_relaxed);
+}
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// Sampled scoped spans for the update path, kept per thread in rings of
+// the most recent events and written out as Chrome trace-event JSON (open
+// in chrome://tracing or ui.perfetto.dev). Unless its update was picked by
+// the sample rate, a span costs a thread-local check and nothing else.
+//
+//	auto update = Tracer::Update{};
+//	...
+//	auto span = Tracer::Span{"ReadDataBase"};
+class Tracer {
+public:
+	using Clock = ::std::chrono::steady_clock;
+
+	class Span {
+	public:
+		// name must outlive the tracer; string literals only
+		explicit Span(char const* name) noexcept;
+		~Span();
+		Span(Span const&) = delete;
+		Span& operator=(Span const&) = delete;
+
+	private:
+		char const* name_{};
+		Clock::time_point start_{};
+	};
+
+	// Scopes one update: decides whether spans on this thread are sampled
+	// until it ends, and records the update itself as the outer span.
+	class Update {
+	public:
+		Update() noexcept;
+		~Update();
+		Update(Update const&) = delete;
+		Update& operator=(Update const&) = delete;
+
+	private:
+		bool sampled_{};
+		Span span_;
+	};
+
+	// Call before any thread records; rate is the sampled fraction of
+	// updates, capacity the events kept per thread.
+	static void Configure(double sample_rate, ::std::size_t capacity);
+	static bool Enabled();
+
+	// Writes everything buffered so far; the buffers are kept, so
+	// consecutive dumps overlap.
+	static bool Dump(::std::string const& path);
+	// async-signal-safe
+	static void RequestDump();
+	static bool TakeDumpRequest();
+};
+
+// vim: set ts=4 sw=4 noet :
@@ -0,0 +1,269 @@
+// Behaviour checks for the embedded storage engines: LogStorage and the
+// attendance journal. Each check works in a fresh temporary directory and
+// reopens the files the way a restart would.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "attendance_journal.hh"
+#include "log_storage.hh"
+#include "metrics.hh"
+
+// found by argument-dependent lookup, so outside the anonymous namespace
+static bool operator==(Storage::Change const& a, Storage::Change const& b)
+{
+	return a.user_id == b.user_id && a.day == b.day && a.remove == b.remove;
+}
+
+namespace {
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			::std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+			::std::exit(1); \
+		} \
+	} while (false)
+
+using UserId = Storage::UserId;
+
+::std::string TempDir()
+{
+	char dir[] = "/tmp/telegram-bot-test.XXXXXX";
+	CHECK(::mkdtemp(dir));
+	return dir;
+}
+
+struct ::stat Stat(::std::string const& path)
+{
+	struct ::stat st{};
+	CHECK(::stat(path.c_str(), &st) == 0);
+	return st;
+}
+
+::std::string ReadFile(::std::string const& path)
+{
+	auto in = ::std::ifstream{path, ::std::ios::binary};
+	return {::std::istreambuf_iterator<char>{in}, {}};
+}
+
+void WriteFile(::std::string const& path, ::std::string const& data)
+{
+	auto out = ::std::ofstream{path, ::std::ios::binary | ::std::ios::trunc};
+	out.write(data.data(), data.size());
+	CHECK(out.good());
+}
+
+::std::string InviteName(int i)
+{
+	auto name = ::std::to_string(i);
+	return ::std::string(32 - name.size(), 'x') + name;
+}
+
+// Everything written comes back after a reopen.
+void TestLogReopen()
+{
+	auto path = TempDir() + "/log";
+	{
+		auto storage = LogStorage{path};
+		storage.RegisterUser(1);
+		storage.RegisterUser(2);
+		storage.PushInvite("hello", 1, ::std::chrono::hours{1});
+		storage.PushInvite("gone", 1, ::std::chrono::hours{1});
+		CHECK(storage.PopInvite("gone"));
+		storage.ApplyAttendances({{1, 100, false}, {2, 100, false}, {2, 101, false}, {2, 101, true}});
+		storage.SetReminder(1, 9 * 60);
+		storage.SetReminder(2, 10 * 60);
+		storage.DeleteReminder(2);
+		auto id = storage.CreateBroadcast(1, "news", {1, 2});
+		storage.RecordDeliveries(id, {{1, Storage::Delivery::SENT}, {2, Storage::Delivery::BLOCKED}});
+	}
+	auto storage = LogStorage{path};
+	CHECK(storage.IsUserRegistered(1));
+	CHECK(storage.IsUserRegistered(2));
+	CHECK(!storage.IsUserRegistered(3));
+	CHECK(storage.ReadAttendances(0, 1000) == (::std::vector<::std::pair<int, UserId>>{{100, 1}, {100, 2}}));
+	auto reminders = storage.ReadReminders();
+	CHECK(reminders.size() == 1 && reminders[0].user_id == 1 && reminders[0].minute == 9 * 60);
+	CHECK(storage.IsUserBlocked(2));
+	CHECK(storage.ReadUnfinishedBroadcasts().empty());
+	CHECK(!storage.PopInvite("gone"));
+	CHECK(storage.PopInvite("hello"));
+}
+
+// A corrupt last record is dropped, and the log stays writable after it.
+void TestLogCorruptTail()
+{
+	auto path = TempDir() + "/log";
+	{
+		auto storage = LogStorage{path};
+		storage.RegisterUser(1);
+		storage.RegisterUser(2);
+	}
+	// the last non-zero byte belongs to the last record
+	auto data = ReadFile(path);
+	auto last = data.find_last_not_of('\0');
+	CHECK(last != ::std::string::npos);
+	data[last] ^= 0x5a;
+	WriteFile(path, data);
+	{
+		auto storage = LogStorage{path};
+		CHECK(storage.IsUserRegistered(1));
+		CHECK(!storage.IsUserRegistered(2));
+		storage.RegisterUser(3);
+	}
+	auto storage = LogStorage{path};
+	CHECK(storage.IsUserRegistered(1));
+	CHECK(!storage.IsUserRegistered(2));
+	CHECK(storage.IsUserRegistered(3));
+}
+
+// Compaction starts exactly when dead records outnumber live ones, with
+// removals by unattend and by invite pop both counted, before and after a
+// reopen, and keeps the live state.
+void TestLogCompaction()
+{
+	// 60000 attendance records of 20 bytes are well past MIN_COMPACT_SIZE
+	constexpr auto ATTENDANCES = 60000;
+	constexpr auto INVITES = 1000;
+	constexpr auto UNATTENDS = 19500;
+	auto path = TempDir() + "/log";
+	auto storage = ::std::make_unique<LogStorage>(path);
+	storage->RegisterUser(7);
+	for (auto i = 0; i < INVITES; ++i) {
+		storage->PushInvite(InviteName(i), 7, ::std::chrono::hours{1});
+	}
+	auto batch = ::std::vector<Storage::Change>{};
+	for (auto i = 0; i < ATTENDANCES; ++i) {
+		batch.push_back({static_cast<UserId>(i % 100), i / 100, false});
+	}
+	storage->ApplyAttendances(batch);
+	batch.resize(UNATTENDS);
+	for (auto& change : batch) {
+		change.remove = true;
+	}
+	storage->ApplyAttendances(batch);
+
+	// live 1 + 1000 + 40500, dead 2 * 19500
+	auto inode = Stat(path).st_ino;
+	storage->Maintain();
+	CHECK(Stat(path).st_ino == inode);
+	storage.reset();
+	storage = ::std::make_unique<LogStorage>(path);
+	storage->Maintain();
+	CHECK(Stat(path).st_ino == inode);
+
+	// live 1 + 40500, dead 2 * 19500 + 2 * 1000
+	for (auto i = 0; i < INVITES; ++i) {
+		CHECK(storage->PopInvite(InviteName(i)));
+	}
+	storage->Maintain();
+	CHECK(Stat(path).st_ino != inode);
+
+	auto check = [&]() {
+		CHECK(storage->IsUserRegistered(7));
+		CHECK(!storage->PopInvite(InviteName(0)));
+		auto attendances = storage->ReadAttendances(0, ATTENDANCES);
+		CHECK(attendances.size() == ATTENDANCES - UNATTENDS);
+		CHECK(attendances.front() == (::std::pair<int, UserId>{UNATTENDS / 100, UNATTENDS % 100}));
+	};
+	check();
+	storage.reset();
+	storage = ::std::make_unique<LogStorage>(path);
+	check();
+	// what is left is all live
+	inode = Stat(path).st_ino;
+	storage->Maintain();
+	CHECK(Stat(path).st_ino == inode);
+}
+
+AttendanceJournal::Commit Failing()
+{
+	return [](auto const&) { throw ::std::runtime_error{"down"}; };
+}
+
+::std::vector<AttendanceJournal::Entry> Pending(AttendanceJournal const& journal)
+{
+	auto entries = ::std::vector<AttendanceJournal::Entry>{};
+	journal.ForEachPending([&](auto const& entry) { entries.push_back(entry); });
+	return entries;
+}
+
+// Uncommitted entries are replayed in order; a torn or corrupt tail is cut
+// off; committed entries are gone from the file.
+void TestJournal()
+{
+	auto path = TempDir() + "/journal";
+	auto metrics = Metrics{};
+	auto const interval = ::std::chrono::milliseconds{10};
+	auto const entries = ::std::vector<AttendanceJournal::Entry>{
+		{1, 100, false}, {2, 100, false}, {1, 100, true}};
+	{
+		auto journal = AttendanceJournal{path, Failing(), metrics, interval, 100};
+		journal.Append(entries);
+		journal.Sync();
+	}
+	{
+		auto journal = AttendanceJournal{path, Failing(), metrics, interval, 100};
+		CHECK(Pending(journal) == entries);
+	}
+
+	// torn: half a record at the end
+	auto data = ReadFile(path);
+	WriteFile(path, data + data.substr(0, 7));
+	{
+		auto journal = AttendanceJournal{path, Failing(), metrics, interval, 100};
+		CHECK(Pending(journal) == entries);
+	}
+	CHECK(ReadFile(path) == data);
+
+	// corrupt: a flipped bit in the second record
+	auto record = data.size() / entries.size();
+	data[record + 8] ^= 1;
+	WriteFile(path, data);
+	{
+		auto journal = AttendanceJournal{path, Failing(), metrics, interval, 100};
+		CHECK(Pending(journal) == ::std::vector<AttendanceJournal::Entry>{entries[0]});
+	}
+	CHECK(ReadFile(path).size() == record);
+
+	auto committed = ::std::vector<AttendanceJournal::Entry>{};
+	{
+		auto journal = AttendanceJournal{path, [&](auto const& batch) {
+			committed.insert(committed.end(), batch.begin(), batch.end());
+		}, metrics, interval, 100};
+		for (auto i = 0; i < 500 && journal.PendingCount(); ++i) {
+			::std::this_thread::sleep_for(interval);
+		}
+		CHECK(!journal.PendingCount());
+	}
+	CHECK(committed == ::std::vector<AttendanceJournal::Entry>{entries[0]});
+	CHECK(ReadFile(path).empty());
+}
+
+} // namespace
+
+int main()
+{
+	TestLogReopen();
+	TestLogCorruptTail();
+	TestLogCompaction();
+	TestJournal();
+	::std::puts("ok");
+	return 0;
+}
+
+// vim: set ts=4 sw=4 noet :